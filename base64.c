@@ -8,6 +8,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#define BASE64_SSSE3 1
+#include <tmmintrin.h>
+#endif
 
 #include "base64.h"
 
@@ -17,6 +25,177 @@ static const unsigned char base64_table[65] =
 static const unsigned char base64_urlsafe_table[65] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
+static unsigned char dtable[256];
+
+static const unsigned char* base64_dtable(void)
+{
+    if (!dtable[0]) {
+        memset(dtable, 0x80, 256);
+        for (size_t i = 0; i < sizeof(base64_table) - 1; i++) {
+            dtable[base64_table[i]] = (unsigned char)i;
+            if (base64_urlsafe_table[i] != base64_table[i]) {
+                dtable[base64_urlsafe_table[i]] = (unsigned char)i;
+            }
+        }
+        dtable['='] = 0;
+    }
+    return dtable;
+}
+
+/*
+ * The vector codecs handle whole blocks from the front of the input and
+ * return how much they consumed; the table code finishes the rest, so the
+ * output is identical. Decoding stops at the first block holding anything
+ * outside the alphabet ('=' included) and leaves it to the table code.
+ */
+#if BASE64_NEON
+
+static size_t base64_simd_encode(const unsigned char *table, const unsigned char *src, size_t len, unsigned char *out)
+{
+    const uint8x16x4_t lut = {{vld1q_u8(table), vld1q_u8(table + 16), vld1q_u8(table + 32), vld1q_u8(table + 48)}};
+    const uint8x16_t mask = vdupq_n_u8(0x3f);
+    size_t i = 0;
+    for (; len - i >= 48; i += 48) {
+        uint8x16x3_t in = vld3q_u8(src + i);
+        uint8x16x4_t idx;
+        idx.val[0] = vshrq_n_u8(in.val[0], 2);
+        idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+        idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+        idx.val[3] = vandq_u8(in.val[2], mask);
+        uint8x16x4_t enc;
+        for (int j = 0; j < 4; j++) {
+            enc.val[j] = vqtbl4q_u8(lut, idx.val[j]);
+        }
+        vst4q_u8(out + i / 3 * 4, enc);
+    }
+    return i;
+}
+
+static size_t base64_simd_decode(const char *src, size_t len, unsigned char *out)
+{
+    const unsigned char *d = base64_dtable();
+    unsigned char t[128];
+    memcpy(t, d, sizeof(t));
+    t['='] = 0x80;
+    const uint8x16x4_t lo = {{vld1q_u8(t), vld1q_u8(t + 16), vld1q_u8(t + 32), vld1q_u8(t + 48)}};
+    const uint8x16x4_t hi = {{vld1q_u8(t + 64), vld1q_u8(t + 80), vld1q_u8(t + 96), vld1q_u8(t + 112)}};
+    const uint8x16_t flip = vdupq_n_u8(0x40);
+    const uint8x16_t ascii = vdupq_n_u8(0x7f);
+    size_t i = 0;
+    // always leave the last group, and its padding, to the table code
+    for (; i + 64 < len; i += 64) {
+        uint8x16x4_t in = vld4q_u8((const uint8_t*)src + i);
+        uint8x16x4_t v;
+        uint8x16_t bad = vdupq_n_u8(0);
+        for (int j = 0; j < 4; j++) {
+            // out of range table indexes give 0, so each half only answers for its own 64 characters
+            v.val[j] = vorrq_u8(vqtbl4q_u8(lo, in.val[j]), vqtbl4q_u8(hi, veorq_u8(in.val[j], flip)));
+            bad = vorrq_u8(bad, vorrq_u8(v.val[j], vcgtq_u8(in.val[j], ascii)));
+        }
+        if (vmaxvq_u8(bad) & 0x80) {
+            break;
+        }
+        uint8x16x3_t dec;
+        dec.val[0] = vorrq_u8(vshlq_n_u8(v.val[0], 2), vshrq_n_u8(v.val[1], 4));
+        dec.val[1] = vorrq_u8(vshlq_n_u8(v.val[1], 4), vshrq_n_u8(v.val[2], 2));
+        dec.val[2] = vorrq_u8(vshlq_n_u8(v.val[2], 6), v.val[3]);
+        vst3q_u8(out + i / 4 * 3, dec);
+    }
+    return i;
+}
+
+#elif BASE64_SSSE3
+
+static size_t base64_simd_encode(const unsigned char *table, const unsigned char *src, size_t len, unsigned char *out)
+{
+    // offsets from each 6-bit value to its character, by range
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            (char)(table[62] - 62), (char)(table[63] - 63), 'A', 0, 0);
+    size_t i = 0;
+    // 12 bytes in per 16 out, but the load reads 16
+    for (; len - i >= 16; i += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(t1, t3);
+
+        __m128i r = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), indices);
+        _mm_storeu_si128((__m128i*)(out + i / 3 * 4), r);
+    }
+    return i;
+}
+
+static inline __m128i in_range(__m128i c, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), c));
+}
+
+static inline __m128i is_char(__m128i c, char x)
+{
+    return _mm_cmpeq_epi8(c, _mm_set1_epi8(x));
+}
+
+static size_t base64_simd_decode(const char *src, size_t len, unsigned char *out)
+{
+    size_t i = 0;
+    // always leave the last group, and its padding, to the table code
+    for (; i + 16 < len; i += 16) {
+        const __m128i c = _mm_loadu_si128((const __m128i*)(src + i));
+        // bytes >= 0x80 are negative, and fall outside every range
+        const __m128i upper = in_range(c, 'A', 'Z');
+        const __m128i lower = in_range(c, 'a', 'z');
+        const __m128i digit = in_range(c, '0', '9');
+        const __m128i plus = is_char(c, '+');
+        const __m128i minus = is_char(c, '-');
+        const __m128i slash = is_char(c, '/');
+        const __m128i underscore = is_char(c, '_');
+        const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+                                           _mm_or_si128(_mm_or_si128(minus, slash), underscore));
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+        __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+        shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+        shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+        shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+        shift = _mm_or_si128(shift, _mm_and_si128(minus, _mm_set1_epi8(62 - '-')));
+        shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+        shift = _mm_or_si128(shift, _mm_and_si128(underscore, _mm_set1_epi8(63 - '_')));
+        const __m128i v = _mm_add_epi8(c, shift);
+
+        // pack four 6-bit values into three bytes per 32-bit lane
+        const __m128i ab_bc = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        __m128i packed = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+        packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        unsigned char *pos = out + i / 4 * 3;
+        _mm_storel_epi64((__m128i*)pos, packed);
+        uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        memcpy(pos + 8, &tail, sizeof(tail));
+    }
+    return i;
+}
+
+#else
+
+static size_t base64_simd_encode(const unsigned char *table, const unsigned char *src, size_t len, unsigned char *out)
+{
+    return 0;
+}
+
+static size_t base64_simd_decode(const char *src, size_t len, unsigned char *out)
+{
+    return 0;
+}
+
+#endif
+
 /**
  * base64_encode - Base64 encode
  * @src: Data to be encoded
@@ -41,9 +220,10 @@ char* base64_table_encode(const unsigned char *table, const unsigned char *src,
         return NULL;
     }
 
+    size_t done = base64_simd_encode(table, src, len, out);
     const unsigned char *end = src + len;
-    const unsigned char *in = src;
-    unsigned char *pos = out;
+    const unsigned char *in = src + done;
+    unsigned char *pos = out + done / 3 * 4;
     while (end - in >= 3) {
         *pos++ = table[in[0] >> 2];
         *pos++ = table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
@@ -92,17 +272,7 @@ char* base64_urlsafe_encode(const unsigned char *src, size_t len, size_t *out_le
  */
 unsigned char* base64_decode(const char *src, size_t len, size_t *out_len)
 {
-    static unsigned char dtable[256] = {0};
-    if (!dtable[0]) {
-        memset(dtable, 0x80, 256);
-        for (size_t i = 0; i < sizeof(base64_table) - 1; i++) {
-            dtable[base64_table[i]] = (unsigned char)i;
-            if (base64_urlsafe_table[i] != base64_table[i]) {
-                dtable[base64_urlsafe_table[i]] = (unsigned char)i;
-            }
-        }
-        dtable['='] = 0;
-    }
+    const unsigned char *dtable = base64_dtable();
 
     size_t count = DIV_ROUND_UP(len, 4);
     size_t plen = count * 4;
@@ -111,12 +281,13 @@ unsigned char* base64_decode(const char *src, size_t len, size_t *out_len)
     if (!out) {
         return NULL;
     }
-    unsigned char *pos = out;
+    size_t done = base64_simd_decode(src, len, out);
+    unsigned char *pos = out + done / 4 * 3;
 
     count = 0;
     unsigned char in[4];
     unsigned char block[4];
-    for (size_t i = 0; i < plen; i++) {
+    for (size_t i = done; i < plen; i++) {
         char c = (i < len) ? src[i] : '=';
         unsigned char tmp = dtable[(unsigned char)c];
         if (tmp == 0x80) {
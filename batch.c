@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <netdb.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "batch.h"
+
+
+// each URL in a batch is replayed through our own http handler over a
+// socketpair, as if the peer had asked for it alone, so injectors fetch and
+// sign and peers serve from cache or their own peers exactly as they would
+// for a single request. the responses go back in request order as frames in
+// one chunked reply.
+
+typedef struct batch batch;
+
+typedef struct {
+    batch *b;
+    evhttp_connection *evcon;
+    evbuffer *frame;
+} batch_item;
+
+struct batch {
+    network *n;
+    evhttp_request *server_req;
+    size_t num_items;
+    size_t next_item;
+    batch_item items[BATCH_MAX];
+};
+
+
+void batch_free(batch *b)
+{
+    for (size_t i = 0; i < b->num_items; i++) {
+        batch_item *item = &b->items[i];
+        if (item->evcon) {
+            evhttp_connection_free(item->evcon);
+        }
+        if (item->frame) {
+            evbuffer_free(item->frame);
+        }
+    }
+    free(b);
+}
+
+void batch_flush(batch *b)
+{
+    while (b->next_item < b->num_items && b->items[b->next_item].frame) {
+        batch_item *item = &b->items[b->next_item++];
+        evhttp_send_reply_chunk(b->server_req, item->frame);
+        evbuffer_free(item->frame);
+        item->frame = NULL;
+    }
+    if (b->next_item < b->num_items) {
+        return;
+    }
+    debug("batch:%p done items:%zu\n", b, b->num_items);
+    if (b->server_req->evcon) {
+        evhttp_connection_set_closecb(b->server_req->evcon, NULL, NULL);
+    }
+    evhttp_send_reply_end(b->server_req);
+    batch_free(b);
+}
+
+void batch_item_frame(batch_item *item, int code, evkeyvalq *headers, evbuffer *body)
+{
+    evbuffer *head = evbuffer_new();
+    if (headers) {
+        const char *hop_by_hop[] = {"Connection", "Content-Length", "Transfer-Encoding", "Keep-Alive"};
+        evkeyval *header;
+        TAILQ_FOREACH(header, headers, next) {
+            bool skip = false;
+            for (size_t i = 0; i < lenof(hop_by_hop); i++) {
+                skip |= !strcasecmp(header->key, hop_by_hop[i]);
+            }
+            if (!skip) {
+                evbuffer_add_printf(head, "%s: %s\r\n", header->key, header->value);
+            }
+        }
+    }
+    size_t body_length = body ? evbuffer_get_length(body) : 0;
+    if (evbuffer_get_length(head) > UINT16_MAX || body_length > BATCH_ITEM_MAX) {
+        evbuffer_drain(head, evbuffer_get_length(head));
+        code = 502;
+        body_length = 0;
+    }
+    batch_frame f = {
+        .code = htons(code),
+        .head_length = htons((uint16_t)evbuffer_get_length(head)),
+        .body_length = htonl((uint32_t)body_length)
+    };
+    item->frame = evbuffer_new();
+    evbuffer_add(item->frame, &f, sizeof(f));
+    evbuffer_add_buffer(item->frame, head);
+    evbuffer_free(head);
+    if (body_length) {
+        evbuffer_add_buffer(item->frame, body);
+    }
+}
+
+void batch_item_done(batch_item *item, int code, evkeyvalq *headers, evbuffer *body)
+{
+    batch_item_frame(item, code, headers, body);
+    evhttp_connection_free(item->evcon);
+    item->evcon = NULL;
+    batch_flush(item->b);
+}
+
+void batch_item_done_cb(evhttp_request *req, void *arg)
+{
+    batch_item *item = (batch_item*)arg;
+    if (!req) {
+        // batch_item_error_cb
+        return;
+    }
+    if (!req->response_code) {
+        batch_item_done(item, 502, NULL, NULL);
+        return;
+    }
+    batch_item_done(item, req->response_code, req->input_headers, req->input_buffer);
+}
+
+void batch_item_error_cb(evhttp_request_error error, void *arg)
+{
+    batch_item *item = (batch_item*)arg;
+    debug("batch:%p item:%zu error %d %s\n", item->b, (size_t)(item - item->b->items), error, evhttp_request_error_str(error));
+    // too long included; that one is better off as a request of its own
+    batch_item_done(item, 502, NULL, NULL);
+}
+
+bool batch_item_start(batch_item *item, const char *url, const sockaddr *addr, socklen_t addrlen)
+{
+    batch *b = item->b;
+    evhttp_uri *uri = evhttp_uri_parse(url);
+    const char *host = uri ? evhttp_uri_get_host(uri) : NULL;
+    int fds[2];
+    if (!host || socketpair(PF_LOCAL, SOCK_STREAM, 0, fds)) {
+        if (uri) {
+            evhttp_uri_free(uri);
+        }
+        return false;
+    }
+    evutil_make_socket_closeonexec(fds[0]);
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_closeonexec(fds[1]);
+    evutil_make_socket_nonblocking(fds[1]);
+    // looks like the peer asked for it directly
+    evhttp_get_request(b->n->http, fds[0], (sockaddr *)addr, addrlen);
+
+    int port = evhttp_uri_get_port(uri);
+    bufferevent *bev = bufferevent_socket_new(b->n->evbase, fds[1], BEV_OPT_CLOSE_ON_FREE);
+    item->evcon = evhttp_connection_base_bufferevent_new(b->n->evbase, NULL, bev, host, port == -1 ? 80 : port);
+    evhttp_connection_set_max_body_size(item->evcon, BATCH_ITEM_MAX);
+
+    evhttp_request *req = evhttp_request_new(batch_item_done_cb, item);
+    evhttp_request_set_error_cb(req, batch_item_error_cb);
+    copy_header(b->server_req, req, "Via");
+    copy_header(b->server_req, req, "X-HashRequest");
+    copy_header(b->server_req, req, "X-Leaf-Sizes");
+    char authority[NI_MAXHOST + sizeof(":65535")];
+    snprintf(authority, sizeof(authority), port == -1 ? "%s" : "%s:%d", host, port);
+    evhttp_add_header(req->output_headers, "Host", authority);
+    evhttp_uri_free(uri);
+    evhttp_make_request(item->evcon, req, EVHTTP_REQ_GET, url);
+    return true;
+}
+
+void batch_evcon_close_cb(evhttp_connection *evcon, void *ctx)
+{
+    batch *b = (batch*)ctx;
+    debug("batch:%p evcon:%p %s\n", b, evcon, __func__);
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+    // freeing the item connections drops their requests without calling back
+    batch_free(b);
+}
+
+bool batch_request(network *n, evhttp_request *req)
+{
+    if (req->type != EVHTTP_REQ_POST || !streq(evhttp_request_get_uri(req), BATCH_PATH) ||
+        !evhttp_find_header(req->input_headers, "X-Batch")) {
+        return false;
+    }
+    batch *b = alloc(batch);
+    b->n = n;
+    b->server_req = req;
+
+    sockaddr_storage addr;
+    socklen_t addrlen = evcon_peer_sockaddr(req->evcon, &addr);
+    char *line;
+    while (b->num_items < BATCH_MAX && (line = evbuffer_readln(req->input_buffer, NULL, EVBUFFER_EOL_CRLF))) {
+        if (*line) {
+            batch_item *item = &b->items[b->num_items++];
+            item->b = b;
+            if (!batch_item_start(item, line, (const sockaddr *)&addr, addrlen)) {
+                batch_item_frame(item, 400, NULL, NULL);
+            }
+        }
+        free(line);
+    }
+    if (!b->num_items) {
+        free(b);
+        evhttp_send_error(req, 400, "Bad Request");
+        return true;
+    }
+    debug("batch:%p from %s items:%zu\n", b, sockaddr_str((const sockaddr *)&addr), b->num_items);
+
+    evhttp_connection_set_closecb(req->evcon, batch_evcon_close_cb, b);
+    evhttp_add_header(req->output_headers, "X-Batch", "1");
+    evhttp_send_reply_start(req, 200, "OK");
+    batch_flush(b);
+    return true;
+}
+
+int batch_frame_read(evbuffer *in, int *code, evkeyvalq *headers, evbuffer *body)
+{
+    batch_frame f;
+    if (evbuffer_copyout(in, &f, sizeof(f)) < (ev_ssize_t)sizeof(f)) {
+        return 0;
+    }
+    uint16_t head_length = ntohs(f.head_length);
+    uint32_t body_length = ntohl(f.body_length);
+    if (body_length > BATCH_ITEM_MAX) {
+        return -1;
+    }
+    if (evbuffer_get_length(in) < sizeof(f) + head_length + body_length) {
+        return 0;
+    }
+    evbuffer_drain(in, sizeof(f));
+    *code = ntohs(f.code);
+
+    char *head = malloc(head_length + 1);
+    evbuffer_remove(in, head, head_length);
+    head[head_length] = '\0';
+    int res = 1;
+    for (char *line = head; *line; ) {
+        char *end = strstr(line, "\r\n");
+        char *value = strchr(line, ':');
+        if (!end || !value || value > end) {
+            res = -1;
+            break;
+        }
+        *end = '\0';
+        *value++ = '\0';
+        value += strspn(value, " ");
+        evhttp_add_header(headers, line, value);
+        line = end + 2;
+    }
+    free(head);
+    evbuffer_remove_buffer(in, body, body_length);
+    return res;
+}
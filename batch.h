@@ -0,0 +1,24 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "network.h"
+#include "http.h"
+
+// POST here with X-Batch and one URL per line, get back a signed response per URL, in order
+#define BATCH_PATH "/.batch"
+#define BATCH_MAX 32
+// bigger responses are left to a request of their own, which can use ranges and multiple peers
+#define BATCH_ITEM_MAX (256 * 1024)
+
+// followed by head_length bytes of "Key: value\r\n" headers, then the body
+typedef struct {
+    uint16_t code;
+    uint16_t head_length;
+    uint32_t body_length;
+} PACKED batch_frame;
+
+bool batch_request(network *n, evhttp_request *req);
+// 1 and the next item, 0 until a whole frame has arrived, -1 if it's malformed
+int batch_frame_read(evbuffer *in, int *code, evkeyvalq *headers, evbuffer *body);
+
+#endif // __BATCH_H__
@@ -94,7 +94,7 @@ function build_android {
 
     rm *.o || true
     $CC $CFLAGS -c dht/dht.c -o dht_dht.o
-    for file in android.c bev_splice.c base64.c client.c dht.c http.c log.c lsd.c \
+    for file in android.c bev_splice.c base64.c client.c dht.c http.c log.c lsd.c mux.c batch.c gossip.c \
                 icmp_handler.c hash_table.c merkle_tree.c network.c obfoo.c sha1.c thread.c timer.c utp_bufferevent.c \
                 bugsnag/bugsnag_ndk.c \
                 bugsnag/bugsnag_ndk_report.c \
@@ -55,7 +55,7 @@ function build_apple {
     rm -rf $TRIPLE || true
     rm *.o || true
     clang $CFLAGS -c dht/dht.c -o dht_dht.o
-    for file in bev_splice.c base64.c client.c dht.c d2d.c http.c log.c lsd.c \
+    for file in bev_splice.c base64.c client.c dht.c d2d.c http.c log.c lsd.c mux.c batch.c gossip.c \
                 icmp_handler.c hash_table.c merkle_tree.c network.c \
                 obfoo.c sha1.c timer.c thread.c utp_bufferevent.c; do
         clang $CFLAGS $LIBUTP_CFLAGS $LIBEVENT_CFLAGS $LIBSODIUM_CFLAGS $LIBBUGSNAG_CFLAGS -c $file
@@ -77,7 +77,7 @@ echo -e "#include <math.h>\nint main() { log(2); }"|clang -x c - 2>/dev/null ||
 
 rm *.o || true
 clang $CFLAGS -c dht/dht.c -o dht_dht.o
-for file in backtrace.c client.c client_main.c d2d.c injector.c dht.c bev_splice.c base64.c http.c log.c lsd.c icmp_handler.c hash_table.c \
+for file in backtrace.c client.c client_main.c d2d.c injector.c dht.c bev_splice.c base64.c http.c log.c lsd.c mux.c batch.c gossip.c icmp_handler.c hash_table.c \
             merkle_tree.c network.c obfoo.c sha1.c stall_detector.c timer.c thread.c utp_bufferevent.c; do
     clang $CFLAGS $LIBUTP_CFLAGS $LIBEVENT_CFLAGS $LIBSODIUM_CFLAGS $LIBBLOCKSRUNTIME_CFLAGS -c $file
 done
@@ -27,6 +27,9 @@
 #include "d2d.h"
 #include "utp.h"
 #include "http.h"
+#include "mux.h"
+#include "batch.h"
+#include "gossip.h"
 #include "timer.h"
 #include "obfoo.h"
 #include "thread.h"
@@ -45,18 +48,12 @@
 
 #define NO_DIRECT 0
 #define NO_CACHE 0
-
-typedef struct {
-    in_addr_t ip;
-    port_t port;
-} PACKED packed_ipv4;
-static_assert(sizeof(packed_ipv4) == 6, "packed_ipv4 should be 6 bytes");
-
-typedef struct {
-    in6_addr ip;
-    port_t port;
-} PACKED packed_ipv6;
-static_assert(sizeof(packed_ipv4) == 6, "packed_ipv6 should be 18 bytes");
+// maximum number of requests with an outstanding hedge at once
+#define HEDGE_BUDGET 4
+// verified X-MSign values remembered
+#define VERIFIED_SIGS_MAX 1024
+// only peers verified this recently are passed on to others
+#define GOSSIP_PEER_AGE (24 * 60 * 60)
 
 typedef struct {
     sockaddr_storage addr;
@@ -72,10 +69,16 @@ typedef struct {
     peer *peer;
     bufferevent *bev;
     evhttp_connection *evcon;
+    // parked in peer_connections with a finished handshake
+    time_t idle_since;
+    // us_clock() when a handshake started, 0 if there was nothing to time
+    uint64_t connect_start;
 } peer_connection;
 
 typedef struct {
     bool failed:1;
+    // coarse, so peers within a factor of two still rotate by the timestamps below
+    uint8_t rtt_bucket;
     int64_t last_connect_attempt;
     int64_t time_since_verified;
     bool never_connected:1;
@@ -89,35 +92,60 @@ typedef struct {
 
 typedef bool (^peer_filter)(peer *p);
 typedef void (^peer_connected)(peer_connection *p);
+
+struct peer_request;
+typedef struct peer_request peer_request;
+struct peer_batch;
+typedef struct peer_batch peer_batch;
+
 typedef struct pending_request {
     char *via;
     peer_connected on_connect;
+    // set when waiting for a peer on behalf of a peer_request, which may join a batch
+    peer_request *peer_req;
     TAILQ_ENTRY(pending_request) next;
 } pending_request;
 
 struct proxy_request;
 typedef struct proxy_request proxy_request;
 
+// leaves hashed per pool job, when that many have already arrived
+#define HASH_BATCH 8
+
 typedef struct {
     uint64_t start;
     uint64_t end;
     uint64_t chunk_index;
     evbuffer *chunk_buffer;
+    // one job hashes on the pool at a time, so chunks complete in order
+    work_queue *hashing;
+    // the chunks after chunk_index that were hashed in the same job
+    evbuffer *ahead[HASH_BATCH - 1];
+    uint8_t ahead_hash[HASH_BATCH - 1][crypto_generichash_BYTES];
+    uint8_t ahead_len;
+    uint8_t ahead_next;
+    // the response finished while a chunk was hashing
+    evhttp_request *finished_req;
 } chunked_range;
 
-typedef struct {
+struct peer_request {
     pending_request r;
     peer_connection *pc;
     evhttp_request *req;
     proxy_request *p;
     chunked_range range;
-} peer_request;
+    // waiting on its item of a batch instead of req
+    peer_batch *batch;
+    // when this route was started, for its own time to first byte
+    uint64_t start_time;
+};
 
 typedef struct {
     evhttp_request *req;
     evhttp_connection *evcon;
     proxy_request *p;
     chunked_range range;
+    uint64_t start_time;
 } direct_request;
 
 struct proxy_request {
@@ -154,12 +182,22 @@ struct proxy_request {
     uint64_t content_length;
     uint64_t total_length;
     uint64_t byte_playhead;
+    uint32_t leaf_size;
     bool *have_bitfield;
 
+    timer *hedge_timer;
+
     bool chunked:1;
     bool merkle_tree_finished:1;
     bool dont_free:1;
     bool localhost:1;
+    // whoever asked can hash with an X-Leaf-Size other than LEAF_CHUNK_SIZE
+    bool leaf_sizes:1;
+    bool got_header:1;
+    bool hedged:1;
+    // counted in hedges_outstanding until the first route answers
+    bool hedge_pending:1;
+    bool unbatched:1;
 };
 
 typedef struct {
@@ -178,18 +216,122 @@ typedef struct {
     uint64_t to_p2p;
 } byte_counts;
 
+#define TTFB_SAMPLES 32
+#define TTFB_DEFAULT_MS 2000
+
+typedef struct {
+    uint32_t samples[TTFB_SAMPLES];
+    uint8_t next;
+    uint8_t count;
+} ttfb_history;
+
+typedef struct {
+    ttfb_history direct;
+    ttfb_history peer;
+    time_t last_used;
+} authority_latency;
+
+#define LATENCY_MAX 512
+#define LATENCY_KEEP (24 * 60 * 60)
+
+#define PEER_MUX_RETRY (60 * 60)
+
+// one multiplexed connection per injector or injector proxy
+typedef struct {
+    char *key;
+    mux *mux;
+    time_t failed;
+} peer_mux;
+
 hash_table *byte_count_per_authority;
+hash_table *latency_per_authority;
+hash_table *peer_muxes;
+
+#define BATCH_RETRY (60 * 60)
+
+struct peer_batch {
+    network *n;
+    peer_connection *pc;
+    evhttp_request *req;
+    size_t num_items;
+    size_t next_item;
+    // NULL once answered or cancelled
+    peer_request *items[BATCH_MAX];
+};
+
+// peers that answered a batch with something else
+typedef struct {
+    char *key;
+    time_t refused;
+} batch_refusal;
+
+hash_table *batch_refusals;
+uint hedges_outstanding;
 timer *stats_report_timer;
 network *g_n;
 uint64_t g_cid;
 bool g_stats_changed;
 
+// measured handshake times, kept apart from peer so the .dat layout stays put
+typedef struct {
+    char *key;
+    uint16_t rtt_ms;
+} peer_rtt;
+
+hash_table *peer_rtts;
+
+// saved injectors and injector proxies handshaked with at startup
+#define PROBE_MAX 32
+#define PROBE_CONCURRENCY 8
+#define PROBE_TIMEOUT_MS 3000
+
+typedef struct {
+    network *n;
+    peer *peer;
+    bufferevent *bev;
+    uint64_t start;
+    timer *timeout;
+} peer_probe;
+
+peer *probe_queue[PROBE_MAX];
+uint probe_queue_len;
+uint probe_queue_next;
+uint probes_outstanding;
+
 peer_array *injectors;
 peer_array *injector_proxies;
 peer_array *all_peers;
 
 peer_connection *peer_connections[20];
 
+// idle connections are kept ready per role, in proportion to the recent request rate
+#define POOL_INTERVAL_MS 5000
+// dropped one maintenance pass before the far end's evhttp times them out
+#define POOL_IDLE_MAX (HTTP_IDLE_TIMEOUT - POOL_INTERVAL_MS / 1000)
+// with no requests for this long, connections that time out are not replaced
+#define POOL_QUIET HTTP_IDLE_TIMEOUT
+// weight of the latest interval in the request rate
+#define POOL_RATE_ALPHA 0.25
+
+typedef enum {
+    POOL_INJECTOR,
+    POOL_INJECTOR_PROXY,
+    POOL_PEER,
+    POOL_ROLES
+} pool_role;
+
+timer *pool_timer;
+
+// further connection attempts start this far apart, until one finishes its handshake
+#define RACE_STAGGER_MS 250
+// most attempts in flight at once
+#define RACE_WIDTH 4
+
+timer *race_timer;
+// requests queued per POOL_INTERVAL_MS, averaged
+double pool_rate;
+uint pool_requests;
+
 char via_tag[] = "1.1 _.newnode";
 time_t injector_reachable;
 time_t last_request;
@@ -211,6 +353,16 @@ uint8_t encrypted_injector_proxy_swarm_p1[20];
 size_t pending_requests_len;
 TAILQ_HEAD(, pending_request) pending_requests;
 
+typedef struct verified_sig {
+    char *sign;
+    uint8_t content_hash[crypto_generichash_BYTES];
+    TAILQ_ENTRY(verified_sig) next;
+} verified_sig;
+
+hash_table *verified_sigs;
+size_t verified_sigs_len;
+TAILQ_HEAD(verified_sig_head, verified_sig) verified_sigs_lru = TAILQ_HEAD_INITIALIZER(verified_sigs_lru);
+
 
 void save_peers(network *n);
 
@@ -264,7 +416,7 @@ bool via_contains(const char *via, char v)
 bool bufferevent_is_utp(bufferevent *bev)
 {
     int fd = bufferevent_getfd(bev);
-    sockaddr_storage ss;
+    sockaddr_storage ss = {0};
     socklen_t len = sizeof(ss);
     getpeername(fd, (sockaddr *)&ss, &len);
     // AF_LOCAL is from socketpair(), which means utp
@@ -282,6 +434,7 @@ void on_utp_connect(network *n, peer_connection *pc)
     pc->evcon = evhttp_connection_base_bufferevent_new(n->evbase, n->evdns, pc->bev, host, sockaddr_get_port(ss));
     debug("on_utp_connect %s bev:%p evcon:%p\n", sockaddr_str(ss), pc->bev, pc->evcon);
     pc->bev = NULL;
+    pc->idle_since = time(NULL);
 
     // handle waiting requests first
     pending_request *r;
@@ -310,6 +463,8 @@ void on_utp_connect(network *n, peer_connection *pc)
     }
 }
 
+void peer_rtt_record(peer *p, uint64_t rtt_us);
+
 void bev_event_cb(bufferevent *bufev, short events, void *arg)
 {
     peer_connection *pc = (peer_connection *)arg;
@@ -334,6 +489,12 @@ void bev_event_cb(bufferevent *bufev, short events, void *arg)
         }
         free(pc);
     } else if (events & BEV_EVENT_CONNECTED) {
+        // ranks it ahead of the candidates that failed or are still trying
+        pc->peer->last_connect = time(NULL);
+        if (pc->connect_start) {
+            peer_rtt_record(pc->peer, us_clock() - pc->connect_start);
+            pc->connect_start = 0;
+        }
         on_utp_connect(pc->n, pc);
     }
 }
@@ -343,16 +504,100 @@ const char* peer_addr_str(const peer *p)
     return sockaddr_str((const sockaddr *)&p->addr);
 }
 
+bool peer_is_injector_proxy(peer *p)
+{
+    for (uint i = 0; i < injector_proxies->length; i++) {
+        if (injector_proxies->peers[i] == p) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bufferevent* peer_mux_open(network *n, peer *p, uint32_t crypto_provide, uint8_t priority)
+{
+    if (!peer_muxes) {
+        peer_muxes = hash_table_create();
+    }
+    const char *key = peer_addr_str(p);
+    peer_mux *pm = hash_get(peer_muxes, key);
+    if (!pm) {
+        pm = alloc(peer_mux);
+        pm->key = strdup(key);
+        hash_set(peer_muxes, pm->key, pm);
+    }
+    if (!pm->mux) {
+        if (time(NULL) - pm->failed < PEER_MUX_RETRY) {
+            return NULL;
+        }
+        utp_socket *s = utp_create_socket(n->utp);
+        // the mux only reads and writes the carrier, so it needs no socketpair
+        bufferevent *carrier = utp_socket_create_fdless_bev(n->evbase, s, (const sockaddr *)&p->addr, crypto_provide);
+        utp_connect(s, (const sockaddr*)&p->addr, sockaddr_get_length((const sockaddr*)&p->addr));
+        debug("peer_mux_open %s new mux\n", pm->key);
+        pm->mux = mux_connect(n, carrier, ^(bool established, bool refused) {
+            debug("peer_mux %s closed established:%d refused:%d\n", pm->key, established, refused);
+            pm->mux = NULL;
+            if (refused) {
+                // an older peer, or a broken one; use a connection per request for a while.
+                // a connection that merely failed says nothing about the mux, so try again next time
+                pm->failed = time(NULL);
+            }
+        });
+    }
+    return mux_open(pm->mux, priority);
+}
+
+void peer_connection_prioritize(peer_connection *pc, uint8_t priority)
+{
+    peer_mux *pm = peer_muxes ? hash_get(peer_muxes, peer_addr_str(pc->peer)) : NULL;
+    if (pm && pm->mux) {
+        mux_prioritize(pm->mux, pc->bev, priority);
+    }
+}
+
+bool peer_mux_ready(peer *p)
+{
+    peer_mux *pm = peer_muxes ? hash_get(peer_muxes, peer_addr_str(p)) : NULL;
+    return pm && pm->mux && mux_ready(pm->mux);
+}
+
+// a stream on the peer's mux if it takes one, otherwise a connection of its own
+bufferevent* peer_connect_bev(network *n, peer *p)
+{
+    // injectors pay the cipher cost for every peer byte, so offer them AES
+    uint32_t crypto_provide = OBFOO_CHACHA20;
+    if (peer_is_injector(p)) {
+        crypto_provide |= OBFOO_AES256_CTR;
+    }
+    if (lsd_null_cipher && lsd_is_lan_peer((const sockaddr *)&p->addr)) {
+        crypto_provide |= OBFOO_NULL;
+    }
+    bufferevent *bev = NULL;
+    if (peer_is_injector(p) || peer_is_injector_proxy(p)) {
+        // pooled until a request takes it and sets the priority
+        bev = peer_mux_open(n, p, crypto_provide, MUX_PRIORITY_DEFAULT);
+    }
+    if (!bev) {
+        utp_socket *s = utp_create_socket(n->utp);
+        bev = utp_socket_create_bev(n->evbase, s, (const sockaddr *)&p->addr, crypto_provide);
+        utp_connect(s, (const sockaddr*)&p->addr, sockaddr_get_length((const sockaddr*)&p->addr));
+    }
+    return bev;
+}
+
 peer_connection* evhttp_utp_connect(network *n, peer *p)
 {
-    utp_socket *s = utp_create_socket(n->utp);
     debug("evhttp_utp_connect %s\n", peer_addr_str(p));
     p->last_connect_attempt = time(NULL);
     peer_connection *pc = alloc(peer_connection);
     pc->n = n;
     pc->peer = p;
-    pc->bev = utp_socket_create_bev(n->evbase, s);
-    utp_connect(s, (const sockaddr*)&p->addr, sockaddr_get_length((const sockaddr*)&p->addr));
+    // a stream on an established mux connects at once, which says nothing about the path
+    if (!peer_mux_ready(p)) {
+        pc->connect_start = us_clock();
+    }
+    pc->bev = peer_connect_bev(n, p);
     bufferevent_setcb(pc->bev, NULL, NULL, bev_event_cb, pc);
     bufferevent_enable(pc->bev, EV_READ);
     return pc;
@@ -469,6 +714,30 @@ void add_sockaddr(network *n, const sockaddr *addr, socklen_t addrlen)
     add_address(n, &all_peers, addr, addrlen);
 }
 
+void gossip_sample_peers(gossip_sample *s)
+{
+    peer_array *lists[] = {injector_proxies, all_peers};
+    for (uint l = 0; l < lenof(lists); l++) {
+        for (uint i = 0; i < lists[l]->length; i++) {
+            peer *p = lists[l]->peers[i];
+            if (p->last_verified && time(NULL) - p->last_verified < GOSSIP_PEER_AGE) {
+                gossip_sample_offer(s, (const sockaddr *)&p->addr);
+            }
+        }
+    }
+}
+
+void peer_gossip_received(network *n, peer *from, evkeyvalq *headers)
+{
+    gossip_received((const sockaddr *)&from->addr, headers, ^bool(const sockaddr *addr, socklen_t addrlen) {
+        if (get_peer(all_peers, addr, addrlen)) {
+            return false;
+        }
+        add_sockaddr(n, addr, addrlen);
+        return true;
+    });
+}
+
 void dht_event_callback(void *closure, int event, const unsigned char *info_hash, const void *data, size_t data_len)
 {
     network *n = (network*)closure;
@@ -583,7 +852,7 @@ void proxy_cache_delete(proxy_request *p)
 bool proxy_request_any_direct(const proxy_request *p)
 {
     for (size_t i = 0; i < lenof(p->direct_requests); i++) {
-        if (p->direct_requests[i].req) {
+        if (p->direct_requests[i].req || work_queue_busy(p->direct_requests[i].range.hashing)) {
             return true;
         }
     }
@@ -593,18 +862,218 @@ bool proxy_request_any_direct(const proxy_request *p)
 bool proxy_request_any_peers(const proxy_request *p)
 {
     for (size_t i = 0; i < lenof(p->requests); i++) {
-        if (p->requests[i].req || p->requests[i].r.on_connect) {
+        if (p->requests[i].req || p->requests[i].r.on_connect || p->requests[i].batch ||
+            work_queue_busy(p->requests[i].range.hashing)) {
             return true;
         }
     }
     return false;
 }
 
+void chunked_range_cancel(chunked_range *r)
+{
+    work_queue_cancel(r->hashing);
+    r->hashing = NULL;
+    for (uint i = r->ahead_next; i < r->ahead_len; i++) {
+        evbuffer_free(r->ahead[i]);
+    }
+    r->ahead_len = r->ahead_next = 0;
+    if (r->finished_req) {
+        evhttp_request_free(r->finished_req);
+        r->finished_req = NULL;
+    }
+}
+
+uint64_t num_chunks(const proxy_request *p);
+uint64_t chunk_length(const proxy_request *p, uint64_t chunk_index);
+
+typedef struct {
+    evbuffer *chunks[HASH_BATCH];
+    uint8_t hashes[HASH_BATCH][crypto_generichash_BYTES];
+    size_t count;
+} hash_batch;
+
+// hashes r->chunk_buffer, and the whole chunks after it already in input, in one pool job
+void chunked_range_hash(proxy_request *p, chunked_range *r, evbuffer *input, void (^hashed)(const uint8_t *chunk_hash))
+{
+    // the pool owns the chunks until they're hashed
+    hash_batch *b = alloc(hash_batch);
+    b->chunks[b->count++] = r->chunk_buffer;
+    r->chunk_buffer = NULL;
+    // a chunked transfer only knows its length at the end, so only its current chunk is certain
+    for (uint64_t i = r->chunk_index + 1; !p->chunked && i < num_chunks(p) && b->count < lenof(b->chunks); i++) {
+        uint64_t len = chunk_length(p, i);
+        if (evbuffer_get_length(input) < len) {
+            break;
+        }
+        evbuffer *chunk = evbuffer_new();
+        evbuffer_remove_buffer(input, chunk, len);
+        b->chunks[b->count++] = chunk;
+    }
+    evbuffer *header = NULL;
+    if (!r->chunk_index) {
+        header = evbuffer_new();
+        evbuffer_add(header, evbuffer_pullup(p->header_buf, -1), evbuffer_get_length(p->header_buf));
+    }
+    if (!r->hashing) {
+        r->hashing = work_queue_new();
+    }
+    work_queue_submit(r->hashing, ^{
+        for (size_t i = 0; i < b->count; i++) {
+            crypto_generichash_state content_state;
+            crypto_generichash_init(&content_state, NULL, 0, crypto_generichash_BYTES);
+            if (!i && header) {
+                evbuffer_hash_update(header, &content_state);
+            }
+            evbuffer_hash_update(b->chunks[i], &content_state);
+            crypto_generichash_final(&content_state, b->hashes[i], crypto_generichash_BYTES);
+        }
+    }, ^(bool cancelled) {
+        if (header) {
+            evbuffer_free(header);
+        }
+        if (cancelled) {
+            for (size_t i = 0; i < b->count; i++) {
+                evbuffer_free(b->chunks[i]);
+            }
+            free(b);
+            return;
+        }
+        r->chunk_buffer = b->chunks[0];
+        for (size_t i = 1; i < b->count; i++) {
+            r->ahead[i - 1] = b->chunks[i];
+            memcpy(r->ahead_hash[i - 1], b->hashes[i], sizeof(r->ahead_hash[i - 1]));
+        }
+        r->ahead_len = (uint8_t)(b->count - 1);
+        r->ahead_next = 0;
+        uint8_t chunk_hash[crypto_generichash_BYTES];
+        memcpy(chunk_hash, b->hashes[0], sizeof(chunk_hash));
+        free(b);
+        hashed(chunk_hash);
+    });
+}
+
+// the current chunk, if it was hashed along with an earlier one
+bool chunked_range_take_ahead(chunked_range *r, uint8_t *chunk_hash)
+{
+    if (r->ahead_next == r->ahead_len) {
+        return false;
+    }
+    evbuffer_add_buffer(r->chunk_buffer, r->ahead[r->ahead_next]);
+    evbuffer_free(r->ahead[r->ahead_next]);
+    memcpy(chunk_hash, r->ahead_hash[r->ahead_next], crypto_generichash_BYTES);
+    r->ahead_next++;
+    if (r->ahead_next == r->ahead_len) {
+        r->ahead_len = r->ahead_next = 0;
+    }
+    return true;
+}
+
 double pdelta(proxy_request *p)
 {
     return (double)(us_clock() - p->start_time) / 1000.0;
 }
 
+int time_cmp(const void *a, const void *b)
+{
+    time_t x = *(const time_t*)a;
+    time_t y = *(const time_t*)b;
+    return (x > y) - (x < y);
+}
+
+// drop entries not updated within keep seconds, and if that leaves the table full, the oldest eighth
+void hash_trim(hash_table *h, size_t max, time_t keep, time_t (^updated)(const void *val))
+{
+    time_t cutoff = time(NULL) - keep;
+    size_t len = hash_length(h);
+    if (len >= max) {
+        time_t *times = malloc(len * sizeof(time_t));
+        __block size_t i = 0;
+        hash_iter(h, ^bool (const char *key, void *val) {
+            times[i++] = updated(val);
+            return true;
+        });
+        qsort(times, i, sizeof(time_t), time_cmp);
+        cutoff = MAX(cutoff, times[i / 8]);
+        free(times);
+    }
+    hash_iter(h, ^bool (const char *key, void *val) {
+        if (updated(val) <= cutoff) {
+            hash_remove(h, key);
+            free((char*)key);
+            free(val);
+        }
+        return true;
+    });
+}
+
+authority_latency* proxy_latency(const proxy_request *p)
+{
+    if (!latency_per_authority) {
+        latency_per_authority = hash_table_create();
+    }
+    authority_latency *l = hash_get(latency_per_authority, p->authority);
+    if (!l) {
+        if (hash_length(latency_per_authority) >= LATENCY_MAX) {
+            hash_trim(latency_per_authority, LATENCY_MAX, LATENCY_KEEP, ^time_t (const void *val) {
+                return ((const authority_latency*)val)->last_used;
+            });
+        }
+        l = alloc(authority_latency);
+        hash_set(latency_per_authority, strdup(p->authority), l);
+    }
+    l->last_used = time(NULL);
+    return l;
+}
+
+void ttfb_record(ttfb_history *h, uint32_t ms)
+{
+    h->samples[h->next] = ms;
+    h->next = (h->next + 1) % lenof(h->samples);
+    h->count = MIN(h->count + 1, lenof(h->samples));
+}
+
+int uint32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint32_t ttfb_p90(const ttfb_history *h)
+{
+    if (!h->count) {
+        return TTFB_DEFAULT_MS;
+    }
+    uint32_t sorted[TTFB_SAMPLES];
+    memcpy(sorted, h->samples, h->count * sizeof(sorted[0]));
+    qsort(sorted, h->count, sizeof(sorted[0]), uint32_cmp);
+    return sorted[h->count * 9 / 10];
+}
+
+void proxy_hedge_release(proxy_request *p)
+{
+    if (p->hedge_timer) {
+        timer_cancel(p->hedge_timer);
+        p->hedge_timer = NULL;
+    }
+    if (p->hedge_pending) {
+        p->hedge_pending = false;
+        hedges_outstanding--;
+    }
+}
+
+void proxy_got_header(proxy_request *p, ttfb_history *h, uint64_t route_start)
+{
+    // every route that gets this far counts, not just the winner, so a hedge doesn't skew the history
+    ttfb_record(h, (uint32_t)((us_clock() - route_start) / 1000));
+    if (p->got_header) {
+        return;
+    }
+    p->got_header = true;
+    proxy_hedge_release(p);
+}
+
 void proxy_send_error(proxy_request *p, int error, const char *reason)
 {
     if (proxy_request_any_direct(p) || proxy_request_any_peers(p)) {
@@ -638,7 +1107,7 @@ void proxy_request_cleanup(proxy_request *p, const char *reason)
         }
     }
     for (size_t i = 0; i < lenof(p->requests); i++) {
-        if (p->requests[i].req || p->requests[i].r.on_connect) {
+        if (p->requests[i].req || p->requests[i].r.on_connect || p->requests[i].batch) {
             num_peers++;
         }
     }
@@ -658,9 +1127,11 @@ void proxy_request_cleanup(proxy_request *p, const char *reason)
             r->pc = NULL;
         }
         assert(!r->range.chunk_buffer);
+        chunked_range_cancel(&r->range);
     }
     for (size_t i = 0; i < lenof(p->direct_requests); i++) {
         direct_request *d = &p->direct_requests[i];
+        chunked_range_cancel(&d->range);
         if (d->evcon) {
             evhttp_connection_free(d->evcon);
             d->evcon = NULL;
@@ -676,6 +1147,7 @@ void proxy_request_cleanup(proxy_request *p, const char *reason)
     if (p->header_buf) {
         evbuffer_free(p->header_buf);
     }
+    proxy_hedge_release(p);
     merkle_tree_free(p->m);
     free(p->have_bitfield);
     proxy_cache_delete(p);
@@ -694,6 +1166,7 @@ void peer_request_cleanup(peer_request *r, const char *reason)
         peer_disconnect(r->pc);
         r->pc = NULL;
     }
+    chunked_range_cancel(&r->range);
     if (r->range.chunk_buffer) {
         evbuffer_free(r->range.chunk_buffer);
         r->range.chunk_buffer = NULL;
@@ -716,7 +1189,8 @@ void peer_reuse(network *n, peer_connection *pc)
         pending_request_complete(r, pc);
         return;
     }
-    // add to the pool if there's a slot
+    pc->idle_since = time(NULL);
+    // add to the pool if there's a slot. pool_maintain trims it back to size
     for (uint i = 0; i < lenof(peer_connections); i++) {
         if (!peer_connections[i]) {
             debug("saving pc:%p for reuse\n", pc);
@@ -744,12 +1218,13 @@ void direct_request_cancel(direct_request *d)
         evhttp_cancel_request(d->req);
         d->req = NULL;
     }
+    chunked_range_cancel(&d->range);
 }
 
 void proxy_direct_requests_cancel(proxy_request *p)
 {
     for (size_t i = 0; i < lenof(p->direct_requests); i++) {
-        if (p->direct_requests[i].req) {
+        if (p->direct_requests[i].req || work_queue_busy(p->direct_requests[i].range.hashing)) {
             direct_request_cancel(&p->direct_requests[i]);
         }
     }
@@ -757,6 +1232,14 @@ void proxy_direct_requests_cancel(proxy_request *p)
 
 void peer_request_cancel(peer_request *r)
 {
+    if (r->batch) {
+        for (size_t i = 0; i < r->batch->num_items; i++) {
+            if (r->batch->items[i] == r) {
+                r->batch->items[i] = NULL;
+            }
+        }
+        r->batch = NULL;
+    }
     if (r->req) {
         debug("r:%p %s:%d p:%p\n", r, __func__, __LINE__, r->p);
         evhttp_cancel_request(r->req);
@@ -769,6 +1252,7 @@ void peer_request_cancel(peer_request *r)
         debug("r:%p %s:%d r->pc = NULL\n", r, __func__, __LINE__);
         r->pc = NULL;
     }
+    chunked_range_cancel(&r->range);
     if (r->range.chunk_buffer) {
         evbuffer_free(r->range.chunk_buffer);
         r->range.chunk_buffer = NULL;
@@ -828,29 +1312,29 @@ void copy_response_headers(evhttp_request *from, evhttp_request *to)
 
 uint64_t num_chunks(const proxy_request *p)
 {
-    return DIV_ROUND_UP(p->total_length, LEAF_CHUNK_SIZE);
+    return DIV_ROUND_UP(p->total_length, p->leaf_size);
 }
 
 uint64_t chunk_length(const proxy_request *p, uint64_t chunk_index)
 {
     if (p->chunked) {
-        return LEAF_CHUNK_SIZE;
+        return p->leaf_size;
     }
-    if ((chunk_index + 1) * LEAF_CHUNK_SIZE <= p->total_length) {
-        return LEAF_CHUNK_SIZE;
+    if ((chunk_index + 1) * p->leaf_size <= p->total_length) {
+        return p->leaf_size;
     }
-    return p->total_length % LEAF_CHUNK_SIZE;
+    return p->total_length % p->leaf_size;
 }
 
 void direct_submit_request(proxy_request *p);
 void direct_chunked_cb(evhttp_request *req, void *arg);
-void proxy_submit_request(proxy_request *p);
+peer_request* proxy_submit_request(proxy_request *p);
 
 void proxy_set_length(proxy_request *p, uint64_t total_length)
 {
     debug("%s p:%p total_length:%"PRIu64" num_chunks:%"PRIu64"\n", __func__, p, total_length, num_chunks(p));
     uint64_t old_length = num_chunks(p);
-    uint64_t old_chunks = DIV_ROUND_UP(old_length, LEAF_CHUNK_SIZE);
+    uint64_t old_chunks = DIV_ROUND_UP(old_length, p->leaf_size);
     p->total_length = total_length;
     if (!p->have_bitfield) {
         p->have_bitfield = calloc(1, num_chunks(p));
@@ -888,8 +1372,9 @@ int proxy_setup_range(proxy_request *p, evhttp_request *req, chunked_range *rang
     if (content_range) {
         debug("Content-Range: %s\n", content_range);
         sscanf(content_range, "bytes %"PRIu64"-%"PRIu64"/%"PRIu64, &range->start, &range->end, &total_length);
-        uint64_t header_prefix = p->header_buf ? evbuffer_get_length(p->header_buf) : 0;
-        range->chunk_index = (range->start + header_prefix) / LEAF_CHUNK_SIZE;
+        if (p->header_buf) {
+            range->chunk_index = (range->start + evbuffer_get_length(p->header_buf)) / p->leaf_size;
+        }
         debug("p:%p start:%"PRIu64" chunk_index:%"PRIu64"\n", p, range->start, range->chunk_index);
     } else if (content_length) {
         debug("Content-Length: %s\n", content_length);
@@ -916,9 +1401,19 @@ int proxy_setup_range(proxy_request *p, evhttp_request *req, chunked_range *rang
         }
         p->direct_code = code;
         p->direct_code_line = strdup(req->response_code_line);
+        if (!p->leaf_size) {
+            // straight from the origin: declare the leaf size the injector would
+            p->leaf_size = p->chunked || !p->leaf_sizes ? LEAF_CHUNK_SIZE : leaf_size_for_length(total_length);
+            if (p->leaf_size != LEAF_CHUNK_SIZE) {
+                char leaf_size[sizeof("4294967295")];
+                snprintf(leaf_size, sizeof(leaf_size), "%"PRIu32, p->leaf_size);
+                overwrite_kv_header(req->input_headers, "X-Leaf-Size", leaf_size);
+                overwrite_kv_header(&p->direct_headers, "X-Leaf-Size", leaf_size);
+            }
+        }
         p->header_buf = build_request_buffer(code, req->input_headers);
         uint64_t header_prefix = p->header_buf ? evbuffer_get_length(p->header_buf) : 0;
-        range->chunk_index = (range->start + header_prefix) / LEAF_CHUNK_SIZE;
+        range->chunk_index = (range->start + header_prefix) / p->leaf_size;
     }
 
     if (p->content_length && p->content_length != total_length) {
@@ -958,6 +1453,8 @@ int direct_header_cb(evhttp_request *req, void *arg)
         return -1;
     }
 
+    proxy_got_header(p, &proxy_latency(p)->direct, d->start_time);
+
     // TODO: to mix data from origin with peers, we still need to check hashes.
     // if direct data doesn't (or didn't) match, abort all peers. see MIX_DIRECT
     if (!p->server_req->response_code) {
@@ -972,6 +1469,13 @@ int direct_header_cb(evhttp_request *req, void *arg)
     proxy_peer_requests_cancel(p);
 
     d->evcon = req->evcon;
+    // the leaf size is only trusted when the injector signed it
+    while (evhttp_find_header(req->input_headers, "X-Leaf-Size")) {
+        evhttp_remove_header(req->input_headers, "X-Leaf-Size");
+    }
+    if (!p->header_buf) {
+        p->leaf_size = 0;
+    }
     copy_all_headers(req, p->server_req);
 
     evhttp_add_header(req->input_headers, "Content-Location", p->uri);
@@ -987,7 +1491,7 @@ int direct_header_cb(evhttp_request *req, void *arg)
         return res;
     }
 
-    if (req->type == EVHTTP_REQ_GET && p->total_length > LEAF_CHUNK_SIZE * 2) {
+    if (req->type == EVHTTP_REQ_GET && p->total_length > p->leaf_size * 2) {
         // if the server is capable of range requests, submit more requests
         const char *content_range = evhttp_find_header(req->input_headers, "Content-Range");
         const char *accept_ranges = evhttp_find_header(req->input_headers, "Accept-Ranges");
@@ -1045,7 +1549,7 @@ uint64_t proxy_new_range_start(const proxy_request *p)
         }
         debug("num_chunks:%"PRIu64" longest_run:%"PRIu64"-%"PRIu64"\n", num_chunks(p), longest_run[0], longest_run[1]);
         uint64_t mid = longest_run[0] + (longest_run[1] - longest_run[0]) / 2;
-        range_start = !mid ? mid : (mid * LEAF_CHUNK_SIZE - evbuffer_get_length(p->header_buf));
+        range_start = !mid ? mid : (mid * p->leaf_size - evbuffer_get_length(p->header_buf));
         debug("p:%p range_start:%"PRIu64" mid:%"PRIu64" header_buf:%zu\n", p, range_start, mid, evbuffer_get_length(p->header_buf));
 
         // maybe consider:
@@ -1110,179 +1614,250 @@ void proxy_request_reply_start(proxy_request *p, evhttp_request *req)
     }
 }
 
-bool direct_request_process_chunks(direct_request *d, evhttp_request *req)
+bool direct_request_got_chunk(direct_request *d, evhttp_request *req, const uint8_t *chunk_hash)
 {
     proxy_request *p = d->p;
     chunked_range *r = &d->range;
-    evbuffer *input = req->input_buffer;
-    debug("d:%p %s length:%zu\n", d, __func__, evbuffer_get_length(input));
+    uint64_t this_chunk_len = chunk_length(p, r->chunk_index);
+    uint64_t header_prefix = 0;
+    if (!r->chunk_index) {
+        header_prefix = evbuffer_get_length(p->header_buf);
+    }
 
-    if (!r->chunk_buffer) {
-        r->chunk_buffer = evbuffer_new();
+    if (p->have_bitfield[r->chunk_index]) {
+        // another range got it while this one was hashing
+        debug("d:%p duplicate chunk:%"PRIu64"\n", d, r->chunk_index);
+        return true;
     }
+    p->have_bitfield[r->chunk_index] = true;
 
-    for (;;) {
-        uint64_t this_chunk_len = chunk_length(p, r->chunk_index);
+    merkle_tree_set_leaf(p->m, r->chunk_index, chunk_hash);
 
-        uint64_t header_prefix = 0;
-        if (!r->chunk_index) {
-            header_prefix = evbuffer_get_length(p->header_buf);
+    if (evbuffer_get_length(r->chunk_buffer)) {
+        uint64_t this_chunk_offset = r->chunk_index * p->leaf_size;
+        if (r->chunk_index > 0) {
+            this_chunk_offset -= evbuffer_get_length(p->header_buf);
         }
-
-        uint64_t received = this_chunk_len - header_prefix - evbuffer_get_length(r->chunk_buffer);
-        evbuffer_remove_buffer(input, r->chunk_buffer, received);
-
-        if (p->chunked) {
-            // always keep the length optimistic. it will set accurately when the transfer finishes
-            proxy_set_length(p, p->byte_playhead + this_chunk_len * 2);
+        debug("d:%p writing offset:%"PRIu64" length:%zu\n", d, this_chunk_offset, evbuffer_get_length(r->chunk_buffer));
+        lseek(p->cache_file, this_chunk_offset, SEEK_SET);
+        if (!evbuffer_write_to_file(r->chunk_buffer, p->cache_file)) {
+            return false;
         }
+    }
 
-        debug("d:%p chunk_index:%"PRIu64"/%"PRIu64" %"PRIu64" < %"PRIu64"\n", d, r->chunk_index, num_chunks(p),
-            header_prefix + evbuffer_get_length(r->chunk_buffer), this_chunk_len);
-        if (header_prefix + evbuffer_get_length(r->chunk_buffer) < this_chunk_len) {
-            return true;
+    if (p->byte_playhead == r->chunk_index * p->leaf_size) {
+        debug("d:%p send chunk:%"PRIu64"/%"PRIu64" p->byte_playhead:%"PRIu64" (r->chunk_index * p->leaf_size):%"PRIu64"\n",
+              d, r->chunk_index, num_chunks(p), p->byte_playhead, r->chunk_index * p->leaf_size);
+        if (!p->byte_playhead) {
+            proxy_request_reply_start(p, req);
         }
+        if (p->server_req) {
+            evhttp_send_reply_chunk(p->server_req, r->chunk_buffer);
+        }
+        p->byte_playhead += this_chunk_len - header_prefix;
+    }
+    return true;
+}
 
-        debug("p->have_bitfield:%p r->chunk_index:%"PRIu64"\n", p->have_bitfield, r->chunk_index);
-        if (p->have_bitfield[r->chunk_index]) {
-            debug("d:%p duplicate chunk:%"PRIu64"\n", d, r->chunk_index);
-        } else {
-            debug("d:%p got chunk:%"PRIu64"\n", d, r->chunk_index);
-            p->have_bitfield[r->chunk_index] = true;
-
-            crypto_generichash_state content_state;
-            crypto_generichash_init(&content_state, NULL, 0, crypto_generichash_BYTES);
-
-            if (!r->chunk_index) {
-                evbuffer_hash_update(p->header_buf, &content_state);
-            }
-            evbuffer_hash_update(r->chunk_buffer, &content_state);
-
-            uint8_t chunk_hash[crypto_generichash_BYTES];
-            crypto_generichash_final(&content_state, chunk_hash, sizeof(chunk_hash));
-            
-            merkle_tree_set_leaf(p->m, r->chunk_index, chunk_hash);
-
-            if (evbuffer_get_length(r->chunk_buffer)) {
-                uint64_t this_chunk_offset = r->chunk_index * LEAF_CHUNK_SIZE;
-                if (r->chunk_index > 0) {
-                    this_chunk_offset -= evbuffer_get_length(p->header_buf);
-                }
-                debug("d:%p writing offset:%"PRIu64" length:%zu\n", d, this_chunk_offset, evbuffer_get_length(r->chunk_buffer));
-                lseek(p->cache_file, this_chunk_offset, SEEK_SET);
-                if (!evbuffer_write_to_file(r->chunk_buffer, p->cache_file)) {
-                    return false;
-                }
-            }
+// 1 to keep reading chunks, 0 to stop, -1 on failure
+int direct_request_next_chunk(direct_request *d, evhttp_request *req)
+{
+    proxy_request *p = d->p;
+    chunked_range *r = &d->range;
 
-            if (p->byte_playhead == r->chunk_index * LEAF_CHUNK_SIZE) {
-                debug("d:%p send chunk:%"PRIu64"/%"PRIu64" p->byte_playhead:%"PRIu64" (r->chunk_index * LEAF_CHUNK_SIZE):%"PRIu64"\n",
-                      d, r->chunk_index, num_chunks(p), p->byte_playhead, r->chunk_index * LEAF_CHUNK_SIZE);
-                if (!p->byte_playhead) {
-                    proxy_request_reply_start(p, req);
-                }
-                if (p->server_req) {
-                    evhttp_send_reply_chunk(p->server_req, r->chunk_buffer);
-                }
-                p->byte_playhead += this_chunk_len - header_prefix;
-            }
-        }
+    evbuffer_drain(r->chunk_buffer, evbuffer_get_length(r->chunk_buffer));
+    r->chunk_index++;
 
-        evbuffer_drain(r->chunk_buffer, evbuffer_get_length(r->chunk_buffer));
-        r->chunk_index++;
+    uint64_t c = p->byte_playhead;
+    while (c < p->total_length && p->have_bitfield[c / p->leaf_size]) {
+        c += p->leaf_size;
+    }
 
-        uint64_t c = p->byte_playhead;
-        while (c < p->total_length && p->have_bitfield[c / LEAF_CHUNK_SIZE]) {
-            c += LEAF_CHUNK_SIZE;
+    if (c > p->byte_playhead) {
+        off_t offset = p->byte_playhead - evbuffer_get_length(p->header_buf);
+        uint64_t length = c - p->byte_playhead;
+        debug("d:%p sending offset:%"PRIu64" length:%"PRIu64"\n", d, (uint64_t)offset, length);
+        evbuffer_file_segment *seg = evbuffer_file_segment_new(p->cache_file, offset, length, 0);
+        if (!seg) {
+            fprintf(stderr, "d:%p evbuffer_file_segment_new %d (%s)\n", d, errno, strerror(errno));
+            return -1;
         }
-
-        if (c > p->byte_playhead) {
-            off_t offset = p->byte_playhead - evbuffer_get_length(p->header_buf);
-            uint64_t length = c - p->byte_playhead;
-            debug("d:%p sending offset:%"PRIu64" length:%"PRIu64"\n", d, (uint64_t)offset, length);
-            evbuffer_file_segment *seg = evbuffer_file_segment_new(p->cache_file, offset, length, 0);
-            if (!seg) {
-                fprintf(stderr, "d:%p evbuffer_file_segment_new %d (%s)\n", d, errno, strerror(errno));
-                return false;
-            }
-            if (p->server_req) {
-                evbuffer *buf = evbuffer_new();
-                if (!evbuffer_add_file_segment(buf, seg, 0, length)) {
-                    evbuffer_file_segment_free(seg);
-                }
-                evhttp_send_reply_chunk(p->server_req, buf);
-                evbuffer_free(buf);
+        if (p->server_req) {
+            evbuffer *buf = evbuffer_new();
+            if (!evbuffer_add_file_segment(buf, seg, 0, length)) {
+                evbuffer_file_segment_free(seg);
             }
-            p->byte_playhead += length;
+            evhttp_send_reply_chunk(p->server_req, buf);
+            evbuffer_free(buf);
         }
+        p->byte_playhead += length;
+    }
 
-        debug("d:%p progress p->byte_playhead:%"PRIu64" p->total_length:%"PRIu64"\n", d, p->byte_playhead, p->total_length);
-        if (!p->chunked && p->byte_playhead == p->total_length) {
-            if (p->server_req) {
-                if (p->server_req->evcon) {
-                    evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
-                }
-                evhttp_send_reply_end(p->server_req);
-                p->server_req = NULL;
-                proxy_direct_requests_cancel(p);
-            }
-
-            //join_url_swarm(p->n, uri);
-            evhttp_uri *evuri = evhttp_uri_parse_with_flags(req->uri, EVHTTP_URI_NONCONFORMANT);
-            const char *host = evhttp_uri_get_host(evuri);
-            if (host) {
-                join_url_swarm(p->n, host);
+    debug("d:%p progress p->byte_playhead:%"PRIu64" p->total_length:%"PRIu64"\n", d, p->byte_playhead, p->total_length);
+    if (!p->chunked && p->byte_playhead == p->total_length) {
+        if (p->server_req) {
+            if (p->server_req->evcon) {
+                evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
             }
-            evhttp_uri_free(evuri);
-
-            merkle_tree_get_root(p->m, p->root_hash);
-
-            // submit a proxy-only request with If-None-Match: "base64(root_hash)" and let it cache
-            size_t b64_hash_len;
-            char *b64_hash = base64_urlsafe_encode((uint8_t*)&p->root_hash, sizeof(p->root_hash), &b64_hash_len);
-            char etag[2048];
-            snprintf(etag, sizeof(etag), "\"%s\"", b64_hash);
-            free(b64_hash);
-            debug("d:%p submitting a cache request %s\n", d, etag);
-            evhttp_add_header(&p->output_headers, "If-None-Match", etag);
-
-            proxy_submit_request(p);
-            return true;
+            evhttp_send_reply_end(p->server_req);
+            p->server_req = NULL;
+            proxy_direct_requests_cancel(p);
         }
 
-        assert(r->chunk_index <= num_chunks(p));
-        if (r->chunk_index >= num_chunks(p)) {
-            // done, let the connection close naturally
-            debug("d:%p done, let the connection close naturally\n", d);
-            return true;
-        }
-        if (!p->have_bitfield[r->chunk_index]) {
-            continue;
+        //join_url_swarm(p->n, uri);
+        evhttp_uri *evuri = evhttp_uri_parse_with_flags(req->uri, EVHTTP_URI_NONCONFORMANT);
+        const char *host = evhttp_uri_get_host(evuri);
+        if (host) {
+            join_url_swarm(p->n, host);
         }
+        evhttp_uri_free(evuri);
 
-        debug("d:%p terminating connection due to overlap\n", d);
-        return false;
+        merkle_tree_get_root(p->m, p->root_hash);
+
+        // submit a proxy-only request with If-None-Match: "base64(root_hash)" and let it cache
+        size_t b64_hash_len;
+        char *b64_hash = base64_urlsafe_encode((uint8_t*)&p->root_hash, sizeof(p->root_hash), &b64_hash_len);
+        char etag[2048];
+        snprintf(etag, sizeof(etag), "\"%s\"", b64_hash);
+        free(b64_hash);
+        debug("d:%p submitting a cache request %s\n", d, etag);
+        evhttp_add_header(&p->output_headers, "If-None-Match", etag);
+
+        proxy_submit_request(p);
+        return 0;
     }
-    return true;
-}
 
-void direct_chunked_cb(evhttp_request *req, void *arg)
-{
-    direct_request *d = (direct_request*)arg;
-    proxy_request *p = d->p;
-    if (!direct_request_process_chunks(d, req)) {
-        direct_request_cancel(d);
-        direct_submit_request(p);
+    assert(r->chunk_index <= num_chunks(p));
+    if (r->chunk_index >= num_chunks(p)) {
+        // done, let the connection close naturally
+        debug("d:%p done, let the connection close naturally\n", d);
+        return 0;
+    }
+    if (!p->have_bitfield[r->chunk_index]) {
+        return 1;
     }
+
+    debug("d:%p terminating connection due to overlap\n", d);
+    return -1;
 }
 
-void direct_error_cb(evhttp_request_error error, void *arg)
+void direct_request_chunk_hashed(direct_request *d, evhttp_request *req, const uint8_t *chunk_hash);
+bool direct_request_done(direct_request *d, evhttp_request *req);
+
+bool direct_request_process_chunks(direct_request *d, evhttp_request *req)
 {
-    direct_request *d = (direct_request*)arg;
+    proxy_request *p = d->p;
+    chunked_range *r = &d->range;
+    evbuffer *input = req->input_buffer;
+    debug("d:%p %s length:%zu\n", d, __func__, evbuffer_get_length(input));
+
+    if (work_queue_busy(r->hashing)) {
+        // picked up again when the chunk in flight is hashed
+        return true;
+    }
+
+    if (!r->chunk_buffer) {
+        r->chunk_buffer = evbuffer_new();
+    }
+
+    for (;;) {
+        uint8_t ahead_hash[crypto_generichash_BYTES];
+        bool hashed = chunked_range_take_ahead(r, ahead_hash);
+        if (!hashed) {
+            uint64_t this_chunk_len = chunk_length(p, r->chunk_index);
+
+            uint64_t header_prefix = 0;
+            if (!r->chunk_index) {
+                header_prefix = evbuffer_get_length(p->header_buf);
+            }
+
+            uint64_t received = this_chunk_len - header_prefix - evbuffer_get_length(r->chunk_buffer);
+            evbuffer_remove_buffer(input, r->chunk_buffer, received);
+
+            if (p->chunked) {
+                // always keep the length optimistic. it will set accurately when the transfer finishes
+                proxy_set_length(p, p->byte_playhead + this_chunk_len * 2);
+            }
+
+            debug("d:%p chunk_index:%"PRIu64"/%"PRIu64" %"PRIu64" < %"PRIu64"\n", d, r->chunk_index, num_chunks(p),
+                header_prefix + evbuffer_get_length(r->chunk_buffer), this_chunk_len);
+            if (header_prefix + evbuffer_get_length(r->chunk_buffer) < this_chunk_len) {
+                return true;
+            }
+        }
+
+        debug("p->have_bitfield:%p r->chunk_index:%"PRIu64"\n", p->have_bitfield, r->chunk_index);
+        if (p->have_bitfield[r->chunk_index]) {
+            debug("d:%p duplicate chunk:%"PRIu64"\n", d, r->chunk_index);
+        } else if (hashed) {
+            if (!direct_request_got_chunk(d, req, ahead_hash)) {
+                return false;
+            }
+        } else {
+            debug("d:%p got chunk:%"PRIu64"\n", d, r->chunk_index);
+            chunked_range_hash(p, r, input, ^(const uint8_t *chunk_hash) {
+                direct_request_chunk_hashed(d, req, chunk_hash);
+            });
+            return true;
+        }
+
+        int next = direct_request_next_chunk(d, req);
+        if (next <= 0) {
+            return next == 0;
+        }
+    }
+    return true;
+}
+
+void direct_request_chunk_hashed(direct_request *d, evhttp_request *req, const uint8_t *chunk_hash)
+{
+    proxy_request *p = d->p;
+    chunked_range *range = &d->range;
+    p->dont_free = true;
+    int next = -1;
+    if (direct_request_got_chunk(d, req, chunk_hash)) {
+        next = direct_request_next_chunk(d, req);
+    }
+    if (next > 0 && !direct_request_process_chunks(d, req)) {
+        next = -1;
+    }
+    evhttp_request *finished = NULL;
+    if (range->finished_req && !work_queue_busy(range->hashing)) {
+        // the transfer ended while this chunk was hashing
+        finished = range->finished_req;
+        range->finished_req = NULL;
+        if (!direct_request_done(d, finished)) {
+            finished = NULL;
+        }
+    } else if (next < 0) {
+        direct_request_cancel(d);
+        direct_submit_request(p);
+    }
+    p->dont_free = false;
+    proxy_request_cleanup(p, __func__);
+    if (finished) {
+        evhttp_request_free(finished);
+    }
+}
+
+void direct_chunked_cb(evhttp_request *req, void *arg)
+{
+    direct_request *d = (direct_request*)arg;
+    proxy_request *p = d->p;
+    if (!direct_request_process_chunks(d, req)) {
+        direct_request_cancel(d);
+        direct_submit_request(p);
+    }
+}
+
+void direct_error_cb(evhttp_request_error error, void *arg)
+{
+    direct_request *d = (direct_request*)arg;
     proxy_request *p = d->p;
     debug("d:%p direct_error_cb %d %s\n", d, error, evhttp_request_error_str(error));
     assert(d->req);
     d->req = NULL;
+    chunked_range_cancel(&d->range);
     if (error == EVREQ_HTTP_REQUEST_CANCEL) {
         return;
     }
@@ -1300,6 +1875,20 @@ void direct_request_done_cb(evhttp_request *req, void *arg)
     debug("p:%p d:%p (%.2fms) %s %s\n", p, d, pdelta(p), __func__, p->uri);
     d->req = NULL;
 
+    if (work_queue_busy(d->range.hashing)) {
+        // finished by direct_request_chunk_hashed
+        evhttp_request_own(req);
+        d->range.finished_req = req;
+        return;
+    }
+    direct_request_done(d, req);
+}
+
+// false while the last chunk is still hashing
+bool direct_request_done(direct_request *d, evhttp_request *req)
+{
+    proxy_request *p = d->p;
+
     if (p->chunked) {
         size_t buffered = d->range.chunk_buffer ? evbuffer_get_length(d->range.chunk_buffer) : 0;
         if (!d->range.chunk_index) {
@@ -1313,6 +1902,11 @@ void direct_request_done_cb(evhttp_request *req, void *arg)
     if (req->response_code != 0) {
         // there may have been no chunks, or a chunked transfer of unknown length. call the chunked_cb one last time
         direct_request_process_chunks(d, req);
+        if (work_queue_busy(d->range.hashing)) {
+            evhttp_request_own(req);
+            d->range.finished_req = req;
+            return false;
+        }
 
         return_connection(d->evcon);
         d->evcon = NULL;
@@ -1326,10 +1920,44 @@ void direct_request_done_cb(evhttp_request *req, void *arg)
     if (!proxy_request_any_direct(p) && !proxy_request_any_peers(p)) {
         proxy_request_cleanup(p, __func__);
     }
+    return true;
+}
+
+void verified_sig_add(const char *sign, const content_sig *sig)
+{
+    if (!verified_sigs) {
+        verified_sigs = hash_table_create();
+    }
+    if (verified_sigs_len >= VERIFIED_SIGS_MAX) {
+        verified_sig *v = TAILQ_LAST(&verified_sigs_lru, verified_sig_head);
+        TAILQ_REMOVE(&verified_sigs_lru, v, next);
+        hash_remove(verified_sigs, v->sign);
+        free(v->sign);
+        free(v);
+        verified_sigs_len--;
+    }
+    verified_sig *v = alloc(verified_sig);
+    v->sign = strdup(sign);
+    memcpy(v->content_hash, sig->content_hash, sizeof(v->content_hash));
+    hash_set(verified_sigs, v->sign, v);
+    TAILQ_INSERT_HEAD(&verified_sigs_lru, v, next);
+    verified_sigs_len++;
 }
 
 bool verify_signature(const uint8_t *content_hash, const char *sign)
 {
+    // the same X-MSign arrives on every peer, direct and cached copy of an object
+    verified_sig *v = verified_sigs ? hash_get(verified_sigs, sign) : NULL;
+    if (v) {
+        if (!memeq(content_hash, v->content_hash, sizeof(v->content_hash))) {
+            fprintf(stderr, "Incorrect hash!\n");
+            return false;
+        }
+        TAILQ_REMOVE(&verified_sigs_lru, v, next);
+        TAILQ_INSERT_HEAD(&verified_sigs_lru, v, next);
+        return true;
+    }
+
     if (strlen(sign) != BASE64_LENGTH(sizeof(content_sig))) {
         fprintf(stderr, "Incorrect length! %zu != %zu\n", strlen(sign), sizeof(content_sig));
         return false;
@@ -1366,6 +1994,8 @@ bool verify_signature(const uint8_t *content_hash, const char *sign)
         return false;
     }
 
+    verified_sig_add(sign, sig);
+
     free(raw_sig);
     return true;
 }
@@ -1520,6 +2150,8 @@ int peer_request_header_cb(evhttp_request *req, void *arg)
     }
     overwrite_kv_header(&p->direct_headers, "Content-Location", content_location);
     peer_verified(p->n, r->pc->peer);
+    peer_gossip_received(p->n, r->pc->peer, req->input_headers);
+    proxy_got_header(p, &proxy_latency(p)->peer, r->start_time);
 
     debug("tree finished: %d\n", p->merkle_tree_finished);
 
@@ -1535,177 +2167,263 @@ int peer_request_header_cb(evhttp_request *req, void *arg)
         p->have_bitfield = NULL;
     }
 
+    if (!p->header_buf) {
+        const char *leaf_size = evhttp_find_header(req->input_headers, "X-Leaf-Size");
+        p->leaf_size = leaf_size ? leaf_size_parse(leaf_size) : LEAF_CHUNK_SIZE;
+        if (!p->leaf_size) {
+            r->pc->peer->last_verified = 0;
+            proxy_send_error(p, 502, "Bad Gateway Leaf Size");
+            return -1;
+        }
+    }
+
     int res = proxy_setup_range(p, req, &r->range);
     if (res < 1) {
         return res;
     }
 
+    // the signed tree fixes the number of leaves; a length or X-Leaf-Size that disagrees would index past it
+    if (p->m->leaves_num != num_chunks(p)) {
+        debug("p:%p leaves:%zu num_chunks:%"PRIu64"\n", p, p->m->leaves_num, num_chunks(p));
+        r->pc->peer->last_verified = 0;
+        proxy_send_error(p, 502, "Bad Gateway Leaf Size");
+        return -1;
+    }
+
     evhttp_request_set_chunked_cb(req, peer_request_chunked_cb);
     return 0;
 }
 
-bool peer_request_process_chunks(peer_request *r, evhttp_request *req)
+bool peer_request_got_chunk(peer_request *r, evhttp_request *req, const uint8_t *chunk_hash)
 {
     proxy_request *p = r->p;
-    evbuffer *input = req->input_buffer;
-    debug("r:%p %s length:%zu\n", r, __func__, evbuffer_get_length(input));
+    uint64_t this_chunk_len = chunk_length(p, r->range.chunk_index);
+    uint64_t header_prefix = 0;
+    if (!r->range.chunk_index) {
+        header_prefix = evbuffer_get_length(p->header_buf);
+    }
 
-    if (!r->range.chunk_buffer) {
-        r->range.chunk_buffer = evbuffer_new();
+    if (r->range.chunk_index >= p->m->leaves_num ||
+        !memeq(chunk_hash, p->m->nodes[r->range.chunk_index].hash, crypto_generichash_BYTES)) {
+        fprintf(stderr, "r:%p chunk:%"PRIu64" hash failed\n", r, r->range.chunk_index);
+        return false;
     }
+    debug("r:%p got chunk:%"PRIu64" hash success\n", r, r->range.chunk_index);
+    p->have_bitfield[r->range.chunk_index] = true;
 
-    for (;;) {
-        uint64_t this_chunk_len = chunk_length(p, r->range.chunk_index);
-        //debug("chunk_index:%"PRIu64" this_chunk_len:%"PRIu64"\n", r->range.chunk_index, this_chunk_len);
+    peer_verified(p->n, r->pc->peer);
 
-        uint64_t header_prefix = 0;
-        if (!r->range.chunk_index) {
-            header_prefix = evbuffer_get_length(p->header_buf);
+    if (evbuffer_get_length(r->range.chunk_buffer)) {
+        uint64_t this_chunk_offset = r->range.chunk_index * p->leaf_size;
+        if (r->range.chunk_index > 0) {
+            this_chunk_offset -= evbuffer_get_length(p->header_buf);
         }
-
-        evbuffer_remove_buffer(input, r->range.chunk_buffer, this_chunk_len - header_prefix - evbuffer_get_length(r->range.chunk_buffer));
-
-        //debug("chunk_index:%"PRIu64" %"PRIu64"/%"PRIu64"\n", r->range.chunk_index, header_prefix + evbuffer_get_length(r->range.chunk_buffer), this_chunk_len);
-        if (header_prefix + evbuffer_get_length(r->range.chunk_buffer) < this_chunk_len) {
-            return true;
+        lseek(p->cache_file, this_chunk_offset, SEEK_SET);
+        if (!evbuffer_write_to_file(r->range.chunk_buffer, p->cache_file)) {
+            return false;
         }
+    }
 
-        if (p->have_bitfield[r->range.chunk_index]) {
-            debug("r:%p duplicate chunk:%"PRIu64"\n", r, r->range.chunk_index);
+    debug("p->byte_playhead:%"PRIu64" (r->chunk_index * p->leaf_size):%"PRIu64"\n", p->byte_playhead, r->range.chunk_index * p->leaf_size);
+    if (p->byte_playhead == r->range.chunk_index * p->leaf_size) {
+        if (!p->byte_playhead) {
+            // XXX: TODO: MIX_DIRECT
+            proxy_direct_requests_cancel(p);
+            if (p->hedged) {
+                // the first verified bytes win the hedge
+                for (size_t i = 0; i < lenof(p->requests); i++) {
+                    if (&p->requests[i] != r) {
+                        peer_request_cancel(&p->requests[i]);
+                    }
+                }
+            }
+            proxy_request_reply_start(p, req);
         }
-
-        crypto_generichash_state content_state;
-        crypto_generichash_init(&content_state, NULL, 0, crypto_generichash_BYTES);
-
-        if (!r->range.chunk_index) {
-            evbuffer_hash_update(p->header_buf, &content_state);
+        if (p->server_req) {
+            evhttp_send_reply_chunk(p->server_req, r->range.chunk_buffer);
         }
-        evbuffer_hash_update(r->range.chunk_buffer, &content_state);
+        p->byte_playhead += this_chunk_len - header_prefix;
+    }
+    return true;
+}
 
-        uint8_t chunk_hash[crypto_generichash_BYTES];
-        crypto_generichash_final(&content_state, chunk_hash, sizeof(chunk_hash));
+// 1 to keep reading chunks, 0 to stop, -1 on failure
+int peer_request_next_chunk(peer_request *r, evhttp_request *req)
+{
+    proxy_request *p = r->p;
 
-        if (!memeq(chunk_hash, p->m->nodes[r->range.chunk_index].hash, sizeof(chunk_hash))) {
-            fprintf(stderr, "r:%p chunk:%"PRIu64" hash failed\n", r, r->range.chunk_index);
-            return false;
-        }
-        debug("r:%p got chunk:%"PRIu64" hash success\n", r, r->range.chunk_index);
-        p->have_bitfield[r->range.chunk_index] = true;
+    evbuffer_drain(r->range.chunk_buffer, evbuffer_get_length(r->range.chunk_buffer));
 
-        peer_verified(p->n, r->pc->peer);
+    debug("(r->chunk_index * p->leaf_size)):%"PRIu64" r->end:%"PRIu64"\n", r->range.chunk_index * p->leaf_size, r->range.end);
+    if (r->range.chunk_index * p->leaf_size <= r->range.end) {
+        r->range.chunk_index++;
+    }
 
-        if (evbuffer_get_length(r->range.chunk_buffer)) {
-            uint64_t this_chunk_offset = r->range.chunk_index * LEAF_CHUNK_SIZE;
-            if (r->range.chunk_index > 0) {
-                this_chunk_offset -= evbuffer_get_length(p->header_buf);
+    uint64_t c = p->byte_playhead;
+    while (c < p->total_length && p->have_bitfield[c / p->leaf_size]) {
+        c += p->leaf_size;
+    }
+
+    if (c > p->byte_playhead) {
+        off_t offset = p->byte_playhead - evbuffer_get_length(p->header_buf);
+        uint64_t length = c - p->byte_playhead;
+        evbuffer_file_segment *seg = evbuffer_file_segment_new(p->cache_file, offset, length, 0);
+        if (!seg) {
+            fprintf(stderr, "r:%p evbuffer_file_segment_new %d (%s)\n", r, errno, strerror(errno));
+            return -1;
+        }
+        if (p->server_req) {
+            evbuffer *buf = evbuffer_new();
+            if (!evbuffer_add_file_segment(buf, seg, 0, length)) {
+                evbuffer_file_segment_free(seg);
             }
-            lseek(p->cache_file, this_chunk_offset, SEEK_SET);
-            if (!evbuffer_write_to_file(r->range.chunk_buffer, p->cache_file)) {
-                return false;
+            evhttp_send_reply_chunk(p->server_req, buf);
+            evbuffer_free(buf);
+        }
+        p->byte_playhead += length;
+    }
+
+    debug("p->byte_playhead:%"PRIu64" p->total_length:%"PRIu64"\n", p->byte_playhead, p->total_length);
+    if (p->byte_playhead == p->total_length) {
+        if (p->server_req) {
+            if (p->server_req->evcon) {
+                evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
             }
+            evhttp_send_reply_end(p->server_req);
+            p->server_req = NULL;
         }
 
-        debug("p->byte_playhead:%"PRIu64" (r->chunk_index * LEAF_CHUNK_SIZE):%"PRIu64"\n", p->byte_playhead, r->range.chunk_index * LEAF_CHUNK_SIZE);
-        if (p->byte_playhead == r->range.chunk_index * LEAF_CHUNK_SIZE) {
-            if (!p->byte_playhead) {
-                // XXX: TODO: MIX_DIRECT
-                proxy_direct_requests_cancel(p);
-                proxy_request_reply_start(p, req);
+        // we cannot reuse the connection until we know the reqeust has finished the reply
+        for (size_t i = 0; i < lenof(p->requests); i++) {
+            peer_request *pr = &p->requests[i];
+            if (!pr->req) {
+                continue;
             }
-            if (p->server_req) {
-                evhttp_send_reply_chunk(p->server_req, r->range.chunk_buffer);
+            // give them a tiny grace period
+            if ((pr->range.chunk_index * p->leaf_size) + 1024 > pr->range.end) {
+                evhttp_request_set_chunked_cb(pr->req, NULL);
+                continue;
             }
-            p->byte_playhead += this_chunk_len - header_prefix;
+            peer_request_cancel(pr);
         }
 
-        evbuffer_drain(r->range.chunk_buffer, evbuffer_get_length(r->range.chunk_buffer));
-
-        debug("(r->chunk_index * LEAF_CHUNK_SIZE)):%"PRIu64" r->end:%"PRIu64"\n", r->range.chunk_index * LEAF_CHUNK_SIZE, r->range.end);
-        if (r->range.chunk_index * LEAF_CHUNK_SIZE <= r->range.end) {
-            r->range.chunk_index++;
+        //join_url_swarm(p->n, uri);
+        evhttp_uri *evuri = evhttp_uri_parse_with_flags(req->uri, EVHTTP_URI_NONCONFORMANT);
+        const char *host = evhttp_uri_get_host(evuri);
+        if (host) {
+            join_url_swarm(p->n, host);
         }
+        evhttp_uri_free(evuri);
 
-        uint64_t c = p->byte_playhead;
-        while (c < p->total_length && p->have_bitfield[c / LEAF_CHUNK_SIZE]) {
-            c += LEAF_CHUNK_SIZE;
+        // only cache if have_bitfield is all 1's. otherwise we need to track partials (or hashcheck on upload, which prevents sendfile)
+        assert(p->merkle_tree_finished);
+        assert(p->have_bitfield);
+        if (proxy_is_complete(p)) {
+            proxy_save_cache(p);
         }
+        return 0;
+    }
 
-        if (c > p->byte_playhead) {
-            off_t offset = p->byte_playhead - evbuffer_get_length(p->header_buf);
-            uint64_t length = c - p->byte_playhead;
-            evbuffer_file_segment *seg = evbuffer_file_segment_new(p->cache_file, offset, length, 0);
-            if (!seg) {
-                fprintf(stderr, "r:%p evbuffer_file_segment_new %d (%s)\n", r, errno, strerror(errno));
-                return false;
-            }
-            if (p->server_req) {
-                evbuffer *buf = evbuffer_new();
-                if (!evbuffer_add_file_segment(buf, seg, 0, length)) {
-                    evbuffer_file_segment_free(seg);
-                }
-                evhttp_send_reply_chunk(p->server_req, buf);
-                evbuffer_free(buf);
-            }
-            p->byte_playhead += length;
-        }
+    assert(r->range.chunk_index <= num_chunks(p));
+    if (r->range.chunk_index >= num_chunks(p)) {
+        // done, let the connection close naturally
+        debug("r:%p done, let the connection close naturally\n", r);
+        return 0;
+    }
+    if (!p->have_bitfield[r->range.chunk_index]) {
+        return 1;
+    }
 
-        debug("p->byte_playhead:%"PRIu64" p->total_length:%"PRIu64"\n", p->byte_playhead, p->total_length);
-        if (p->byte_playhead == p->total_length) {
-            if (p->server_req) {
-                if (p->server_req->evcon) {
-                    evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
-                }
-                evhttp_send_reply_end(p->server_req);
-                p->server_req = NULL;
-            }
+    debug("r:%p terminating connection due to overlap\n", r);
+    return -1;
+}
 
-            // we cannot reuse the connection until we know the reqeust has finished the reply
-            for (size_t i = 0; i < lenof(p->requests); i++) {
-                peer_request *pr = &p->requests[i];
-                if (!pr->req) {
-                    continue;
-                }
-                // give them a tiny grace period
-                if ((pr->range.chunk_index * LEAF_CHUNK_SIZE) + 1024 > pr->range.end) {
-                    evhttp_request_set_chunked_cb(pr->req, NULL);
-                    continue;
-                }
-                peer_request_cancel(pr);
-            }
+void peer_request_chunk_hashed(peer_request *r, evhttp_request *req, const uint8_t *chunk_hash);
 
-            //join_url_swarm(p->n, uri);
-            evhttp_uri *evuri = evhttp_uri_parse_with_flags(req->uri, EVHTTP_URI_NONCONFORMANT);
-            const char *host = evhttp_uri_get_host(evuri);
-            if (host) {
-                join_url_swarm(p->n, host);
-            }
-            evhttp_uri_free(evuri);
+bool peer_request_process_chunks(peer_request *r, evhttp_request *req)
+{
+    proxy_request *p = r->p;
+    evbuffer *input = req->input_buffer;
+    debug("r:%p %s length:%zu\n", r, __func__, evbuffer_get_length(input));
 
-            // only cache if have_bitfield is all 1's. otherwise we need to track partials (or hashcheck on upload, which prevents sendfile)
-            assert(p->merkle_tree_finished);
-            assert(p->have_bitfield);
-            if (proxy_is_complete(p)) {
-                proxy_save_cache(p);
-            }
-            return true;
-        }
+    if (work_queue_busy(r->range.hashing)) {
+        // picked up again when the chunk in flight is hashed
+        return true;
+    }
 
-        assert(r->range.chunk_index <= num_chunks(p));
-        if (r->range.chunk_index >= num_chunks(p)) {
-            // done, let the connection close naturally
-            debug("r:%p done, let the connection close naturally\n", r);
-            return true;
+    if (!r->range.chunk_buffer) {
+        r->range.chunk_buffer = evbuffer_new();
+    }
+
+    // chunks hashed along with an earlier one go through without another trip to the pool
+    uint8_t ahead_hash[crypto_generichash_BYTES];
+    while (chunked_range_take_ahead(&r->range, ahead_hash)) {
+        if (!peer_request_got_chunk(r, req, ahead_hash)) {
+            return false;
         }
-        if (!p->have_bitfield[r->range.chunk_index]) {
-            continue;
+        int next = peer_request_next_chunk(r, req);
+        if (next <= 0) {
+            return next == 0;
         }
+    }
 
-        debug("r:%p terminating connection due to overlap\n", r);
-        return false;
+    uint64_t this_chunk_len = chunk_length(p, r->range.chunk_index);
+    //debug("chunk_index:%"PRIu64" this_chunk_len:%"PRIu64"\n", r->range.chunk_index, this_chunk_len);
+
+    uint64_t header_prefix = 0;
+    if (!r->range.chunk_index) {
+        header_prefix = evbuffer_get_length(p->header_buf);
+    }
+
+    evbuffer_remove_buffer(input, r->range.chunk_buffer, this_chunk_len - header_prefix - evbuffer_get_length(r->range.chunk_buffer));
+
+    //debug("chunk_index:%"PRIu64" %"PRIu64"/%"PRIu64"\n", r->range.chunk_index, header_prefix + evbuffer_get_length(r->range.chunk_buffer), this_chunk_len);
+    if (header_prefix + evbuffer_get_length(r->range.chunk_buffer) < this_chunk_len) {
+        return true;
+    }
+
+    if (p->have_bitfield[r->range.chunk_index]) {
+        debug("r:%p duplicate chunk:%"PRIu64"\n", r, r->range.chunk_index);
     }
+
+    chunked_range_hash(p, &r->range, input, ^(const uint8_t *chunk_hash) {
+        peer_request_chunk_hashed(r, req, chunk_hash);
+    });
     return true;
 }
 
+bool peer_request_done(peer_request *r, evhttp_request *req);
+
+void peer_request_chunk_hashed(peer_request *r, evhttp_request *req, const uint8_t *chunk_hash)
+{
+    proxy_request *p = r->p;
+    chunked_range *range = &r->range;
+    p->dont_free = true;
+    int next = -1;
+    if (peer_request_got_chunk(r, req, chunk_hash)) {
+        next = peer_request_next_chunk(r, req);
+    }
+    if (next > 0 && !peer_request_process_chunks(r, req)) {
+        next = -1;
+    }
+    evhttp_request *finished = NULL;
+    if (range->finished_req && !work_queue_busy(range->hashing)) {
+        // the transfer ended while this chunk was hashing
+        finished = range->finished_req;
+        range->finished_req = NULL;
+        if (!peer_request_done(r, finished)) {
+            finished = NULL;
+        }
+    } else if (next < 0) {
+        peer_request_cancel(r);
+    }
+    p->dont_free = false;
+    proxy_request_cleanup(p, __func__);
+    if (finished) {
+        evhttp_request_free(finished);
+    }
+}
+
 void peer_request_chunked_cb(evhttp_request *req, void *arg)
 {
     peer_request *r = (peer_request*)arg;
@@ -1719,6 +2437,7 @@ void peer_request_error_cb(evhttp_request_error error, void *arg)
     peer_request *r = (peer_request*)arg;
     debug("r:%p %s %d %s\n", r, __func__, error, evhttp_request_error_str(error));
     r->req = NULL;
+    chunked_range_cancel(&r->range);
     if (error == EVREQ_HTTP_REQUEST_CANCEL) {
         return;
     }
@@ -1743,12 +2462,32 @@ void peer_request_done_cb(evhttp_request *req, void *arg)
         return;
     }
 
+    if (work_queue_busy(r->range.hashing)) {
+        // finished by peer_request_chunk_hashed
+        evhttp_request_own(req);
+        r->range.finished_req = req;
+        return;
+    }
+    peer_request_done(r, req);
+}
+
+// false while the last chunk is still hashing
+bool peer_request_done(peer_request *r, evhttp_request *req)
+{
+    proxy_request *p = r->p;
+
     // there may have been no chunks, or a chunked transfer of unknown length. call the chunked_cb one last time
     peer_request_process_chunks(r, req);
+    if (work_queue_busy(r->range.hashing)) {
+        evhttp_request_own(req);
+        r->range.finished_req = req;
+        return false;
+    }
 
     peer_reuse(p->n, r->pc);
     r->pc = NULL;
     peer_request_cleanup(r, __func__);
+    return true;
 }
 
 void stats_changed()
@@ -1915,6 +2654,7 @@ void direct_submit_request(proxy_request *p)
     }
 
     d->p = p;
+    d->start_time = us_clock();
     d->req = evhttp_request_new(direct_request_done_cb, d);
 
     copy_all_headers(p->server_req, d->req);
@@ -1950,6 +2690,10 @@ void direct_submit_request(proxy_request *p)
         path = "/";
     }
     snprintf(request_uri, sizeof(request_uri), "%s%s%s", path, q?"?":"", q?q:"");
+    // the connection may be to a cached numeric address, so don't let evhttp fill in Host
+    if (!evhttp_find_header(d->req->output_headers, "Host") && evhttp_uri_get_host(uri)) {
+        evhttp_add_header(d->req->output_headers, "Host", evhttp_uri_get_host(uri));
+    }
     evhttp_connection *evcon = make_connection(p->n, uri);
     if (!evcon) {
         return;
@@ -1973,9 +2717,258 @@ void append_via(evhttp_request *from, evkeyvalq *to)
     overwrite_kv_header(to, "Via", viab);
 }
 
+peer_request* proxy_submit_request(proxy_request *p);
+
+bool peer_request_batchable(const peer_request *r)
+{
+    const proxy_request *p = r->p;
+    // a browser request nothing has answered yet, fetched whole
+    return p->localhost && p->http_method == EVHTTP_REQ_GET && p->server_req && !p->unbatched && !p->got_header &&
+        !p->merkle_tree_finished && p->cache_file == -1 && !evhttp_find_header(p->server_req->input_headers, "Range");
+}
+
+bool peer_batch_refused(const peer *peer)
+{
+    batch_refusal *br = batch_refusals ? hash_get(batch_refusals, peer_addr_str(peer)) : NULL;
+    return br && time(NULL) - br->refused < BATCH_RETRY;
+}
+
+void peer_batch_refuse(const peer *peer)
+{
+    if (!batch_refusals) {
+        batch_refusals = hash_table_create();
+    }
+    const char *key = peer_addr_str(peer);
+    batch_refusal *br = hash_get(batch_refusals, key);
+    if (!br) {
+        br = alloc(batch_refusal);
+        br->key = strdup(key);
+        hash_set(batch_refusals, br->key, br);
+    }
+    br->refused = time(NULL);
+}
+
+void peer_batch_fallback(peer_request *r)
+{
+    proxy_request *p = r->p;
+    debug("p:%p r:%p (%.2fms) %s\n", p, r, pdelta(p), __func__);
+    r->batch = NULL;
+    p->unbatched = true;
+    if (p->server_req && !p->got_header) {
+        p->dont_free = true;
+        proxy_submit_request(p);
+        p->dont_free = false;
+    }
+    proxy_request_cleanup(p, __func__);
+}
+
+bool peer_batch_deliver(peer_batch *b, peer_request *r, int code, evkeyvalq *headers, evbuffer *body)
+{
+    proxy_request *p = r->p;
+    r->batch = NULL;
+    if (!p->server_req || p->got_header) {
+        // answered some other way in the meantime
+        proxy_request_cleanup(p, __func__);
+        return true;
+    }
+
+    const char *content_location = evhttp_find_header(headers, "Content-Location");
+    const char *msign = evhttp_find_header(headers, "X-MSign");
+    const char *leaf_size = evhttp_find_header(headers, "X-Leaf-Size");
+    uint32_t leaf_size_value = leaf_size ? leaf_size_parse(leaf_size) : LEAF_CHUNK_SIZE;
+    if (!code || !content_location || !streq(content_location, p->uri) || !msign || !leaf_size_value) {
+        debug("p:%p (%.2fms) batch item %d unusable\n", p, pdelta(p), code);
+        return false;
+    }
+
+    // items are small, so hash them here rather than chunk by chunk on the pool
+    merkle_tree *m = alloc(merkle_tree);
+    m->leaf_size = leaf_size_value;
+    evbuffer *head = build_request_buffer(code, headers);
+    merkle_tree_add_evbuffer(m, head);
+    evbuffer_free(head);
+    merkle_tree_add_evbuffer(m, body);
+    uint8_t root_hash[crypto_generichash_BYTES];
+    merkle_tree_get_root(m, root_hash);
+    merkle_tree_free(m);
+    if (!verify_signature(root_hash, msign)) {
+        fprintf(stderr, "batch item signature failed!\n");
+        b->pc->peer->last_verified = 0;
+        return false;
+    }
+
+    peer_verified(p->n, b->pc->peer);
+    peer_gossip_received(p->n, b->pc->peer, headers);
+    proxy_got_header(p, &proxy_latency(p)->peer, r->start_time);
+    p->dont_free = true;
+    proxy_direct_requests_cancel(p);
+    proxy_peer_requests_cancel(p);
+    p->dont_free = false;
+
+    const char *response_header_whitelist[] = hashed_headers;
+    for (uint i = 0; i < lenof(response_header_whitelist); i++) {
+        const char *value = evhttp_find_header(headers, response_header_whitelist[i]);
+        if (value) {
+            overwrite_header(p->server_req, response_header_whitelist[i], value);
+        }
+    }
+    debug("p:%p req:%p (%.2fms) responding with %d from batch\n", p, p->server_req, pdelta(p), code);
+    if (p->server_req->evcon) {
+        evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
+    }
+    evhttp_send_reply(p->server_req, code, NULL, body);
+    p->server_req = NULL;
+    proxy_request_cleanup(p, __func__);
+    return true;
+}
+
+// false if the reply is malformed
+bool peer_batch_read(peer_batch *b, evbuffer *input)
+{
+    for (;;) {
+        evkeyvalq headers;
+        TAILQ_INIT(&headers);
+        evbuffer *body = evbuffer_new();
+        int code;
+        int res = batch_frame_read(input, &code, &headers, body);
+        if (res > 0 && b->next_item == b->num_items) {
+            res = -1;
+        }
+        if (res > 0) {
+            peer_request *r = b->items[b->next_item];
+            b->items[b->next_item++] = NULL;
+            if (r && !peer_batch_deliver(b, r, code, &headers, body)) {
+                peer_batch_fallback(r);
+            }
+        }
+        evhttp_clear_headers(&headers);
+        evbuffer_free(body);
+        if (res <= 0) {
+            return !res;
+        }
+    }
+}
+
+void peer_batch_finish(peer_batch *b, bool reuse)
+{
+    debug("batch:%p %s answered:%zu/%zu\n", b, __func__, b->next_item, b->num_items);
+    if (reuse) {
+        peer_reuse(b->n, b->pc);
+    } else {
+        peer_disconnect(b->pc);
+    }
+    for (size_t i = 0; i < b->num_items; i++) {
+        peer_request *r = b->items[i];
+        if (r) {
+            b->items[i] = NULL;
+            peer_batch_fallback(r);
+        }
+    }
+    free(b);
+}
+
+void peer_batch_chunked_cb(evhttp_request *req, void *arg)
+{
+    peer_batch *b = (peer_batch*)arg;
+    if (!peer_batch_read(b, req->input_buffer)) {
+        evhttp_cancel_request(b->req);
+        b->req = NULL;
+        peer_batch_finish(b, false);
+    }
+}
+
+int peer_batch_header_cb(evhttp_request *req, void *arg)
+{
+    peer_batch *b = (peer_batch*)arg;
+    if (req->response_code != 200 || !evhttp_find_header(req->input_headers, "X-Batch")) {
+        debug("batch:%p peer %s refused %d %s\n", b, peer_addr_str(b->pc->peer), req->response_code, req->response_code_line);
+        peer_batch_refuse(b->pc->peer);
+        return -1;
+    }
+    evhttp_request_set_chunked_cb(req, peer_batch_chunked_cb);
+    return 0;
+}
+
+void peer_batch_error_cb(evhttp_request_error error, void *arg)
+{
+    peer_batch *b = (peer_batch*)arg;
+    debug("batch:%p %s %d %s\n", b, __func__, error, evhttp_request_error_str(error));
+    if (error == EVREQ_HTTP_REQUEST_CANCEL) {
+        return;
+    }
+    b->req = NULL;
+    peer_batch_finish(b, false);
+}
+
+void peer_batch_done_cb(evhttp_request *req, void *arg)
+{
+    peer_batch *b = (peer_batch*)arg;
+    if (!req) {
+        return;
+    }
+    b->req = NULL;
+    bool complete = req->response_code && peer_batch_read(b, req->input_buffer) && b->next_item == b->num_items;
+    peer_batch_finish(b, complete);
+}
+
+// sends r along with any other waiting browser requests this peer can take
+bool peer_batch_submit(peer_request *r)
+{
+    peer_connection *pc = r->pc;
+    if (!peer_request_batchable(r) || peer_batch_refused(pc->peer)) {
+        return false;
+    }
+    peer_batch *b = alloc(peer_batch);
+    b->items[b->num_items++] = r;
+    for (pending_request *pr = TAILQ_FIRST(&pending_requests), *next; pr && b->num_items < BATCH_MAX; pr = next) {
+        next = TAILQ_NEXT(pr, next);
+        peer_request *o = pr->peer_req;
+        if (!o || via_contains(pr->via, pc->peer->via) || !peer_request_batchable(o)) {
+            continue;
+        }
+        bool dup = false;
+        for (size_t i = 0; i < b->num_items; i++) {
+            dup |= b->items[i]->p == o->p;
+        }
+        if (dup) {
+            continue;
+        }
+        abort_connect(pr);
+        b->items[b->num_items++] = o;
+    }
+    if (b->num_items == 1) {
+        free(b);
+        return false;
+    }
+
+    b->n = r->p->n;
+    b->pc = pc;
+    r->pc = NULL;
+    b->req = evhttp_request_new(peer_batch_done_cb, b);
+    evhttp_add_header(b->req->output_headers, "X-Batch", "1");
+    // only browser requests are batched
+    evhttp_add_header(b->req->output_headers, "X-Leaf-Sizes", "1");
+    append_via(NULL, b->req->output_headers);
+    for (size_t i = 0; i < b->num_items; i++) {
+        peer_request *item = b->items[i];
+        evhttp_request_free(item->req);
+        item->req = NULL;
+        item->batch = b;
+        evbuffer_add_printf(b->req->output_buffer, "%s\n", item->p->uri);
+    }
+    evhttp_request_set_header_cb(b->req, peer_batch_header_cb);
+    evhttp_request_set_error_cb(b->req, peer_batch_error_cb);
+    debug("batch:%p pc:%p evcon:%p items:%zu\n", b, pc, pc->evcon, b->num_items);
+    evhttp_make_request(pc->evcon, b->req, EVHTTP_REQ_POST, BATCH_PATH);
+    return true;
+}
+
 void peer_submit_request_on_con(peer_request *r, evhttp_connection *evcon)
 {
     proxy_request *p = r->p;
+    if (peer_batch_submit(r)) {
+        return;
+    }
     debug("p:%p r:%p evcon:%p %s: %s %s\n", p, r, evcon, __func__, evhttp_method(p->http_method), p->uri);
     bufferevent *server = p->server_req ? evhttp_connection_get_bufferevent(p->server_req->evcon) : NULL;
     bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
@@ -1983,6 +2976,43 @@ void peer_submit_request_on_con(peer_request *r, evhttp_connection *evcon)
     evhttp_make_request(evcon, r->req, p->http_method, p->uri);
 }
 
+uint16_t peer_rtt_ms(peer *p)
+{
+    peer_rtt *r = peer_rtts ? hash_get(peer_rtts, peer_addr_str(p)) : NULL;
+    return r ? r->rtt_ms : UINT16_MAX;
+}
+
+// unmeasured peers rank with typical ones, so they still get tried and timed
+#define PEER_RTT_UNKNOWN_MS 250
+
+uint8_t peer_rtt_bucket(peer *p)
+{
+    uint16_t rtt_ms = peer_rtt_ms(p);
+    if (rtt_ms == UINT16_MAX) {
+        rtt_ms = PEER_RTT_UNKNOWN_MS;
+    }
+    uint8_t bucket = 0;
+    for (rtt_ms /= 32; rtt_ms; rtt_ms /= 2) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void peer_rtt_record(peer *p, uint64_t rtt_us)
+{
+    if (!peer_rtts) {
+        peer_rtts = hash_table_create();
+    }
+    const char *key = peer_addr_str(p);
+    peer_rtt *r = hash_get(peer_rtts, key);
+    if (!r) {
+        r = alloc(peer_rtt);
+        r->key = strdup(key);
+        hash_set(peer_rtts, r->key, r);
+    }
+    r->rtt_ms = (uint16_t)MIN(rtt_us / 1000, UINT16_MAX - 1);
+}
+
 int peer_sort_cmp(const peer_sort *pa, const peer_sort *pb)
 {
     return memcmp(pa, pb, sizeof(peer_sort));
@@ -2002,8 +3032,9 @@ peer* select_peer(peer_array *pa, peer_filter filter)
         if (filter && filter(p)) {
             continue;
         }
-        peer_sort c;
+        peer_sort c = {.peer = NULL};
         c.failed = p->last_connect < p->last_connect_attempt;
+        c.rtt_bucket = c.failed ? 0 : peer_rtt_bucket(p);
         int64_t time_since_verified = time(NULL) - p->last_verified;
         c.time_since_verified = ntohll(time_since_verified);
         int64_t last_connect_attempt = p->last_connect_attempt;
@@ -2018,28 +3049,172 @@ peer* select_peer(peer_array *pa, peer_filter filter)
                   c.failed, htonll(c.time_since_verified), htonll(c.last_connect_attempt), c.never_connected, c.salt, c.peer);
             debug("peer_sort_cmp:%d\n", peer_sort_cmp(&c, &best));
         }
-        if (!i || peer_sort_cmp(&c, &best) < 0) {
-            //debug("better p:%p\n", p);
-            best = c;
+        if (!i || peer_sort_cmp(&c, &best) < 0) {
+            //debug("better p:%p\n", p);
+            best = c;
+        }
+    }
+    return best.peer;
+}
+
+peer_connection* start_peer_connection(network *n, peer_array *peers, peer_filter filter)
+{
+    peer *p = select_peer(peers, filter);
+    if (!p) {
+        //debug("no peer selected from peers:%p\n", peers);
+        return NULL;
+    }
+    //debug("peer selected: %s\n", peer_addr_str(p));
+    return evhttp_utp_connect(n, p);
+}
+
+pool_role peer_pool_role(peer *p)
+{
+    if (peer_is_injector(p)) {
+        return POOL_INJECTOR;
+    }
+    if (peer_is_injector_proxy(p)) {
+        return POOL_INJECTOR_PROXY;
+    }
+    return POOL_PEER;
+}
+
+void pool_targets(uint target[POOL_ROLES])
+{
+    memset(target, 0, POOL_ROLES * sizeof(target[0]));
+    if (time(NULL) - last_request > POOL_QUIET) {
+        return;
+    }
+    // requests go to injectors and injector proxies first (connect_more_injectors), so keep one of
+    // each warm, and grow with the rate: half of the expected requests on peers, a quarter on each
+    uint expected = (uint)(pool_rate + 0.99);
+    target[POOL_INJECTOR] = MIN(1 + expected / 4, injectors->length);
+    target[POOL_INJECTOR_PROXY] = MIN(1 + expected / 4, injector_proxies->length);
+    target[POOL_PEER] = expected / 2;
+    uint room = lenof(peer_connections);
+    for (uint i = 0; i < POOL_ROLES; i++) {
+        target[i] = MIN(target[i], room);
+        room -= target[i];
+    }
+}
+
+void pool_evict(uint i, const char *why)
+{
+    peer_connection *pc = peer_connections[i];
+    debug("pool evicting pc:%p %s (%s)\n", pc, peer_addr_str(pc->peer), why);
+    peer_disconnect(pc);
+    peer_connections[i] = NULL;
+}
+
+bool pool_has(peer *p)
+{
+    for (uint i = 0; i < lenof(peer_connections); i++) {
+        if (peer_connections[i] && peer_connections[i]->peer == p) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void pool_maintain(network *n)
+{
+    pool_rate = POOL_RATE_ALPHA * pool_requests + (1 - POOL_RATE_ALPHA) * pool_rate;
+    pool_requests = 0;
+
+    uint target[POOL_ROLES];
+    pool_targets(target);
+
+    time_t now = time(NULL);
+    uint count[POOL_ROLES] = {0};
+    for (uint i = 0; i < lenof(peer_connections); i++) {
+        peer_connection *pc = peer_connections[i];
+        if (!pc) {
+            continue;
+        }
+        // idle too long, the far end may be about to close it. refilled below if still wanted
+        if (pc->evcon && now - pc->idle_since > POOL_IDLE_MAX) {
+            pool_evict(i, "stale");
+            continue;
+        }
+        count[peer_pool_role(pc->peer)]++;
+    }
+
+    peer_array *arrays[POOL_ROLES] = {injectors, injector_proxies, all_peers};
+    // a ready mux opens a stream without a handshake, so it counts as warm and its streams aren't replaced
+    for (uint role = 0; role < POOL_ROLES; role++) {
+        for (uint i = 0; i < arrays[role]->length; i++) {
+            peer *p = arrays[role]->peers[i];
+            if (peer_pool_role(p) == role && peer_mux_ready(p) && !pool_has(p)) {
+                count[role]++;
+            }
+        }
+    }
+
+    // least useful first: beyond its role's target, and the longest idle
+    for (;;) {
+        int worst = -1;
+        for (uint i = 0; i < lenof(peer_connections); i++) {
+            peer_connection *pc = peer_connections[i];
+            if (!pc || !pc->evcon) {
+                continue;
+            }
+            pool_role role = peer_pool_role(pc->peer);
+            if (count[role] <= target[role]) {
+                continue;
+            }
+            if (worst == -1 || pc->idle_since < peer_connections[worst]->idle_since) {
+                worst = i;
+            }
+        }
+        if (worst == -1) {
+            break;
         }
+        count[peer_pool_role(peer_connections[worst]->peer)]--;
+        pool_evict(worst, "surplus");
     }
-    return best.peer;
-}
 
-peer_connection* start_peer_connection(network *n, peer_array *peers, peer_filter filter)
-{
-    peer *p = select_peer(peers, filter);
-    if (!p) {
-        //debug("no peer selected from peers:%p\n", peers);
-        return NULL;
+    for (uint role = 0; role < POOL_ROLES; role++) {
+        for (uint i = 0; i < lenof(peer_connections) && count[role] < target[role]; i++) {
+            if (peer_connections[i]) {
+                continue;
+            }
+            peer_connections[i] = start_peer_connection(n, arrays[role], ^bool(peer *p) {
+                return peer_pool_role(p) != role;
+            });
+            if (!peer_connections[i]) {
+                break;
+            }
+            count[role]++;
+        }
     }
-    //debug("peer selected: %s\n", peer_addr_str(p));
-    return evhttp_utp_connect(n, p);
+
+    uint total = 0;
+    for (uint role = 0; role < POOL_ROLES; role++) {
+        total += count[role];
+    }
+    debug("pool rate:%.2f injector:%u/%u injector_proxy:%u/%u peer:%u/%u\n", pool_rate,
+          count[POOL_INJECTOR], target[POOL_INJECTOR], count[POOL_INJECTOR_PROXY], target[POOL_INJECTOR_PROXY],
+          count[POOL_PEER], target[POOL_PEER]);
+    if (!total && pool_rate < 0.01) {
+        // nothing left to look after; queue_request starts it again
+        return;
+    }
+    pool_timer = timer_start(n, POOL_INTERVAL_MS, ^{
+        pool_timer = NULL;
+        pool_maintain(n);
+    });
 }
 
 void queue_request(network *n, pending_request *r, peer_filter filter, peer_connected on_connect)
 {
     debug("%s r:%p pending:%zu first:%p\n", __func__, r, pending_requests_len, TAILQ_FIRST(&pending_requests));
+    pool_requests++;
+    if (!pool_timer) {
+        pool_timer = timer_start(n, POOL_INTERVAL_MS, ^{
+            pool_timer = NULL;
+            pool_maintain(n);
+        });
+    }
     bool any_connected = false;
     for (uint i = 0; i < lenof(peer_connections); i++) {
         if (peer_connections[i]) {
@@ -2101,23 +3276,54 @@ void queue_request(network *n, pending_request *r, peer_filter filter, peer_conn
     debug("queued request:%p (outstanding:%zu)\n", r, pending_requests_len);
 }
 
-void connect_more_injectors(network *n, bool injector_preference)
+bool connect_race_step(network *n, bool injector_preference)
 {
-    debug("%s injector_pref:%d\n", __func__, injector_preference);
+    int slot = -1;
+    uint connecting = 0;
     for (uint i = 0; i < lenof(peer_connections) / 2; i++) {
-        if (peer_connections[i]) {
+        peer_connection *pc = peer_connections[i];
+        if (!pc) {
+            if (slot == -1) {
+                slot = i;
+            }
             continue;
         }
-        peer_array *o[2] = {injectors, injector_proxies};
-        if (!injector_preference && randombytes_uniform(2)) {
-            o[0] = injector_proxies;
-            o[1] = injectors;
-        }
-        peer_connections[i] = start_peer_connection(n, o[0], NULL);
-        if (!peer_connections[i]) {
-            peer_connections[i] = start_peer_connection(n, o[1], NULL);
+        if (pc->evcon) {
+            // a winner is already waiting
+            return false;
         }
+        connecting++;
+    }
+    if (slot == -1 || connecting >= RACE_WIDTH) {
+        return false;
+    }
+    peer_array *o[2] = {injectors, injector_proxies};
+    if (!injector_preference && randombytes_uniform(2)) {
+        o[0] = injector_proxies;
+        o[1] = injectors;
+    }
+    // select_peer ranks peers with an attempt in flight as failed, so each step tries the next candidate
+    peer_connections[slot] = start_peer_connection(n, o[0], NULL);
+    if (!peer_connections[slot]) {
+        peer_connections[slot] = start_peer_connection(n, o[1], NULL);
+    }
+    return !!peer_connections[slot];
+}
+
+void connect_more_injectors(network *n, bool injector_preference)
+{
+    debug("%s injector_pref:%d\n", __func__, injector_preference);
+    // the first handshake to finish takes the first waiting request (on_utp_connect),
+    // later ones park in the pool for the next
+    if (!connect_race_step(n, injector_preference) || race_timer) {
+        return;
     }
+    race_timer = timer_start(n, RACE_STAGGER_MS, ^{
+        race_timer = NULL;
+        if (!TAILQ_EMPTY(&pending_requests)) {
+            connect_more_injectors(n, injector_preference);
+        }
+    });
 }
 
 peer_request* proxy_make_request(proxy_request *p)
@@ -2135,6 +3341,7 @@ peer_request* proxy_make_request(proxy_request *p)
     }
 
     r->p = p;
+    r->start_time = us_clock();
     r->req = evhttp_request_new(peer_request_done_cb, r);
 
     evkeyval *header;
@@ -2173,25 +3380,55 @@ bool filter_peer(peer *peer, evhttp_request *server_req, const char *via)
     return sockaddr_eq((const sockaddr*)&ss, (const sockaddr*)&peer->addr) || via_contains(via, peer->via);
 }
 
-void proxy_submit_request(proxy_request *p)
+peer_request* proxy_submit_request(proxy_request *p)
 {
     // TODO: kick off a separate HEAD request for hashes which blocks until hashes are available.
     // then we can use them immediately, before the download is finished.
     peer_request *r = proxy_make_request(p);
     if (!r) {
-        return;
+        return NULL;
     }
 
     const char *via = evhttp_find_header(r->req->input_headers, "Via");
     r->r.via = via?strdup(via):NULL;
+    r->r.peer_req = r;
 
     queue_request(p->n, &r->r, ^bool(peer *peer) {
         return filter_peer(peer, p->server_req, via);
     }, ^(peer_connection *pc) {
         debug("%s:%d r:%p peer:%p\n", __func__, __LINE__, r, pc->peer);
         r->pc = pc;
+        // the browser is waiting on this one; a peer's request can wait behind it
+        peer_connection_prioritize(pc, p->localhost ? MUX_PRIORITY_HIGH : MUX_PRIORITY_LOW);
         peer_submit_request_on_con(r, r->pc->evcon);
     });
+    return r;
+}
+
+void proxy_hedge_schedule(proxy_request *p, bool direct)
+{
+    authority_latency *l = proxy_latency(p);
+    uint32_t delay = ttfb_p90(&l->peer);
+    if (direct) {
+        delay = MIN(delay, ttfb_p90(&l->direct));
+    }
+    p->hedge_timer = timer_start(p->n, delay, ^{
+        p->hedge_timer = NULL;
+        if (p->got_header || p->hedged || !p->server_req) {
+            return;
+        }
+        if (hedges_outstanding >= HEDGE_BUDGET) {
+            debug("p:%p (%.2fms) hedge budget exhausted (%u)\n", p, pdelta(p), hedges_outstanding);
+            return;
+        }
+        debug("p:%p (%.2fms) no header after %ums, hedging %s\n", p, pdelta(p), delay, p->uri);
+        if (!proxy_submit_request(p)) {
+            return;
+        }
+        p->hedged = true;
+        p->hedge_pending = true;
+        hedges_outstanding++;
+    });
 }
 
 void proxy_evcon_close_cb(evhttp_connection *evcon, void *ctx)
@@ -2234,9 +3471,12 @@ void submit_request(network *n, evhttp_request *server_req)
     const char *host = evhttp_uri_get_host(uri);
     p->authority = strdup(host ?: "");
     p->localhost = evcon_is_localhost(p->server_req->evcon);
+    // a browser never sees the tree; a peer only gets large leaves when it asked for them
+    p->leaf_sizes = p->localhost || evhttp_find_header(p->server_req->input_headers, "X-Leaf-Sizes");
     p->http_method = p->server_req->type;
     p->uri = strdup(evhttp_request_get_uri(p->server_req));
     p->m = alloc(merkle_tree);
+    p->leaf_size = LEAF_CHUNK_SIZE;
 
     debug("p:%p new request %s\n", p, p->uri);
 
@@ -2251,6 +3491,9 @@ void submit_request(network *n, evhttp_request *server_req)
         }
     }
     append_via(p->server_req, &p->output_headers);
+    if (p->leaf_sizes) {
+        evhttp_add_header(&p->output_headers, "X-Leaf-Sizes", "1");
+    }
 
     /*
     if (!dht_num_searches()) {
@@ -2261,8 +3504,14 @@ void submit_request(network *n, evhttp_request *server_req)
 
     p->dont_free = true;
 
+    bool direct = false;
     if (!NO_DIRECT && evcon_is_localhost(server_req->evcon)) {
         direct_submit_request(p);
+        direct = true;
+    }
+
+    if (p->http_method == EVHTTP_REQ_GET || p->http_method == EVHTTP_REQ_HEAD) {
+        proxy_hedge_schedule(p, direct);
     }
 
     switch (p->http_method) {
@@ -2401,6 +3650,7 @@ void submit_trace_request(network *n)
     queue_request(n, &t->r, NULL, ^(peer_connection *pc) {
         debug("%s:%d t:%p peer:%p\n", __func__, __LINE__, t, pc->peer);
         t->pc = pc;
+        peer_connection_prioritize(pc, MUX_PRIORITY_LOW);
         trace_submit_request_on_con(t, t->pc->evcon);
     });
 }
@@ -2415,6 +3665,115 @@ void submit_trace_request(network *n)
 #define SOCKS5_REPLY_INVAL 0x07 // command not supported / protocol error
 #define SOCKS5_REPLY_AFNOSUPPORT 0x08 // address type not supported
 
+typedef enum {
+    ROUTE_UNKNOWN,
+    ROUTE_DIRECT,
+    ROUTE_PROXY,
+} route_choice;
+
+#define ROUTE_STAGGER_MS 1000
+#define ROUTE_MAX_AGE (24 * 60 * 60)
+#define ROUTE_KEEP (7 * 24 * 60 * 60)
+#define ROUTES_MAX 1024
+#define ROUTE_SAVE_MS (60 * 1000)
+
+typedef struct {
+    time_t last_direct_success;
+    time_t last_direct_failure;
+    time_t last_proxy_success;
+    time_t last_proxy_failure;
+    uint16_t direct_successes;
+    uint16_t direct_failures;
+    uint16_t proxy_successes;
+    uint16_t proxy_failures;
+} route_stats;
+
+typedef struct {
+    char authority[256];
+    route_stats stats;
+} route_record;
+
+hash_table *route_per_authority;
+timer *saving_routes;
+
+void save_routes(network *n);
+time_t route_last_update(const route_stats *r);
+
+void route_prune(void)
+{
+    hash_trim(route_per_authority, ROUTES_MAX, ROUTE_KEEP, ^time_t (const void *val) {
+        return route_last_update(val);
+    });
+}
+
+route_stats* route_get(const char *authority, bool create)
+{
+    if (!route_per_authority) {
+        route_per_authority = hash_table_create();
+    }
+    route_stats *r = hash_get(route_per_authority, authority);
+    if (!r && create && strlen(authority) < member_sizeof(route_record, authority)) {
+        if (hash_length(route_per_authority) >= ROUTES_MAX) {
+            route_prune();
+        }
+        r = alloc(route_stats);
+        hash_set(route_per_authority, strdup(authority), r);
+    }
+    return r;
+}
+
+time_t route_last_update(const route_stats *r)
+{
+    return MAX(MAX(r->last_direct_success, r->last_direct_failure),
+               MAX(r->last_proxy_success, r->last_proxy_failure));
+}
+
+void route_update(network *n, const char *authority, bool direct, bool success)
+{
+    route_stats *r = route_get(authority, true);
+    if (!r) {
+        return;
+    }
+    time_t now = time(NULL);
+    uint16_t *count;
+    if (direct) {
+        *(success ? &r->last_direct_success : &r->last_direct_failure) = now;
+        count = success ? &r->direct_successes : &r->direct_failures;
+    } else {
+        *(success ? &r->last_proxy_success : &r->last_proxy_failure) = now;
+        count = success ? &r->proxy_successes : &r->proxy_failures;
+    }
+    (*count)++;
+    // decay, so the rates follow the network we're on now
+    if (*count >= 64) {
+        r->direct_successes /= 2;
+        r->direct_failures /= 2;
+        r->proxy_successes /= 2;
+        r->proxy_failures /= 2;
+    }
+    debug("route %s %s %s (direct %u/%u proxy %u/%u)\n", authority, direct ? "direct" : "proxy", success ? "success" : "failure",
+          r->direct_successes, r->direct_failures, r->proxy_successes, r->proxy_failures);
+    save_routes(n);
+}
+
+route_choice route_predict(const char *authority)
+{
+    route_stats *r = route_get(authority, false);
+    if (!r || time(NULL) - route_last_update(r) > ROUTE_MAX_AGE) {
+        return ROUTE_UNKNOWN;
+    }
+    bool direct_works = r->last_direct_success > r->last_direct_failure;
+    bool proxy_works = r->last_proxy_success > r->last_proxy_failure;
+    if (direct_works && r->direct_successes >= r->direct_failures) {
+        return ROUTE_DIRECT;
+    }
+    if (proxy_works && !direct_works) {
+        return ROUTE_PROXY;
+    }
+    // failing, or not enough history. race both
+    return ROUTE_UNKNOWN;
+}
+
 typedef struct {
     // HTTP CONNECT request
     evhttp_request *server_req;
@@ -2426,7 +3785,7 @@ typedef struct {
     pending_request r;
     peer_connection *pc;
     // direct
-    bufferevent *direct;
+    happy_eyeballs *direct;
 
     network *n;
 
@@ -2437,7 +3796,15 @@ typedef struct {
     char *authority;
     int attempts;
 
+    // direct destination
+    char *host;
+    port_t port;
+
+    // the alternative route, started late
+    timer *stagger;
+
     bool dont_free:1;
+    bool stagger_direct:1;
 } connect_req;
 
 void free_write_cb(bufferevent *bev, void *ctx)
@@ -2456,8 +3823,8 @@ void socks_reply(bufferevent *bev, uint8_t resp)
 
 bool connect_exhausted(connect_req *c)
 {
-    debug("c:%p %s direct:%p proxy_req:%p on_connect:%p\n", c, __func__, c->direct, c->proxy_req, c->r.on_connect);
-    if (c->direct || c->proxy_req || c->r.on_connect) {
+    debug("c:%p %s direct:%p proxy_req:%p on_connect:%p stagger:%p\n", c, __func__, c->direct, c->proxy_req, c->r.on_connect, c->stagger);
+    if (c->direct || c->proxy_req || c->r.on_connect || c->stagger) {
         return false;
     }
     for (size_t i = 0; i < lenof(c->bevs); i++) {
@@ -2514,12 +3881,22 @@ void connect_cleanup(connect_req *c)
         c->pc = NULL;
     }
     free(c->authority);
+    free(c->host);
     free(c);
 }
 
+void connect_stagger_cancel(connect_req *c)
+{
+    if (c->stagger) {
+        timer_cancel(c->stagger);
+        c->stagger = NULL;
+    }
+}
+
 void connect_proxy_cancel(connect_req *c)
 {
     debug("c:%p %s req:%p\n", c, __func__, c->proxy_req);
+    connect_stagger_cancel(c);
     if (c->proxy_req) {
         evhttp_cancel_request(c->proxy_req);
         c->proxy_req = NULL;
@@ -2532,8 +3909,9 @@ void connect_proxy_cancel(connect_req *c)
 void connect_direct_cancel(connect_req *c)
 {
     debug("c:%p %s\n", c, __func__);
+    connect_stagger_cancel(c);
     if (c->direct) {
-        bufferevent_free(c->direct);
+        happy_eyeballs_cancel(c->direct);
         c->direct = NULL;
     }
 }
@@ -2582,6 +3960,7 @@ void connect_other_read_cb(bufferevent *bev, void *ctx)
     debug("c:%p %s connection complete server:%p bev:%p intro_data_length:%zu\n", c, __func__, server, bev, evbuffer_get_length(c->intro_data));
     c->pending_bev = NULL;
     c->dont_free = true;
+    route_update(c->n, c->authority, !bufferevent_is_utp(bev), true);
     connect_proxy_cancel(c);
     connect_direct_cancel(c);
     char authority[128];
@@ -2598,6 +3977,8 @@ void connect_other_read_cb(bufferevent *bev, void *ctx)
     bufferevent_enable(bev, EV_READ|EV_WRITE);
 }
 
+void connect_start_alternative(connect_req *c);
+
 void connect_other_event_cb(bufferevent *bev, short events, void *ctx)
 {
     connect_req *c = (connect_req *)ctx;
@@ -2611,7 +3992,10 @@ void connect_other_event_cb(bufferevent *bev, short events, void *ctx)
         assert(i != lenof(c->bevs) - 1);
     }
 
+    // closed before any data arrived
+    route_update(c->n, c->authority, !bufferevent_is_utp(bev), false);
     bufferevent_free(bev);
+    connect_start_alternative(c);
 }
 
 void connected(connect_req *c, bufferevent *other)
@@ -2692,6 +4076,7 @@ void connect_done_cb(evhttp_request *req, void *arg)
         }
         connect_invalid_reply(c);
     }
+    connect_start_alternative(c);
     if (connect_exhausted(c)) {
         if (c->server_req) {
             connect_send_error(c, 523, "Origin Is Unreachable (max-retries)");
@@ -2776,6 +4161,10 @@ void connect_error_cb(evhttp_request_error error, void *arg)
     connect_req *c = (connect_req *)arg;
     debug("c:%p %s req:%p %d %s\n", c, __func__, c->proxy_req, error, evhttp_request_error_str(error));
     c->proxy_req = NULL;
+    if (error != EVREQ_HTTP_REQUEST_CANCEL) {
+        route_update(c->n, c->authority, false, false);
+        connect_start_alternative(c);
+    }
     if (c->server_req) {
         switch (error) {
         case EVREQ_HTTP_TIMEOUT: connect_send_error(c, 504, "Gateway Timeout"); break;
@@ -2797,22 +4186,13 @@ void connect_error_cb(evhttp_request_error error, void *arg)
     connect_cleanup(c);
 }
 
-void connect_direct_event_cb(bufferevent *bev, short events, void *ctx)
+void connect_direct_error(connect_req *c, int err)
 {
-    connect_req *c = (connect_req *)ctx;
-    debug("c:%p %s bev:%p req:%s events:0x%x %s\n", c, __func__, bev,
-        c->server_req ? evhttp_request_get_uri(c->server_req) : "(null)", events, bev_events_to_str(events));
-
-    if (events & BEV_EVENT_TIMEOUT) {
-        bufferevent_free(bev);
-        c->direct = NULL;
-        connect_send_error(c, 504, "Gateway Timeout");
-        connect_cleanup(c);
-    } else if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-        int err = bufferevent_get_error(bev);
-        debug("c:%p bev:%p error:%d %s\n", c, bev, err, strerror(err));
-        bufferevent_free(bev);
-        c->direct = NULL;
+    debug("c:%p %s req:%s error:%d %s\n", c, __func__,
+        c->server_req ? evhttp_request_get_uri(c->server_req) : "(null)", err, strerror(err));
+    route_update(c->n, c->authority, true, false);
+    connect_start_alternative(c);
+    if (c->server_req) {
         int code = 502;
         const char *reason = "Bad Gateway";
         switch (err) {
@@ -2822,11 +4202,17 @@ void connect_direct_event_cb(bufferevent *bev, short events, void *ctx)
         case ETIMEDOUT: code = 504; reason = "Gateway Timeout"; break;
         }
         connect_send_error(c, code, reason);
-        connect_cleanup(c);
-    } else if (events & BEV_EVENT_CONNECTED) {
-        c->direct = NULL;
-        connected(c, bev);
+    } else {
+        switch (err) {
+        case ENETUNREACH: connect_socks_reply(c, SOCKS5_REPLY_NETUNREACH); break;
+        case EHOSTUNREACH: connect_socks_reply(c, SOCKS5_REPLY_HOSTUNREACH); break;
+        case ECONNREFUSED: connect_socks_reply(c, SOCKS5_REPLY_CONNREFUSED); break;
+        case ETIMEDOUT: connect_socks_reply(c, SOCKS5_REPLY_TIMEDOUT); break;
+        default:
+        case 0: connect_socks_reply(c, SOCKS5_REPLY_FAILURE); break;
+        }
     }
+    connect_cleanup(c);
 }
 
 void connect_evcon_close_cb(evhttp_connection *evcon, void *ctx)
@@ -2859,6 +4245,8 @@ void connect_peer(connect_req *c, bool injector_preference)
         assert(!c->r.on_connect);
 
         c->pc = pc;
+        // tunnels often carry bulk, so plain browser requests go ahead of them
+        peer_connection_prioritize(pc, c->server_req && !evcon_is_localhost(c->server_req->evcon) ? MUX_PRIORITY_LOW : MUX_PRIORITY_DEFAULT);
         assert(!c->proxy_req);
         c->proxy_req = evhttp_request_new(connect_done_cb, c);
         debug("c:%p %s made req:%p\n", c, __func__, c->proxy_req);
@@ -2871,6 +4259,71 @@ void connect_peer(connect_req *c, bool injector_preference)
     });
 }
 
+void connect_direct_start(connect_req *c)
+{
+#if !NO_DIRECT
+    c->direct = happy_eyeballs_connect(c->n, c->host, c->port, 0, ^(bufferevent *bev, int err) {
+        c->direct = NULL;
+        if (!bev) {
+            connect_direct_error(c, err);
+            return;
+        }
+        connected(c, bev);
+    });
+    debug("c:%p %s direct:%p\n", c, __func__, c->direct);
+#endif
+}
+
+void connect_start_alternative(connect_req *c)
+{
+    if (!c->stagger) {
+        return;
+    }
+    timer_cancel(c->stagger);
+    c->stagger = NULL;
+    debug("c:%p %s %s\n", c, __func__, c->stagger_direct ? "direct" : "proxy");
+    if (c->stagger_direct) {
+        connect_direct_start(c);
+    } else {
+        connect_peer(c, false);
+    }
+}
+
+void connect_start(connect_req *c, bool can_proxy)
+{
+    route_choice route = can_proxy ? route_predict(c->authority) : ROUTE_DIRECT;
+    debug("c:%p %s %s route:%d\n", c, __func__, c->authority, route);
+    if (NO_DIRECT && can_proxy) {
+        route = ROUTE_PROXY;
+    }
+    switch (route) {
+    case ROUTE_UNKNOWN:
+        connect_peer(c, false);
+        connect_direct_start(c);
+        break;
+    case ROUTE_DIRECT:
+        connect_direct_start(c);
+        if (can_proxy) {
+            c->stagger_direct = false;
+            c->stagger = timer_start(c->n, ROUTE_STAGGER_MS, ^{
+                c->stagger = NULL;
+                connect_peer(c, false);
+            });
+        }
+        break;
+    case ROUTE_PROXY:
+        connect_peer(c, false);
+        if (!NO_DIRECT) {
+            c->stagger_direct = true;
+            c->stagger = timer_start(c->n, ROUTE_STAGGER_MS, ^{
+                c->stagger = NULL;
+                connect_direct_start(c);
+            });
+        }
+        break;
+    }
+}
+
 void connect_request(network *n, evhttp_request *req)
 {
     char buf[2048];
@@ -2895,22 +4348,13 @@ void connect_request(network *n, evhttp_request *req)
     c->n = n;
     c->server_req = req;
     c->authority = strdup(evhttp_request_get_uri(c->server_req));
+    c->host = strdup(host);
+    c->port = port;
+    evhttp_uri_free(uri);
 
     evhttp_connection_set_closecb(c->server_req->evcon, connect_evcon_close_cb, c);
 
-#if !NO_DIRECT
-    c->direct = bufferevent_socket_new(n->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(c->direct, NULL, NULL, connect_direct_event_cb, c);
-    bufferevent_enable(c->direct, EV_READ);
-#endif
-
-    connect_peer(c, false);
-
-#if !NO_DIRECT
-    // TODO: if the request is from a peer, use LEDBAT: setsocketopt(sock, SOL_SOCKET, O_TRAFFIC_CLASS, SO_TC_BK, sizeof(int))
-    bufferevent_socket_connect_hostname(c->direct, n->evdns, AF_INET, host, port);
-    evhttp_uri_free(uri);
-#endif
+    connect_start(c, true);
 }
 
 int evhttp_parse_firstline_(evhttp_request *, evbuffer*);
@@ -2954,11 +4398,26 @@ void http_request_cb(evhttp_request *req, void *arg)
         }
     }
 
+    if (mux_request(n, req)) {
+        return;
+    }
+
     if (req->type == EVHTTP_REQ_CONNECT) {
         connect_request(n, req);
         return;
     }
 
+    if (batch_request(n, req)) {
+        return;
+    }
+
+    // each item of a batch comes through here with its own headers
+    if (!evcon_is_localhost(req->evcon)) {
+        gossip_add(req, ^(gossip_sample *s) {
+            gossip_sample_peers(s);
+        });
+    }
+
     const evhttp_uri *evuri = evhttp_request_get_evhttp_uri(req);
     const char *scheme = evhttp_uri_get_scheme(evuri);
     const char *host = evhttp_uri_get_host(evuri);
@@ -2998,6 +4457,17 @@ void http_request_cb(evhttp_request *req, void *arg)
         evbuffer_add_file(header_buf, headers_file, 0, length);
         evhttp_parse_firstline_(temp, header_buf);
         evhttp_parse_headers_(temp, header_buf);
+        if (evhttp_find_header(temp->input_headers, "X-Leaf-Size") && !evcon_is_localhost(req->evcon) &&
+            !evhttp_find_header(req->input_headers, "X-Leaf-Sizes")) {
+            // the peer would hash it with the default leaf size and reject the signature
+            debug("req:%p cached copy has a leaf size the peer didn't ask for\n", req);
+            evbuffer_free(header_buf);
+            evhttp_request_free(temp);
+            close(cache_file);
+            close(headers_file);
+            submit_request(n, req);
+            return;
+        }
         copy_response_headers(temp, req);
         evbuffer_free(header_buf);
 
@@ -3119,35 +4589,147 @@ void load_peers(network *n)
     load_peer_file("peers.dat", &all_peers);
 }
 
-void socks_connect_event_cb(bufferevent *bev, short events, void *ctx)
+void probe_next(network *n);
+
+void probe_done(peer_probe *pr, bool connected)
 {
-    connect_req *c = ctx;
-    debug("c:%p %s bev:%p req:%s events:0x%x %s\n", c, __func__, bev,
-        c->server_req ? evhttp_request_get_uri(c->server_req) : "(null)", events, bev_events_to_str(events));
+    if (pr->timeout) {
+        timer_cancel(pr->timeout);
+        pr->timeout = NULL;
+    }
+    network *n = pr->n;
+    peer *p = pr->peer;
+    if (!connected) {
+        debug("probe %s failed\n", peer_addr_str(p));
+        bufferevent_free(pr->bev);
+    } else {
+        uint64_t rtt = us_clock() - pr->start;
+        debug("probe %s rtt:%"PRIu64"ms\n", peer_addr_str(p), rtt / 1000);
+        peer_rtt_record(p, rtt);
+        p->last_connect = time(NULL);
+        // already paid for the handshake, so park it for the first request
+        int slot = -1;
+        for (uint i = 0; i < lenof(peer_connections) / 2 && slot == -1; i++) {
+            if (!peer_connections[i]) {
+                slot = i;
+            }
+        }
+        if (slot == -1) {
+            bufferevent_free(pr->bev);
+        } else {
+            peer_connection *pc = alloc(peer_connection);
+            pc->n = n;
+            pc->peer = p;
+            pc->bev = pr->bev;
+            bufferevent_setcb(pc->bev, NULL, NULL, bev_event_cb, pc);
+            peer_connections[slot] = pc;
+            on_utp_connect(n, pc);
+        }
+    }
+    free(pr);
+    probes_outstanding--;
+    probe_next(n);
+}
 
-    if (events & BEV_EVENT_TIMEOUT) {
-        bufferevent_free(bev);
-        c->direct = NULL;
-        connect_socks_reply(c, SOCKS5_REPLY_TIMEDOUT);
-        connect_cleanup(c);
-    } else if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-        int err = bufferevent_get_error(bev);
-        debug("c:%p bev:%p error:%d %s\n", c, bev, err, strerror(err));
-        bufferevent_free(bev);
-        c->direct = NULL;
-        switch (err) {
-        case ENETUNREACH: connect_socks_reply(c, SOCKS5_REPLY_NETUNREACH); break;
-        case EHOSTUNREACH: connect_socks_reply(c, SOCKS5_REPLY_HOSTUNREACH); break;
-        case ECONNREFUSED: connect_socks_reply(c, SOCKS5_REPLY_CONNREFUSED); break;
-        case ETIMEDOUT: connect_socks_reply(c, SOCKS5_REPLY_TIMEDOUT); break;
-        default:
-        case 0: connect_socks_reply(c, SOCKS5_REPLY_FAILURE); break;
+void probe_event_cb(bufferevent *bev, short events, void *arg)
+{
+    peer_probe *pr = (peer_probe *)arg;
+    if (events & BEV_EVENT_CONNECTED) {
+        probe_done(pr, true);
+    } else if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
+        probe_done(pr, false);
+    }
+}
+
+void probe_start(network *n, peer *p)
+{
+    peer_probe *pr = alloc(peer_probe);
+    pr->n = n;
+    pr->peer = p;
+    pr->start = us_clock();
+    p->last_connect_attempt = time(NULL);
+    // the same way a request would connect, so a mux opened here carries the first requests
+    pr->bev = peer_connect_bev(n, p);
+    bufferevent_setcb(pr->bev, NULL, NULL, probe_event_cb, pr);
+    bufferevent_enable(pr->bev, EV_READ);
+    pr->timeout = timer_start(n, PROBE_TIMEOUT_MS, ^{
+        pr->timeout = NULL;
+        probe_done(pr, false);
+    });
+    probes_outstanding++;
+}
+
+void probe_next(network *n)
+{
+    while (probes_outstanding < PROBE_CONCURRENCY && probe_queue_next < probe_queue_len) {
+        peer *p = probe_queue[probe_queue_next++];
+        // a request got there first
+        if (peer_mux_ready(p)) {
+            continue;
+        }
+        probe_start(n, p);
+    }
+    if (!probes_outstanding && probe_queue_next == probe_queue_len) {
+        debug("probed %u saved injectors and injector proxies\n", probe_queue_len);
+    }
+}
+
+void probe_saved_peers(network *n)
+{
+    // verified ones first, they are the most likely to still be there
+    peer_array *arrays[] = {injectors, injector_proxies};
+    for (uint pass = 0; pass < 2; pass++) {
+        for (uint a = 0; a < lenof(arrays); a++) {
+            for (uint i = 0; i < arrays[a]->length && probe_queue_len < lenof(probe_queue); i++) {
+                peer *p = arrays[a]->peers[i];
+                if (!p->last_verified == pass) {
+                    probe_queue[probe_queue_len++] = p;
+                }
+            }
+        }
+    }
+    probe_next(n);
+}
+
+void save_routes(network *n)
+{
+    if (saving_routes) {
+        return;
+    }
+    // only route_update schedules a save, and updates within the interval share one write
+    saving_routes = timer_start(n, ROUTE_SAVE_MS, ^{
+        saving_routes = NULL;
+        route_prune();
+        FILE *f = fopen("routes.dat", "wb");
+        if (!f) {
+            return;
+        }
+        hash_iter(route_per_authority, ^bool (const char *authority, void *val) {
+            route_record rr = {.stats = *(route_stats*)val};
+            snprintf(rr.authority, sizeof(rr.authority), "%s", authority);
+            fwrite(&rr, sizeof(rr), 1, f);
+            return true;
+        });
+        fclose(f);
+    });
+}
+
+void load_routes(network *n)
+{
+    FILE *f = fopen("routes.dat", "rb");
+    if (!f) {
+        return;
+    }
+    route_record rr;
+    while (fread(&rr, sizeof(rr), 1, f) == 1) {
+        rr.authority[sizeof(rr.authority) - 1] = '\0';
+        route_stats *r = route_get(rr.authority, true);
+        if (r) {
+            *r = rr.stats;
         }
-        connect_cleanup(c);
-    } else if (events & BEV_EVENT_CONNECTED) {
-        c->direct = NULL;
-        connected(c, bev);
     }
+    debug("loaded %zu routes\n", hash_length(route_per_authority));
+    fclose(f);
 }
 
 void socks_connect_req_event_cb(bufferevent *bev, short events, void *ctx)
@@ -3163,7 +4745,7 @@ void socks_event_cb(bufferevent *bev, short events, void *ctx)
     bufferevent_free(bev);
 }
 
-bufferevent* socks_connect_request(network *n, bufferevent *bev, const char *host, port_t port)
+void socks_connect_request(network *n, bufferevent *bev, const char *host, port_t port)
 {
     connect_req *c = alloc(connect_req);
     c->n = n;
@@ -3171,23 +4753,14 @@ bufferevent* socks_connect_request(network *n, bufferevent *bev, const char *hos
     char authority[1024];
     snprintf(authority, sizeof(authority), "%s:%u", host, port);
     c->authority = strdup(authority);
+    c->host = strdup(host);
+    c->port = port;
 
     debug("c:%p %s bev:%p SOCKS5 CONNECT %s:%u\n", c, __func__, bev, host, port);
 
     bufferevent_setcb(bev, NULL, NULL, socks_connect_req_event_cb, c);
 
-#if !NO_DIRECT
-    c->direct = bufferevent_socket_new(n->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
-    debug("%s bev:%p direct:%p\n", __func__, bev, c->direct);
-    bufferevent_setcb(c->direct, NULL, NULL, socks_connect_event_cb, c);
-    bufferevent_enable(c->direct, EV_READ);
-#endif
-
-    if (port == 443 || port == 80) {
-        connect_peer(c, false);
-    }
-
-    return c->direct;
+    connect_start(c, port == 443 || port == 80);
 }
 
 void socks_read_req_cb(bufferevent *bev, void *ctx);
@@ -3252,10 +4825,7 @@ void socks_read_req_cb(bufferevent *bev, void *ctx)
 
         char host[NI_MAXHOST];
         getnameinfo((sockaddr*)&sin, sizeof(sin), host, sizeof(host), NULL, 0, NI_NUMERICHOST);
-        bufferevent *b = socks_connect_request(n, bev, host, ntohs(sin.sin_port));
-        if (b) {
-            bufferevent_socket_connect(b, (sockaddr*)&sin, sizeof(sin));
-        }
+        socks_connect_request(n, bev, host, ntohs(sin.sin_port));
         break;
     }
     // domain name
@@ -3277,12 +4847,7 @@ void socks_read_req_cb(bufferevent *bev, void *ctx)
         evbuffer_drain(input, 4 + sizeof(uint8_t) + p[4] + sizeof(port_t));
         bufferevent_setcb(bev, NULL, NULL, socks_event_cb, ctx);
 
-        bufferevent *b = socks_connect_request(n, bev, host, port);
-        if (b) {
-            // XXX: disable IPv6, since evdns waits for *both* and the v6 request often times out
-            // TODO: if the request is from a peer, use LEDBAT: setsocketopt(sock, SOL_SOCKET, O_TRAFFIC_CLASS, SO_TC_BK, sizeof(int))
-            bufferevent_socket_connect_hostname(b, n->evdns, AF_INET, host, port);
-        }
+        socks_connect_request(n, bev, host, port);
         break;
     }
     // ipv6
@@ -3304,10 +4869,7 @@ void socks_read_req_cb(bufferevent *bev, void *ctx)
 
         char host[NI_MAXHOST];
         getnameinfo((sockaddr*)&sin6, sizeof(sin6), host, sizeof(host), NULL, 0, NI_NUMERICHOST);
-        bufferevent *b = socks_connect_request(n, bev, host, ntohs(sin6.sin6_port));
-        if (b) {
-            bufferevent_socket_connect(b, (sockaddr*)&sin6, sizeof(sin6));
-        }
+        socks_connect_request(n, bev, host, ntohs(sin6.sin6_port));
         break;
     }
     }
@@ -3421,6 +4983,7 @@ network* client_init(const char *app_name, const char *app_id, port_t *http_port
 
     timer_start(n, 0, ^{
         load_peers(n);
+        load_routes(n);
 
         // for local debugging
         /*
@@ -3438,6 +5001,8 @@ network* client_init(const char *app_name, const char *app_id, port_t *http_port
         };
         add_sockaddr(n, (sockaddr *)&iin, sizeof(iin));
 
+        probe_saved_peers(n);
+
         timer_callback cb = ^{
             time_t t = time(NULL);
             tm *tm = gmtime(&t);
@@ -3473,6 +5038,11 @@ int newnode_run(network *n)
     return network_loop(n);
 }
 
+void newnode_set_lan_null_cipher(bool enabled)
+{
+    lsd_null_cipher = enabled;
+}
+
 void newnode_thread(network *n)
 {
     thread(^{
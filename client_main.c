@@ -15,7 +15,7 @@ int main(int argc, char *argv[])
     char *port_s = "8006";
 
     for (;;) {
-        int c = getopt(argc, argv, "p:v");
+        int c = getopt(argc, argv, "p:nv");
         if (c == -1) {
             break;
         }
@@ -23,6 +23,9 @@ int main(int argc, char *argv[])
         case 'p':
             port_s = optarg;
             break;
+        case 'n':
+            newnode_set_lan_null_cipher(true);
+            break;
         case 'v':
             o_debug++;
             break;
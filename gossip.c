@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "base64.h"
+#include "gossip.h"
+
+
+#define GOSSIP_SLOTS 1024
+
+// per host, by hash of the IP. a collision only costs a little gossip
+typedef struct {
+    time_t sent;
+    time_t received;
+    time_t window_start;
+    uint16_t window_added;
+} gossip_slot;
+
+gossip_slot gossip_slots[GOSSIP_SLOTS];
+
+
+gossip_slot* gossip_slot_for(const sockaddr *sa)
+{
+    const uint8_t *ip;
+    size_t len;
+    switch (sa->sa_family) {
+    case AF_INET:
+        ip = (const uint8_t *)&((const sockaddr_in *)sa)->sin_addr;
+        len = sizeof(in_addr);
+        break;
+    case AF_INET6:
+        ip = (const uint8_t *)&((const sockaddr_in6 *)sa)->sin6_addr;
+        len = sizeof(in6_addr);
+        break;
+    default:
+        return NULL;
+    }
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ ip[i]) * 16777619u;
+    }
+    return &gossip_slots[h % GOSSIP_SLOTS];
+}
+
+void gossip_sample_offer(gossip_sample *s, const sockaddr *addr)
+{
+    for (size_t i = 0; i < s->num; i++) {
+        if (sockaddr_eq((const sockaddr *)&s->addrs[i], addr)) {
+            return;
+        }
+    }
+    s->seen++;
+    size_t i = s->num;
+    if (s->num < lenof(s->addrs)) {
+        s->num++;
+    } else {
+        i = randombytes_uniform((uint32_t)s->seen);
+        if (i >= lenof(s->addrs)) {
+            return;
+        }
+    }
+    memset(&s->addrs[i], 0, sizeof(s->addrs[i]));
+    memcpy(&s->addrs[i], addr, sockaddr_get_length(addr));
+}
+
+void gossip_add_header(evhttp_request *req, const char *key, const void *packed, size_t len)
+{
+    if (!len) {
+        return;
+    }
+    size_t out_len;
+    char *b64 = base64_urlsafe_encode(packed, len, &out_len);
+    overwrite_header(req, key, b64);
+    free(b64);
+}
+
+void gossip_add(evhttp_request *req, gossip_sample_cb sample)
+{
+    // a CONNECT reply (or a mux) drops output headers, so it would only use up the interval
+    if (req->type == EVHTTP_REQ_CONNECT) {
+        return;
+    }
+    sockaddr_storage to;
+    socklen_t tolen = evcon_peer_sockaddr(req->evcon, &to);
+    if (sockaddr_is_localhost((const sockaddr *)&to, tolen)) {
+        return;
+    }
+    gossip_slot *slot = gossip_slot_for((const sockaddr *)&to);
+    time_t now = time(NULL);
+    if (!slot || now - slot->sent < GOSSIP_INTERVAL) {
+        return;
+    }
+
+    gossip_sample s = {.num = 0};
+    sample(&s);
+    packed_ipv4 v4[GOSSIP_MAX];
+    packed_ipv6 v6[GOSSIP_MAX];
+    size_t num_v4 = 0;
+    size_t num_v6 = 0;
+    for (size_t i = 0; i < s.num; i++) {
+        const sockaddr *sa = (const sockaddr *)&s.addrs[i];
+        if (sockaddr_eq(sa, (const sockaddr *)&to)) {
+            continue;
+        }
+        if (sa->sa_family == AF_INET) {
+            const sockaddr_in *sin = (const sockaddr_in *)sa;
+            v4[num_v4++] = (packed_ipv4){.ip = sin->sin_addr.s_addr, .port = sin->sin_port};
+        } else if (sa->sa_family == AF_INET6) {
+            const sockaddr_in6 *sin6 = (const sockaddr_in6 *)sa;
+            v6[num_v6++] = (packed_ipv6){.ip = sin6->sin6_addr, .port = sin6->sin6_port};
+        }
+    }
+    if (!num_v4 && !num_v6) {
+        return;
+    }
+    slot->sent = now;
+    debug("gossip %zu+%zu peers to %s\n", num_v4, num_v6, sockaddr_str((const sockaddr *)&to));
+    gossip_add_header(req, "X-Peers4", v4, num_v4 * sizeof(packed_ipv4));
+    gossip_add_header(req, "X-Peers6", v6, num_v6 * sizeof(packed_ipv6));
+}
+
+bool sockaddr_is_unspecified(const sockaddr *sa)
+{
+    switch (sa->sa_family) {
+    case AF_INET:
+        return ((const sockaddr_in *)sa)->sin_addr.s_addr == INADDR_ANY;
+    case AF_INET6:
+        return IN6_IS_ADDR_UNSPECIFIED(&((const sockaddr_in6 *)sa)->sin6_addr);
+    }
+    return true;
+}
+
+bool gossip_acceptable(const sockaddr *sa, const sockaddr *from)
+{
+    // nothing on our side of the network should be probed on a stranger's word
+    return sockaddr_get_port(sa) && !sockaddr_is_unspecified(sa) && !sockaddr_is_localhost(sa, sockaddr_get_length(sa)) &&
+        !sockaddr_is_private(sa) && !sockaddr_eq(sa, from);
+}
+
+void gossip_take(gossip_slot *slot, const sockaddr *from, const sockaddr *sa, size_t *taken, gossip_addr_cb cb)
+{
+    if (*taken >= GOSSIP_MAX || slot->window_added >= GOSSIP_SOURCE_CAP || !gossip_acceptable(sa, from)) {
+        return;
+    }
+    (*taken)++;
+    if (cb(sa, sockaddr_get_length(sa))) {
+        slot->window_added++;
+    }
+}
+
+void gossip_received(const sockaddr *from, evkeyvalq *headers, gossip_addr_cb cb)
+{
+    const char *peers4 = evhttp_find_header(headers, "X-Peers4");
+    const char *peers6 = evhttp_find_header(headers, "X-Peers6");
+    if (!peers4 && !peers6) {
+        return;
+    }
+    gossip_slot *slot = gossip_slot_for(from);
+    time_t now = time(NULL);
+    if (!slot || now - slot->received < GOSSIP_INTERVAL) {
+        return;
+    }
+    slot->received = now;
+    if (now - slot->window_start >= GOSSIP_SOURCE_WINDOW) {
+        slot->window_start = now;
+        slot->window_added = 0;
+    }
+
+    size_t taken = 0;
+    size_t len;
+    if (peers4) {
+        uint8_t *packed = base64_decode(peers4, strlen(peers4), &len);
+        for (size_t i = 0; packed && i < len / sizeof(packed_ipv4); i++) {
+            const packed_ipv4 *a = (const packed_ipv4 *)&packed[i * sizeof(packed_ipv4)];
+            sockaddr_storage addr = {0};
+            sockaddr_in *sin = (sockaddr_in *)&addr;
+            sin->sin_family = AF_INET;
+            sin->sin_addr.s_addr = a->ip;
+            sin->sin_port = a->port;
+#ifdef __APPLE__
+            sin->sin_len = sizeof(sockaddr_in);
+#endif
+            gossip_take(slot, from, (const sockaddr *)&addr, &taken, cb);
+        }
+        free(packed);
+    }
+    if (peers6) {
+        uint8_t *packed = base64_decode(peers6, strlen(peers6), &len);
+        for (size_t i = 0; packed && i < len / sizeof(packed_ipv6); i++) {
+            const packed_ipv6 *a = (const packed_ipv6 *)&packed[i * sizeof(packed_ipv6)];
+            sockaddr_storage addr = {0};
+            sockaddr_in6 *sin6 = (sockaddr_in6 *)&addr;
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, &a->ip, sizeof(a->ip));
+            sin6->sin6_port = a->port;
+#ifdef __APPLE__
+            sin6->sin6_len = sizeof(sockaddr_in6);
+#endif
+            gossip_take(slot, from, (const sockaddr *)&addr, &taken, cb);
+        }
+        free(packed);
+    }
+    debug("gossip from %s took %zu, %u this window\n", sockaddr_str(from), taken, slot->window_added);
+}
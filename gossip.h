@@ -0,0 +1,32 @@
+#ifndef __GOSSIP_H__
+#define __GOSSIP_H__
+
+#include "network.h"
+#include "http.h"
+
+// most addresses sent in, or taken from, one response
+#define GOSSIP_MAX 8
+// least seconds between gossip to, or taken from, the same host
+#define GOSSIP_INTERVAL 60
+// most new addresses taken from one host per GOSSIP_SOURCE_WINDOW
+#define GOSSIP_SOURCE_CAP 32
+#define GOSSIP_SOURCE_WINDOW (60 * 60)
+
+// a uniform sample of the candidates offered to it
+typedef struct {
+    sockaddr_storage addrs[GOSSIP_MAX];
+    size_t num;
+    size_t seen;
+} gossip_sample;
+
+typedef void (^gossip_sample_cb)(gossip_sample *s);
+// true if the address was new to the caller
+typedef bool (^gossip_addr_cb)(const sockaddr *addr, socklen_t addrlen);
+
+void gossip_sample_offer(gossip_sample *s, const sockaddr *addr);
+// X-Peers4 / X-Peers6 on the response to a peer's request
+void gossip_add(evhttp_request *req, gossip_sample_cb sample);
+// addresses from the response of a peer whose signature checked out
+void gossip_received(const sockaddr *from, evkeyvalq *headers, gossip_addr_cb cb);
+
+#endif // __GOSSIP_H__
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <netdb.h>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -20,6 +21,8 @@
 #include "constants.h"
 #include "hash_table.h"
 #include "utp_bufferevent.h"
+#include "obfoo.h"
+#include "lsd.h"
 #include "http.h"
 
 
@@ -158,11 +161,28 @@ evbuffer* build_request_buffer(int response_code, evkeyvalq *hdrs)
 
 void merkle_tree_hash_request(merkle_tree *m, evhttp_request *req, evkeyvalq *hdrs)
 {
+    const char *leaf_size = evhttp_find_header(hdrs, "X-Leaf-Size");
+    if (leaf_size && !m->leaves_num && !m->leaf_progress) {
+        m->leaf_size = leaf_size_parse(leaf_size);
+    }
     evbuffer *buf = build_request_buffer(req->response_code, hdrs);
     merkle_tree_add_evbuffer(m, buf);
     evbuffer_free(buf);
 }
 
+socklen_t evcon_peer_sockaddr(evhttp_connection *evcon, sockaddr_storage *ss)
+{
+    char *host;
+    ev_uint16_t port;
+    evhttp_connection_get_peer(evcon, &host, &port);
+    if (!dns_parse_numeric(host, AF_INET, ss) && !dns_parse_numeric(host, AF_INET6, ss)) {
+        memset(ss, 0, sizeof(*ss));
+        ss->ss_family = AF_INET;
+    }
+    sockaddr_set_port((sockaddr *)ss, port);
+    return sockaddr_get_length((const sockaddr *)ss);
+}
+
 evhttp_connection *make_connection(network *n, const evhttp_uri *uri)
 {
     const char *scheme = evhttp_uri_get_scheme(uri);
@@ -174,13 +194,22 @@ evhttp_connection *make_connection(network *n, const evhttp_uri *uri)
     if (port == -1) {
         port = get_port_for_scheme(scheme);
     }
+    // prefer an address the resolver already has, in the family that last won a connection race
+    char address[NI_MAXHOST];
+    snprintf(address, sizeof(address), "%s", host);
+    int family = AF_INET;
+    sockaddr_storage ss;
+    if (dns_cached_address(n, host, &ss)) {
+        getnameinfo((sockaddr*)&ss, sockaddr_get_length((sockaddr*)&ss), address, sizeof(address), NULL, 0, NI_NUMERICHOST);
+        family = ss.ss_family;
+    }
     for (size_t i = 0; i < lenof(connections); i++) {
         evhttp_connection *evcon = connections[i];
         if (evcon) {
             char *e_host;
             ev_uint16_t e_port;
             evhttp_connection_get_peer(evcon, &e_host, &e_port);
-            if (port == e_port && strcasecmp(host, e_host) == 0) {
+            if (port == e_port && (strcasecmp(host, e_host) == 0 || strcasecmp(address, e_host) == 0)) {
                 connections[i] = NULL;
                 evhttp_connection_set_closecb(evcon, NULL, NULL);
                 debug("re-using %s:%d evcon:%p\n", e_host, e_port, evcon);
@@ -188,12 +217,12 @@ evhttp_connection *make_connection(network *n, const evhttp_uri *uri)
             }
         }
     }
-    debug("connecting to %s:%d\n", host, port);
+    debug("connecting to %s:%d (%s)\n", host, port, address);
     // XXX: doesn't handle SSL
     // TODO: if the request is from a peer, use LEDBAT: setsocketopt(sock, SOL_SOCKET, O_TRAFFIC_CLASS, SO_TC_BK, sizeof(int))
-    evhttp_connection *evcon = evhttp_connection_base_new(n->evbase, n->evdns, host, (port_t)port);
-    // XXX: disable IPv6, since evdns waits for *both* and the v6 request often times out
-    evhttp_connection_set_family(evcon, AF_INET);
+    evhttp_connection *evcon = evhttp_connection_base_new(n->evbase, n->evdns, address, (port_t)port);
+    // XXX: without a cached address, disable IPv6, since evdns waits for *both* and the v6 request often times out
+    evhttp_connection_set_family(evcon, family);
     return evcon;
 }
 
@@ -234,7 +263,11 @@ uint64 utp_on_accept(utp_callback_arguments *a)
 #endif
     ddebug("utp_on_accept %p %s\n", a->socket, sockaddr_str((const sockaddr*)&addr));
     add_sockaddr(n, (sockaddr *)&addr, addrlen);
-    int fd = utp_socket_create_fd(n->evbase, a->socket);
+    uint32_t crypto_provide = OBFOO_CHACHA20 | OBFOO_AES256_CTR;
+    if (lsd_null_cipher && lsd_is_lan_peer((const sockaddr *)&addr)) {
+        crypto_provide |= OBFOO_NULL;
+    }
+    int fd = utp_socket_create_fd(n->evbase, a->socket, crypto_provide);
     if (fd < 0) {
         debug("%s failed %d %s\n", __func__, errno, strerror(errno));
         utp_close(a->socket);
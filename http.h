@@ -38,6 +38,7 @@ void hash_headers(evkeyvalq *in, crypto_generichash_state *content_state);
 void hash_request(evhttp_request *req, evkeyvalq *hdrs, crypto_generichash_state *content_state);
 void merkle_tree_hash_request(merkle_tree *m, evhttp_request *req, evkeyvalq *hdrs);
 evbuffer* build_request_buffer(int response_code, evkeyvalq *hdrs);
+socklen_t evcon_peer_sockaddr(evhttp_connection *evcon, sockaddr_storage *ss);
 
 evhttp_connection *make_connection(network *n, const evhttp_uri *uri);
 void return_connection(evhttp_connection *evcon);
@@ -113,10 +113,15 @@ void icmp_handler(network *n)
                 hexdump(vec_buf, len);
             }
 
-            if (e->ee_type == 3 && e->ee_code == 4) {
-                ddebug("ICMP type 3, code 4: Fragmentation error, discovered MTU %d\n", e->ee_info);
+            bool frag_needed = e->ee_origin == SO_EE_ORIGIN_ICMP && e->ee_type == 3 && e->ee_code == 4;
+            // ICMPv6 type 2: packet too big
+            bool too_big = e->ee_origin == SO_EE_ORIGIN_ICMP6 && e->ee_type == 2;
+            if (frag_needed || too_big) {
+                ddebug("ICMP type %d, code %d: Fragmentation error, discovered MTU %d\n", e->ee_type, e->ee_code, e->ee_info);
+                // remember it for the next connection to this address
+                pmtu_update((const sockaddr *)&remote, e->ee_info);
                 utp_process_icmp_fragmentation(n->utp, vec_buf, len, (const sockaddr *)&remote, remote_len, e->ee_info);
-                // XXX: can dht do anything with fragmentation?
+                // XXX: can dht do anything with fragmentation? its messages are sized by the dht library
             } else {
                 ddebug("ICMP type %d, code %d\n", e->ee_type, e->ee_code);
                 utp_process_icmp_error(n->utp, vec_buf, len, (const sockaddr *)&remote, remote_len);
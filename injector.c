@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
 
@@ -19,6 +20,7 @@
 #include "utp.h"
 #include "base64.h"
 #include "timer.h"
+#include "thread.h"
 #include "network.h"
 #include "constants.h"
 #include "bev_splice.h"
@@ -26,6 +28,8 @@
 #include "stall_detector.h"
 #include "utp_bufferevent.h"
 #include "http.h"
+#include "mux.h"
+#include "batch.h"
 
 
 typedef struct {
@@ -36,8 +40,15 @@ typedef struct {
     uint64 start_time;
     evhttp_request *req;
     merkle_tree *m;
+    work_queue *signing;
 } proxy_request;
 
+typedef struct {
+    uint8_t root_hash[crypto_generichash_BYTES];
+    char *b64_msign;
+    char *b64_hashes;
+} signed_response;
+
 unsigned char pk[crypto_sign_PUBLICKEYBYTES] = injector_pk;
 #ifdef injector_sk
 unsigned char sk[crypto_sign_SECRETKEYBYTES] = injector_sk;
@@ -71,8 +82,9 @@ void content_sign(content_sig *sig, const uint8_t *content_hash)
 {
     // base64(sign("sign" + timestamp + hash(headers + content)))
     time_t now = time(NULL);
+    tm t;
     char ts[sizeof("2011-10-08T07:07:09Z")];
-    strftime(ts, sizeof(ts), "%FT%TZ", gmtime(&now));
+    strftime(ts, sizeof(ts), "%FT%TZ", gmtime_r(&now, &t));
     assert(sizeof(ts) - 1 == strlen(ts));
 
     memcpy(sig->sign, "sign", sizeof(sig->sign));
@@ -83,9 +95,10 @@ void content_sign(content_sig *sig, const uint8_t *content_hash)
 
 void request_cleanup(proxy_request *p)
 {
-    if (p->req) {
+    if (p->req || work_queue_busy(p->signing)) {
         return;
     }
+    work_queue_cancel(p->signing);
     if (p->evcon) {
         evhttp_connection_free(p->evcon);
     }
@@ -96,6 +109,41 @@ void request_cleanup(proxy_request *p)
     free(p);
 }
 
+void send_signed_response(proxy_request *p, int code, const char *code_line, signed_response *s)
+{
+    debug("returning X-MSign for %s %s\n", evhttp_request_get_uri(p->server_req), s->b64_msign);
+    evhttp_add_header(p->server_req->output_headers, "X-MSign", s->b64_msign);
+    if (s->b64_hashes) {
+        evhttp_add_header(p->server_req->output_headers, "X-Hashes", s->b64_hashes);
+    }
+
+    bool matches = false;
+    char *ifnonematch = (char*)evhttp_find_header(p->server_req->input_headers, "If-None-Match");
+    if (ifnonematch) {
+        size_t root_etag_len;
+        char *root_etag = base64_urlsafe_encode((uint8_t*)&s->root_hash, sizeof(s->root_hash), &root_etag_len);
+        size_t if_len = strlen(ifnonematch);
+        if (if_len > 0) {
+            if (ifnonematch[if_len - 1] == '"') {
+                ifnonematch[if_len - 1] = '\0';
+            }
+            ifnonematch++;
+        }
+        matches = streq(ifnonematch, root_etag);
+        if (!matches) {
+            debug("If-None-Match: %s != %s\n", ifnonematch, root_etag);
+        }
+        free(root_etag);
+    }
+    if (matches) {
+        evhttp_send_reply(p->server_req, 304, "Not Modified", NULL);
+    } else {
+        debug("pending_output:%zu uri:%s\n", p->pending_output ? evbuffer_get_length(p->pending_output) : 0,
+            evhttp_request_get_uri(p->server_req));
+        evhttp_send_reply(p->server_req, code, code_line, p->pending_output);
+    }
+}
+
 void request_done_cb(evhttp_request *req, void *arg)
 {
     proxy_request *p = (proxy_request*)arg;
@@ -104,61 +152,47 @@ void request_done_cb(evhttp_request *req, void *arg)
         return;
     }
     p->req = NULL;
-    if (p->server_req && p->server_req->evcon) {
-        evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
-    }
     if (req->response_code != 0 && p->server_req) {
         debug("p:%p server_request_done_cb: %s\n", p, evhttp_request_get_uri(p->server_req));
 
-        const char *uri = evhttp_request_get_uri(p->server_req);
-
-        uint8_t root_hash[crypto_generichash_BYTES];
-        merkle_tree_get_root(p->m, root_hash);
-        content_sig sig;
-        content_sign(&sig, root_hash);
-        size_t out_len;
-        char *b64_msign = base64_urlsafe_encode((uint8_t*)&sig, sizeof(sig), &out_len);
-        debug("returning X-MSign for %s %s\n", uri, b64_msign);
-
-        evhttp_add_header(p->server_req->output_headers, "X-MSign", b64_msign);
-        free(b64_msign);
-
-        char *hashrequest = (char*)evhttp_find_header(p->server_req->input_headers, "X-HashRequest");
-        char *b64_hashes = NULL;
-        if (hashrequest) {
-            static_assert(sizeof(node) == member_sizeof(node, hash), "node hash packing");
-            size_t node_len = p->m->leaves_num * member_sizeof(node, hash);
-            b64_hashes = base64_urlsafe_encode((uint8_t*)p->m->nodes, node_len, &out_len);
-            evhttp_add_header(p->server_req->output_headers, "X-Hashes", b64_hashes);
-            free(b64_hashes);
+        // finishing the tree, signing and encoding the leaves is too slow for the loop on large responses
+        int code = req->response_code;
+        char *code_line = strdup(req->response_code_line);
+        bool hashrequest = !!evhttp_find_header(p->server_req->input_headers, "X-HashRequest");
+        merkle_tree *m = p->m;
+        signed_response *s = alloc(signed_response);
+        if (!p->signing) {
+            p->signing = work_queue_new();
         }
-
-        bool matches = false;
-        char *ifnonematch = (char*)evhttp_find_header(p->server_req->input_headers, "If-None-Match");
-        if (ifnonematch) {
-            size_t root_etag_len;
-            char *root_etag = base64_urlsafe_encode((uint8_t*)&root_hash, sizeof(root_hash), &root_etag_len);
-            size_t if_len = strlen(ifnonematch);
-            if (if_len > 0) {
-                if (ifnonematch[if_len - 1] == '"') {
-                    ifnonematch[if_len - 1] = '\0';
+        work_queue_submit(p->signing, ^{
+            merkle_tree_get_root(m, s->root_hash);
+            content_sig sig;
+            content_sign(&sig, s->root_hash);
+            size_t out_len;
+            s->b64_msign = base64_urlsafe_encode((uint8_t*)&sig, sizeof(sig), &out_len);
+            if (hashrequest) {
+                static_assert(sizeof(node) == member_sizeof(node, hash), "node hash packing");
+                size_t node_len = m->leaves_num * member_sizeof(node, hash);
+                s->b64_hashes = base64_urlsafe_encode((uint8_t*)m->nodes, node_len, &out_len);
+            }
+        }, ^(bool cancelled) {
+            if (!cancelled && p->server_req) {
+                if (p->server_req->evcon) {
+                    evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
                 }
-                ifnonematch++;
+                send_signed_response(p, code, code_line, s);
+                p->server_req = NULL;
             }
-            matches = streq(ifnonematch, root_etag);
-            if (!matches) {
-                debug("If-None-Match: %s != %s\n", ifnonematch, root_etag);
+            free(s->b64_msign);
+            free(s->b64_hashes);
+            free(s);
+            free(code_line);
+            if (!cancelled) {
+                request_cleanup(p);
             }
-            free(root_etag);
-        }
-        if (matches) {
-            evhttp_send_reply(p->server_req, 304, "Not Modified", NULL);
-        } else {
-            debug("pending_output:%zu uri:%s\n", p->pending_output ? evbuffer_get_length(p->pending_output) : 0,
-                evhttp_request_get_uri(p->server_req));
-            evhttp_send_reply(p->server_req, req->response_code, req->response_code_line, p->pending_output);
-        }
-        p->server_req = NULL;
+        });
+    } else if (p->server_req && p->server_req->evcon) {
+        evhttp_connection_set_closecb(p->server_req->evcon, NULL, NULL);
     }
     if (req->response_code != 0) {
         return_connection(p->evcon);
@@ -211,6 +245,17 @@ int header_cb(evhttp_request *req, void *arg)
     char *content_length = (char*)evhttp_find_header(req->input_headers, "Content-Length");
     debug("Content-Length:%s uri:%s\n", content_length, evhttp_request_get_uri(p->server_req));
 
+    // the leaf size is ours to declare, not the origin's, and older clients only hash with the default
+    evhttp_remove_header(p->server_req->output_headers, "X-Leaf-Size");
+    if (content_length && evhttp_find_header(p->server_req->input_headers, "X-Leaf-Sizes")) {
+        uint32_t leaf_size = leaf_size_for_length(strtoull(content_length, NULL, 10));
+        if (leaf_size != LEAF_CHUNK_SIZE) {
+            char leaf_size_str[sizeof("4294967295")];
+            snprintf(leaf_size_str, sizeof(leaf_size_str), "%"PRIu32, leaf_size);
+            overwrite_header(p->server_req, "X-Leaf-Size", leaf_size_str);
+        }
+    }
+
     merkle_tree_hash_request(p->m, req, p->server_req->output_headers);
 
     evhttp_request_set_chunked_cb(req, chunked_cb);
@@ -274,6 +319,11 @@ void submit_request(network *n, evhttp_request *server_req, evhttp_connection *e
     evhttp_remove_header(p->req->output_headers, "Range");
     evhttp_remove_header(p->req->output_headers, "If-Range");
 
+    // the connection may be to a cached numeric address, so don't let evhttp fill in Host
+    if (!evhttp_find_header(p->req->output_headers, "Host")) {
+        evhttp_add_header(p->req->output_headers, "Host", evhttp_uri_get_host(uri));
+    }
+
     overwrite_header(p->req, "User-Agent", "newnode/" VERSION);
 
     evhttp_request_set_header_cb(p->req, header_cb);
@@ -288,7 +338,7 @@ void submit_request(network *n, evhttp_request *server_req, evhttp_connection *e
 
 typedef struct {
     evhttp_request *server_req;
-    bufferevent *direct;
+    happy_eyeballs *direct;
     uint64 start_time;
 } connect_req;
 
@@ -356,25 +406,6 @@ void connected(connect_req *c, bufferevent *other)
     bufferevent_enable(bev, EV_READ|EV_WRITE);
 }
 
-void connect_event_cb(bufferevent *bev, short events, void *ctx)
-{
-    connect_req *c = (connect_req *)ctx;
-    debug("c:%p (%.2fms) connect_event_cb bev:%p req:%s events:0x%x %s\n", c, cdelta(c), bev, evhttp_request_get_uri(c->server_req), events, bev_events_to_str(events));
-
-    if (events & BEV_EVENT_TIMEOUT) {
-        connect_cleanup(c, ETIMEDOUT);
-    } else if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-        int err = bufferevent_get_error(bev);
-        bufferevent_free(bev);
-        c->direct = NULL;
-        connect_cleanup(c, err);
-    } else if (events & BEV_EVENT_CONNECTED) {
-        bufferevent_set_timeouts(c->direct, NULL, NULL);
-        c->direct = NULL;
-        connected(c, bev);
-    }
-}
-
 void close_cb(evhttp_connection *evcon, void *ctx)
 {
     connect_req *c = (connect_req *)ctx;
@@ -382,7 +413,7 @@ void close_cb(evhttp_connection *evcon, void *ctx)
     evhttp_connection_set_closecb(evcon, NULL, NULL);
     c->server_req = NULL;
     if (c->direct) {
-        bufferevent_free(c->direct);
+        happy_eyeballs_cancel(c->direct);
         c->direct = NULL;
     }
     connect_cleanup(c, 0);
@@ -414,12 +445,15 @@ void connect_request(network *n, evhttp_request *req)
 
     evhttp_connection_set_closecb(req->evcon, close_cb, c);
 
-    c->direct = bufferevent_socket_new(n->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(c->direct, NULL, NULL, connect_event_cb, c);
-    const timeval conn_tv = { 45, 0 };
-    bufferevent_set_timeouts(c->direct, &conn_tv, &conn_tv);
-    bufferevent_enable(c->direct, EV_READ);
-    bufferevent_socket_connect_hostname(c->direct, n->evdns, AF_INET, host, port);
+    c->direct = happy_eyeballs_connect(n, host, port, 45000, ^(bufferevent *bev, int err) {
+        debug("c:%p (%.2fms) connect bev:%p req:%s error:%d %s\n", c, cdelta(c), bev, evhttp_request_get_uri(c->server_req), err, strerror(err));
+        c->direct = NULL;
+        if (!bev) {
+            connect_cleanup(c, err);
+            return;
+        }
+        connected(c, bev);
+    });
     evhttp_uri_free(uri);
 }
 
@@ -432,11 +466,22 @@ void http_request_cb(evhttp_request *req, void *arg)
     debug("con:%p %s:%u request received %s %s\n", req->evcon, e_host, e_port,
         evhttp_method(req->type), evhttp_request_get_uri(req));
 
+    if (mux_request(n, req)) {
+        return;
+    }
+
     if (req->type == EVHTTP_REQ_CONNECT) {
         connect_request(n, req);
         return;
     }
 
+    if (req->type == EVHTTP_REQ_POST) {
+        if (!batch_request(n, req)) {
+            evhttp_send_error(req, 405, "Method Not Allowed");
+        }
+        return;
+    }
+
     if (req->type == EVHTTP_REQ_TRACE) {
 
         char *useragent = (char*)evhttp_find_header(req->input_headers, "User-Agent");
@@ -590,7 +635,7 @@ static_assert(20 >= crypto_generichash_BYTES_MIN, "dht hash must fit in generich
     cb();
     timer_repeating(n, 25 * 60 * 1000, cb);
 
-    evhttp_set_allowed_methods(n->http, EVHTTP_REQ_GET | EVHTTP_REQ_CONNECT | EVHTTP_REQ_TRACE | EVHTTP_REQ_OPTIONS);
+    evhttp_set_allowed_methods(n->http, EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_CONNECT | EVHTTP_REQ_TRACE | EVHTTP_REQ_OPTIONS);
     evhttp_set_gencb(n->http, http_request_cb, n);
     evhttp_bind_socket_with_handle(n->http, "127.0.0.1", port);
     printf("listening on TCP: %s:%d\n", "127.0.0.1", port);
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
 #ifdef __linux__
 #include <asm/types.h>
@@ -15,11 +16,31 @@
 
 
 typedef struct ip_mreq ip_mreq;
+typedef struct ipv6_mreq ipv6_mreq;
 void lsd_setup(network *n);
 
+#define LSD_PEERS_MAX 64
+// announcements repeat every 25 minutes
+#define LSD_PEER_EXPIRE (60 * 60)
+
+#define LSD_GROUP "239.192.0.0"
+#define LSD_GROUP6 "ff02::efc0:0"
+#define LSD_PORT 9190
+
+// IPv4 peers are kept v4-mapped
+typedef struct {
+    in6_addr addr;
+    uint32_t scope_id;
+    time_t last_seen;
+} lsd_peer;
+
+bool lsd_null_cipher;
 int lsd_fd = -1;
+int lsd6_fd = -1;
 event lsd_event;
+event lsd6_event;
 event route_event;
+lsd_peer lsd_peers[LSD_PEERS_MAX];
 
 bool starts_with(const char *restrict string, const char *restrict prefix)
 {
@@ -31,6 +52,84 @@ bool starts_with(const char *restrict string, const char *restrict prefix)
     return true;
 }
 
+bool lsd_in6_addr(const sockaddr *sa, in6_addr *a, uint32_t *scope_id)
+{
+    switch(sa->sa_family) {
+    case AF_INET:
+        memset(a, 0, sizeof(*a));
+        a->s6_addr[10] = 0xff;
+        a->s6_addr[11] = 0xff;
+        memcpy(&a->s6_addr[12], &((const sockaddr_in *)sa)->sin_addr, sizeof(in_addr));
+        *scope_id = 0;
+        return true;
+    case AF_INET6: {
+        const sockaddr_in6 *sin6 = (const sockaddr_in6 *)sa;
+        *a = sin6->sin6_addr;
+        // fe80:: is only unique per interface
+        *scope_id = IN6_IS_ADDR_LINKLOCAL(a) ? sin6->sin6_scope_id : 0;
+        return true;
+    }
+    }
+    return false;
+}
+
+// private IPv4, fc00::/7 and fe80::/10
+lsd_peer* lsd_find_peer(const sockaddr *sa, in6_addr *a, uint32_t *scope_id)
+{
+    if (!sockaddr_is_private(sa) || !lsd_in6_addr(sa, a, scope_id)) {
+        return NULL;
+    }
+    for (size_t i = 0; i < lenof(lsd_peers); i++) {
+        lsd_peer *p = &lsd_peers[i];
+        if (p->last_seen && memeq(&p->addr, a, sizeof(*a)) && p->scope_id == *scope_id) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+void lsd_add_peer(const sockaddr *sa)
+{
+    in6_addr a;
+    uint32_t scope_id;
+    lsd_peer *p = lsd_find_peer(sa, &a, &scope_id);
+    if (!p) {
+        if (!sockaddr_is_private(sa)) {
+            return;
+        }
+        p = &lsd_peers[0];
+        for (size_t i = 0; i < lenof(lsd_peers); i++) {
+            if (lsd_peers[i].last_seen < p->last_seen) {
+                p = &lsd_peers[i];
+            }
+        }
+        p->addr = a;
+        p->scope_id = scope_id;
+    }
+    p->last_seen = time(NULL);
+}
+
+bool lsd_is_lan_peer(const sockaddr *sa)
+{
+    in6_addr a;
+    uint32_t scope_id;
+    const lsd_peer *p = lsd_find_peer(sa, &a, &scope_id);
+    return p && time(NULL) - p->last_seen < LSD_PEER_EXPIRE;
+}
+
+void lsd_sendto(int fd, const char *buf, int len, const sockaddr *addr, socklen_t addrlen)
+{
+    for (int i = 0; i < 3; i++) {
+        if (sendto(fd, buf, len, 0, addr, addrlen) == -1) {
+            if (errno == ENETDOWN || errno == ENETUNREACH) {
+                return;
+            }
+            fprintf(stderr, "lsd error %d %s\n", errno, strerror(errno));
+            return;
+        }
+    }
+}
+
 void lsd_send(network *n, bool reply)
 {
     sockaddr_storage ss;
@@ -41,27 +140,37 @@ void lsd_send(network *n, bool reply)
     // XXX: TODO: remove SEARCH/REPLY once we have bidirectional peer connections
     int len = snprintf(buf, sizeof(buf),
                        "NN-%s * HTTP/1.1\r\n"
-                       "Host: 239.192.0.0:9190\r\n"
+                       "Host: " LSD_GROUP ":%d\r\n"
                        "Port: %d\r\n"
-                       "\r\n", reply?"REPLY":"SEARCH", sockaddr_get_port((sockaddr*)&ss));
+                       "\r\n", reply?"REPLY":"SEARCH", LSD_PORT, sockaddr_get_port((sockaddr*)&ss));
 
-    for (int i = 0; i < 3; i++) {
-        sockaddr_in addr = {
-            .sin_family = AF_INET,
-            .sin_addr.s_addr = inet_addr("239.192.0.0"),
-            .sin_port = htons(9190),
+    sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr(LSD_GROUP),
+        .sin_port = htons(LSD_PORT),
 #ifdef __APPLE__
-            .sin_len = sizeof(addr)
+        .sin_len = sizeof(addr)
 #endif
-        };
-        if (sendto(lsd_fd, buf, len, 0, (sockaddr *)&addr, sizeof(addr)) == -1) {
-            if (errno == ENETDOWN || errno == ENETUNREACH) {
-                return;
-            }
-            fprintf(stderr, "lsd error %d %s\n", errno, strerror(errno));
-            return;
-        }
+    };
+    lsd_sendto(lsd_fd, buf, len, (sockaddr *)&addr, sizeof(addr));
+
+    if (lsd6_fd == -1) {
+        return;
     }
+    len = snprintf(buf, sizeof(buf),
+                   "NN-%s * HTTP/1.1\r\n"
+                   "Host: [" LSD_GROUP6 "]:%d\r\n"
+                   "Port: %d\r\n"
+                   "\r\n", reply?"REPLY":"SEARCH", LSD_PORT, sockaddr_get_port((sockaddr*)&ss));
+    sockaddr_in6 addr6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(LSD_PORT),
+#ifdef __APPLE__
+        .sin6_len = sizeof(addr6)
+#endif
+    };
+    inet_pton(AF_INET6, LSD_GROUP6, &addr6.sin6_addr);
+    lsd_sendto(lsd6_fd, buf, len, (sockaddr *)&addr6, sizeof(addr6));
 }
 
 void lsd_read_cb(evutil_socket_t fd, short events, void *arg)
@@ -98,6 +207,7 @@ void lsd_read_cb(evutil_socket_t fd, short events, void *arg)
                 getnameinfo((sockaddr *)&addr, addrlen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV);
                 debug("lsd peer %s:%s\n", host, serv);
             }
+            lsd_add_peer((sockaddr *)&addr);
             add_sockaddr(n, (sockaddr *)&addr, addrlen);
         }
     }
@@ -111,11 +221,63 @@ void route_read_cb(evutil_socket_t fd, short events, void *arg)
     lsd_setup(n);
 }
 
+// link-local scope, so peers reached over fe80:: and fc00::/7 are found too. optional, like IPv6
+void lsd6_setup(network *n)
+{
+    int fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == -1) {
+        return;
+    }
+
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval));
+
+    sockaddr_in6 addr = {
+        .sin6_family = AF_INET6,
+        .sin6_addr = in6addr_any,
+        .sin6_port = htons(LSD_PORT),
+#ifdef __APPLE__
+        .sin6_len = sizeof(addr)
+#endif
+    };
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr))) {
+        debug("lsd6 bind %d %s\n", errno, strerror(errno));
+        evutil_closesocket(fd);
+        return;
+    }
+
+    ipv6_mreq mreqv6 = {.ipv6mr_interface = 0};
+    inet_pton(AF_INET6, LSD_GROUP6, &mreqv6.ipv6mr_multiaddr);
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, (const void *)&mreqv6, sizeof(mreqv6))) {
+        debug("lsd6 IPV6_JOIN_GROUP %d %s\n", errno, strerror(errno));
+        evutil_closesocket(fd);
+        return;
+    }
+    int option = 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (const void *)&option, sizeof(option))) {
+        debug("lsd6 IPV6_MULTICAST_LOOP %d %s\n", errno, strerror(errno));
+    }
+
+    evutil_make_socket_closeonexec(fd);
+    evutil_make_socket_nonblocking(fd);
+
+    lsd6_fd = fd;
+    event_assign(&lsd6_event, n->evbase, lsd6_fd, EV_READ|EV_PERSIST, lsd_read_cb, n);
+    event_add(&lsd6_event, NULL);
+}
+
 void lsd_setup(network *n)
 {
     timer_callback cb = ^{
         lsd_send(n, false);
     };
+    if (lsd6_fd != -1) {
+        evutil_closesocket(lsd6_fd);
+        event_del(&lsd6_event);
+        lsd6_fd = -1;
+    }
     if (lsd_fd != -1) {
         evutil_closesocket(lsd_fd);
         event_del(&lsd_event);
@@ -143,7 +305,7 @@ void lsd_setup(network *n)
     sockaddr_in addr = {
         .sin_family = AF_INET,
         .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(9190),
+        .sin_port = htons(LSD_PORT),
 #ifdef __APPLE__
         .sin_len = sizeof(addr)
 #endif
@@ -154,7 +316,7 @@ void lsd_setup(network *n)
 
     // http://www.iana.org/assignments/multicast-addresses
     ip_mreq mreqv4 = {
-        .imr_multiaddr.s_addr = inet_addr("239.192.0.0"),
+        .imr_multiaddr.s_addr = inet_addr(LSD_GROUP),
         .imr_interface.s_addr = inet_addr("0.0.0.0")
     };
     if (setsockopt(lsd_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const void *)&mreqv4, sizeof(mreqv4))) {
@@ -183,5 +345,7 @@ void lsd_setup(network *n)
     event_assign(&lsd_event, n->evbase, lsd_fd, EV_READ|EV_PERSIST, lsd_read_cb, n);
     event_add(&lsd_event, NULL);
 
+    lsd6_setup(n);
+
     cb();
 }
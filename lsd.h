@@ -4,8 +4,13 @@
 #include "network.h"
 
 
+// negotiate no obfuscation with peers found by LSD on a private subnet.
+// off unless the app opts in, and both sides have to.
+extern bool lsd_null_cipher;
+
 void lsd_setup(network *n);
 void lsd_send(network *n, bool reply);
+bool lsd_is_lan_peer(const sockaddr *sa);
 
 // defined by caller
 void add_sockaddr(network *n, const sockaddr *addr, socklen_t addrlen);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sodium.h>
@@ -10,6 +11,28 @@
 #include "merkle_tree.h"
 
 
+uint32_t leaf_size_for_length(uint64_t length)
+{
+    uint32_t leaf_size = LEAF_CHUNK_SIZE;
+    while (leaf_size < LEAF_CHUNK_SIZE_MAX && length / leaf_size > LEAF_CHUNKS_TARGET) {
+        leaf_size *= 2;
+    }
+    return leaf_size;
+}
+
+uint32_t leaf_size_parse(const char *s)
+{
+    // 0 for anything other than a power of two in range
+    char *endp;
+    unsigned long leaf_size = strtoul(s, &endp, 10);
+    if (*s == '\0' || *endp != '\0' ||
+        leaf_size < LEAF_CHUNK_SIZE || leaf_size > LEAF_CHUNK_SIZE_MAX ||
+        (leaf_size & (leaf_size - 1))) {
+        return 0;
+    }
+    return (uint32_t)leaf_size;
+}
+
 void merkle_tree_free(merkle_tree *m)
 {
     if (!m) {
@@ -73,17 +96,20 @@ void merkle_tree_leaf_finish(merkle_tree *m)
 
 void merkle_tree_add_hashed_data(merkle_tree *m, const uint8_t *data, size_t length)
 {
+    if (!m->leaf_size) {
+        m->leaf_size = LEAF_CHUNK_SIZE;
+    }
     for (size_t remain = length; remain; ) {
-        assert(m->leaf_progress < LEAF_CHUNK_SIZE);
+        assert(m->leaf_progress < m->leaf_size);
         if (m->leaf_progress == 0) {
             crypto_generichash_init(&m->leaf_state, NULL, 0, member_sizeof(node, hash));
         }
-        size_t len = MIN(LEAF_CHUNK_SIZE - m->leaf_progress, remain);
+        size_t len = MIN(m->leaf_size - m->leaf_progress, remain);
         crypto_generichash_update(&m->leaf_state, &data[length - remain], len);
         remain -= len;
         m->leaf_progress += len;
-        assert(m->leaf_progress <= LEAF_CHUNK_SIZE);
-        if (m->leaf_progress == LEAF_CHUNK_SIZE) {
+        assert(m->leaf_progress <= m->leaf_size);
+        if (m->leaf_progress == m->leaf_size) {
             merkle_tree_leaf_finish(m);
         }
     }
@@ -2,6 +2,9 @@
 #define __MERKLE_TREE_H__
 
 #define LEAF_CHUNK_SIZE 16384
+#define LEAF_CHUNK_SIZE_MAX (1024 * 1024)
+// large objects get bigger leaves, declared in the hashed X-Leaf-Size header
+#define LEAF_CHUNKS_TARGET 4096
 
 typedef struct {
     uint8_t hash[crypto_generichash_BYTES];
@@ -9,12 +12,16 @@ typedef struct {
 
 typedef struct {
     crypto_generichash_state leaf_state;
-    uint16_t leaf_progress;
+    uint32_t leaf_size;
+    uint32_t leaf_progress;
     size_t leaves_num;
     size_t nodes_alloc;
     node *nodes;
 } merkle_tree;
 
+uint32_t leaf_size_for_length(uint64_t length);
+uint32_t leaf_size_parse(const char *s);
+
 void merkle_tree_free(merkle_tree *m);
 bool merkle_tree_set_leaves(merkle_tree *m, const uint8_t *data, size_t length);
 void merkle_tree_set_leaf(merkle_tree *m, size_t leaf_idx, const uint8_t *hash);
@@ -0,0 +1,606 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <Block.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "log.h"
+#include "mux.h"
+#include "timer.h"
+
+
+// many HTTP and CONNECT streams over one obfoo/uTP connection.
+//
+// carrier < frames < mux < stream bev < socketpair < evhttp / splice
+//
+// each frame is a mux_frame header and up to MUX_FRAME_MAX bytes. a stream
+// may have a window of bytes in flight; the receiver returns credit as the
+// app takes them. a sender with data and no credit says BLOCKED, and if the
+// app has already read what arrived, the window is smaller than the path's
+// bandwidth-delay product, so the receiver doubles it, up to MUX_WINDOW_MAX.
+// the scheduler sends one frame at a time from the most urgent stream with
+// data and credit, round robin within a priority, and keeps the carrier
+// shallow so a new urgent stream doesn't queue behind bulk. a stream's
+// priority comes with its OPEN and can change with a PRIORITY frame. an
+// OPEN past MUX_MAX_STREAMS, or past the fds this process spares for
+// streams, is answered with RST.
+
+
+#define MUX_FRAME_MAX 16384
+// the window a stream starts with, and the most it grows to: 4MiB covers
+// ~330Mbps at 100ms
+#define MUX_WINDOW (256 * 1024)
+#define MUX_WINDOW_MAX (4 * 1024 * 1024)
+// credit is returned in pieces at least this big, or once the app has it all
+#define MUX_CREDIT_MIN (MUX_FRAME_MAX * 2)
+#define MUX_CARRIER_LOWAT (64 * 1024)
+#define MUX_REPLY_MAX 4096
+#define MUX_IDLE_MS 60000
+// streams either side may have open at once; the peer resets any OPEN past it
+#define MUX_MAX_STREAMS 64
+
+enum {
+    MUX_OPEN = 1,
+    MUX_DATA = 2,
+    MUX_FIN = 3,
+    MUX_RST = 4,
+    MUX_WINDOW_UPDATE = 5,
+    MUX_PRIORITY = 6,
+    MUX_BLOCKED = 7,
+};
+
+typedef struct {
+    uint32_t stream;
+    uint8_t type;
+    uint8_t priority;
+    uint16_t length;
+} PACKED mux_frame;
+
+typedef struct mux_stream {
+    mux *m;
+    uint32_t id;
+    uint8_t priority;
+    bufferevent *bev;
+    // the caller's end, not owned, to find the stream by
+    bufferevent *app;
+    // held until the peer agrees to the mux, then told it's connected
+    bufferevent *app_bev;
+    uint32_t send_window;
+    uint32_t recv_window;
+    uint32_t unacked;
+    bool read_eof:1;
+    bool blocked:1;
+    bool fin_sent:1;
+    bool fin_received:1;
+    TAILQ_ENTRY(mux_stream) next;
+} mux_stream;
+
+struct mux {
+    network *n;
+    bufferevent *carrier;
+    mux_closed_cb closed;
+    sockaddr_storage addr;
+    socklen_t addrlen;
+    uint32_t next_id;
+    size_t num_streams;
+    timer *idle;
+    TAILQ_HEAD(, mux_stream) streams;
+    bool incoming:1;
+    bool ready:1;
+    bool refused:1;
+    bool closing:1;
+};
+
+// streams of all muxes; each holds both ends of a socketpair
+size_t mux_streams_total;
+
+
+void mux_close(mux *m);
+
+void mux_fail(mux *m)
+{
+    m->refused = true;
+    mux_close(m);
+}
+
+// a quarter of the fds for streams, the rest for sockets and the cache
+bool mux_stream_budget()
+{
+    rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile)) {
+        return false;
+    }
+    return (mux_streams_total + 1) * 2 <= nofile.rlim_cur / 4;
+}
+
+void mux_send_frame(mux *m, uint32_t id, uint8_t type, uint8_t priority, uint16_t length)
+{
+    mux_frame f = {.stream = htonl(id), .type = type, .priority = priority, .length = htons(length)};
+    evbuffer_add(bufferevent_get_output(m->carrier), &f, sizeof(f));
+}
+
+mux_stream* mux_stream_find(mux *m, uint32_t id)
+{
+    mux_stream *s;
+    TAILQ_FOREACH(s, &m->streams, next) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void mux_idle(mux *m)
+{
+    if (m->incoming || m->closing || m->num_streams || m->idle) {
+        return;
+    }
+    m->idle = timer_start(m->n, MUX_IDLE_MS, ^{
+        m->idle = NULL;
+        mux_close(m);
+    });
+}
+
+void mux_stream_free(mux_stream *s)
+{
+    mux *m = s->m;
+    TAILQ_REMOVE(&m->streams, s, next);
+    m->num_streams--;
+    mux_streams_total--;
+    // closes the socketpair, so the app sees EOF
+    bufferevent_free(s->bev);
+    if (s->app_bev) {
+        // never got going
+        bufferevent_trigger_event(s->app_bev, BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
+        bufferevent_decref(s->app_bev);
+    }
+    free(s);
+    mux_idle(m);
+}
+
+void mux_stream_reset(mux_stream *s)
+{
+    if (s->m->ready) {
+        mux_send_frame(s->m, s->id, MUX_RST, 0, 0);
+    }
+    mux_stream_free(s);
+}
+
+bool mux_stream_check_close(mux_stream *s)
+{
+    if (!s->fin_sent || !s->fin_received || evbuffer_get_length(bufferevent_get_output(s->bev))) {
+        return false;
+    }
+    mux_stream_free(s);
+    return true;
+}
+
+void mux_stream_stop_writing(mux_stream *s)
+{
+    // the peer is done sending and the app has it all
+    bufferevent_disable(s->bev, EV_WRITE);
+    shutdown(bufferevent_getfd(s->bev), SHUT_WR);
+    mux_stream_check_close(s);
+}
+
+void mux_flush(mux *m)
+{
+    if (!m->ready) {
+        return;
+    }
+    evbuffer *out = bufferevent_get_output(m->carrier);
+    while (evbuffer_get_length(out) < MUX_CARRIER_LOWAT) {
+        mux_stream *best = NULL;
+        mux_stream *s;
+        TAILQ_FOREACH(s, &m->streams, next) {
+            if (s->fin_sent) {
+                continue;
+            }
+            size_t avail = evbuffer_get_length(bufferevent_get_input(s->bev));
+            if (avail && !s->send_window && !s->blocked) {
+                s->blocked = true;
+                mux_send_frame(m, s->id, MUX_BLOCKED, 0, 0);
+            }
+            if (!(avail ? s->send_window : s->read_eof)) {
+                continue;
+            }
+            if (!best || s->priority < best->priority) {
+                best = s;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        evbuffer *input = bufferevent_get_input(best->bev);
+        size_t len = MIN(evbuffer_get_length(input), MIN(MUX_FRAME_MAX, best->send_window));
+        if (len) {
+            mux_send_frame(m, best->id, MUX_DATA, 0, (uint16_t)len);
+            evbuffer_remove_buffer(input, out, len);
+            best->send_window -= len;
+        } else {
+            mux_send_frame(m, best->id, MUX_FIN, 0, 0);
+            best->fin_sent = true;
+        }
+        // round robin among streams of the same priority
+        TAILQ_REMOVE(&m->streams, best, next);
+        TAILQ_INSERT_TAIL(&m->streams, best, next);
+        if (best->fin_sent) {
+            mux_stream_check_close(best);
+        }
+    }
+}
+
+void mux_stream_read_cb(bufferevent *bev, void *ctx)
+{
+    mux_stream *s = (mux_stream*)ctx;
+    mux_flush(s->m);
+}
+
+void mux_send_credit(mux_stream *s, uint32_t credit)
+{
+    uint32_t c = htonl(credit);
+    mux_send_frame(s->m, s->id, MUX_WINDOW_UPDATE, 0, sizeof(c));
+    evbuffer_add(bufferevent_get_output(s->m->carrier), &c, sizeof(c));
+}
+
+void mux_stream_write_cb(bufferevent *bev, void *ctx)
+{
+    mux_stream *s = (mux_stream*)ctx;
+    mux *m = s->m;
+    // whatever is no longer queued, the app has taken
+    size_t queued = evbuffer_get_length(bufferevent_get_output(s->bev));
+    uint32_t taken = s->unacked - (uint32_t)queued;
+    if (taken && m->ready && (taken >= MUX_CREDIT_MIN || !queued)) {
+        mux_send_credit(s, taken);
+        s->unacked -= taken;
+    }
+    if (s->fin_received && !queued) {
+        mux_stream_stop_writing(s);
+    }
+}
+
+void mux_stream_event_cb(bufferevent *bev, short events, void *ctx)
+{
+    mux_stream *s = (mux_stream*)ctx;
+    mux *m = s->m;
+    debug("mux:%p stream:%u events:0x%x %s\n", m, s->id, events, bev_events_to_str(events));
+    if (events & BEV_EVENT_ERROR) {
+        mux_stream_reset(s);
+        return;
+    }
+    if (events & BEV_EVENT_EOF) {
+        s->read_eof = true;
+        mux_flush(m);
+    }
+}
+
+mux_stream* mux_stream_new(mux *m, uint32_t id, uint8_t priority, int fd)
+{
+    mux_stream *s = alloc(mux_stream);
+    s->m = m;
+    s->id = id;
+    s->priority = priority;
+    s->send_window = MUX_WINDOW;
+    s->recv_window = MUX_WINDOW;
+    s->bev = bufferevent_socket_new(m->n->evbase, fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(s->bev, mux_stream_read_cb, mux_stream_write_cb, mux_stream_event_cb, s);
+    // stop reading from the app while the stream is out of credit
+    bufferevent_setwatermark(s->bev, EV_READ, 0, MUX_FRAME_MAX * 4);
+    // the queue never exceeds the window, so hear about every write and return credit as it goes
+    bufferevent_setwatermark(s->bev, EV_WRITE, MUX_WINDOW_MAX, 0);
+    bufferevent_enable(s->bev, EV_READ|EV_WRITE);
+    TAILQ_INSERT_TAIL(&m->streams, s, next);
+    m->num_streams++;
+    mux_streams_total++;
+    if (m->idle) {
+        timer_cancel(m->idle);
+        m->idle = NULL;
+    }
+    return s;
+}
+
+void mux_stream_opened(mux_stream *s)
+{
+    mux_send_frame(s->m, s->id, MUX_OPEN, s->priority, 0);
+    if (s->app_bev) {
+        bufferevent_trigger_event(s->app_bev, BEV_EVENT_CONNECTED, BEV_TRIG_DEFER_CALLBACKS);
+        bufferevent_decref(s->app_bev);
+        s->app_bev = NULL;
+    }
+}
+
+bool mux_accept(mux *m, uint32_t id, uint8_t priority)
+{
+    if (m->num_streams >= MUX_MAX_STREAMS) {
+        debug("mux:%p stream:%u over %d streams\n", m, id, MUX_MAX_STREAMS);
+        return false;
+    }
+    if (!mux_stream_budget()) {
+        debug("mux:%p stream:%u over the fd budget, %zu streams in all\n", m, id, mux_streams_total);
+        return false;
+    }
+    int fds[2];
+    if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fds)) {
+        return false;
+    }
+    evutil_make_socket_closeonexec(fds[0]);
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_closeonexec(fds[1]);
+    evutil_make_socket_nonblocking(fds[1]);
+    mux_stream_new(m, id, priority, fds[0]);
+    evhttp_get_request(m->n->http, fds[1], (sockaddr *)&m->addr, m->addrlen);
+    return true;
+}
+
+bool mux_read_reply(mux *m)
+{
+    evbuffer *in = bufferevent_get_input(m->carrier);
+    evbuffer_ptr end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+    if (end.pos == -1) {
+        if (evbuffer_get_length(in) > MUX_REPLY_MAX) {
+            mux_fail(m);
+        }
+        return false;
+    }
+    size_t length = end.pos + 4;
+    const char *reply = (const char *)evbuffer_pullup(in, length);
+    const char ok[] = "HTTP/1.1 101 ";
+    const char agreed[] = "\r\nX-Mux: 1\r\n";
+    if (length < strlen(ok) || memcmp(reply, ok, strlen(ok)) || !memmem(reply, length, agreed, strlen(agreed))) {
+        debug("mux:%p refused %.*s\n", m, (int)strcspn(reply, "\r\n"), reply);
+        mux_fail(m);
+        return false;
+    }
+    evbuffer_drain(in, length);
+    debug("mux:%p established streams:%zu\n", m, m->num_streams);
+    m->ready = true;
+    mux_stream *s;
+    TAILQ_FOREACH(s, &m->streams, next) {
+        mux_stream_opened(s);
+    }
+    return true;
+}
+
+void mux_read_cb(bufferevent *bev, void *ctx)
+{
+    mux *m = (mux*)ctx;
+    if (!m->ready && !mux_read_reply(m)) {
+        return;
+    }
+    evbuffer *in = bufferevent_get_input(m->carrier);
+    for (;;) {
+        mux_frame f;
+        if (evbuffer_copyout(in, &f, sizeof(f)) < (ev_ssize_t)sizeof(f)) {
+            break;
+        }
+        uint16_t length = ntohs(f.length);
+        if (evbuffer_get_length(in) < sizeof(f) + length) {
+            break;
+        }
+        evbuffer_drain(in, sizeof(f));
+        uint32_t id = ntohl(f.stream);
+        mux_stream *s = mux_stream_find(m, id);
+        switch (f.type) {
+        case MUX_OPEN:
+            if (!m->incoming || s || length) {
+                debug("mux:%p bad open stream:%u\n", m, id);
+                mux_fail(m);
+                return;
+            }
+            if (!mux_accept(m, id, f.priority)) {
+                // only this stream fails, the others carry on
+                mux_send_frame(m, id, MUX_RST, 0, 0);
+            }
+            break;
+        case MUX_DATA:
+            if (!s || s->fin_received) {
+                // reset here while the frame was in flight
+                evbuffer_drain(in, length);
+                break;
+            }
+            if (s->unacked + length > s->recv_window) {
+                debug("mux:%p stream:%u over its window\n", m, id);
+                mux_fail(m);
+                return;
+            }
+            evbuffer_remove_buffer(in, bufferevent_get_output(s->bev), length);
+            s->unacked += length;
+            break;
+        case MUX_FIN:
+            if (s && !s->fin_received) {
+                s->fin_received = true;
+                if (!evbuffer_get_length(bufferevent_get_output(s->bev))) {
+                    mux_stream_stop_writing(s);
+                }
+            }
+            break;
+        case MUX_RST:
+            if (s) {
+                mux_stream_free(s);
+            }
+            break;
+        case MUX_WINDOW_UPDATE: {
+            uint32_t credit;
+            if (length != sizeof(credit)) {
+                mux_fail(m);
+                return;
+            }
+            evbuffer_remove(in, &credit, sizeof(credit));
+            if (s) {
+                s->send_window += ntohl(credit);
+                s->blocked = false;
+            }
+            break;
+        }
+        case MUX_BLOCKED:
+            if (length) {
+                mux_fail(m);
+                return;
+            }
+            // the sender waited on credit while the app kept up
+            if (s && !s->fin_received && s->recv_window < MUX_WINDOW_MAX &&
+                evbuffer_get_length(bufferevent_get_output(s->bev)) < MUX_CREDIT_MIN) {
+                debug("mux:%p stream:%u window:%u\n", m, id, s->recv_window * 2);
+                mux_send_credit(s, s->recv_window);
+                s->recv_window *= 2;
+            }
+            break;
+        case MUX_PRIORITY:
+            if (length) {
+                mux_fail(m);
+                return;
+            }
+            if (s) {
+                s->priority = f.priority;
+            }
+            break;
+        default:
+            // room to grow
+            evbuffer_drain(in, length);
+            break;
+        }
+    }
+    mux_flush(m);
+}
+
+void mux_write_cb(bufferevent *bev, void *ctx)
+{
+    mux *m = (mux*)ctx;
+    mux_flush(m);
+}
+
+void mux_event_cb(bufferevent *bev, short events, void *ctx)
+{
+    mux *m = (mux*)ctx;
+    debug("mux:%p events:0x%x %s\n", m, events, bev_events_to_str(events));
+    if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
+        mux_close(m);
+    }
+}
+
+void mux_close(mux *m)
+{
+    if (m->closing) {
+        return;
+    }
+    m->closing = true;
+    mux_stream *s;
+    while ((s = TAILQ_FIRST(&m->streams))) {
+        mux_stream_free(s);
+    }
+    if (m->idle) {
+        timer_cancel(m->idle);
+    }
+    bufferevent_free(m->carrier);
+    if (m->closed) {
+        m->closed(m->ready, m->refused);
+        Block_release(m->closed);
+    }
+    free(m);
+}
+
+mux* mux_new(network *n, bufferevent *carrier)
+{
+    mux *m = alloc(mux);
+    m->n = n;
+    m->carrier = carrier;
+    m->next_id = 1;
+    TAILQ_INIT(&m->streams);
+    bufferevent_setcb(carrier, mux_read_cb, mux_write_cb, mux_event_cb, m);
+    bufferevent_setwatermark(carrier, EV_WRITE, MUX_CARRIER_LOWAT / 2, 0);
+    bufferevent_enable(carrier, EV_READ|EV_WRITE);
+    return m;
+}
+
+mux* mux_connect(network *n, bufferevent *carrier, mux_closed_cb closed)
+{
+    mux *m = mux_new(n, carrier);
+    m->closed = Block_copy(closed);
+    evbuffer_add_printf(bufferevent_get_output(carrier),
+        "GET %s HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: newnode-mux\r\nX-Mux: 1\r\n\r\n", MUX_PATH);
+    return m;
+}
+
+bufferevent* mux_open(mux *m, uint8_t priority)
+{
+    if (m->num_streams >= MUX_MAX_STREAMS || !mux_stream_budget()) {
+        // a new mux that got no stream still goes away
+        mux_idle(m);
+        return NULL;
+    }
+    int fds[2];
+    if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fds)) {
+        return NULL;
+    }
+    evutil_make_socket_closeonexec(fds[0]);
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_closeonexec(fds[1]);
+    evutil_make_socket_nonblocking(fds[1]);
+    mux_stream *s = mux_stream_new(m, m->next_id, priority, fds[0]);
+    m->next_id += 2;
+    s->app_bev = bufferevent_socket_new(m->n->evbase, fds[1], BEV_OPT_CLOSE_ON_FREE);
+    s->app = s->app_bev;
+    bufferevent_incref(s->app_bev);
+    if (m->ready) {
+        mux_stream_opened(s);
+    }
+    return s->app;
+}
+
+bool mux_ready(mux *m)
+{
+    return m->ready;
+}
+
+bool mux_prioritize(mux *m, bufferevent *app, uint8_t priority)
+{
+    mux_stream *s;
+    TAILQ_FOREACH(s, &m->streams, next) {
+        if (s->app != app) {
+            continue;
+        }
+        if (s->priority != priority) {
+            s->priority = priority;
+            // before the mux is up, the OPEN carries it
+            if (m->ready) {
+                mux_send_frame(m, s->id, MUX_PRIORITY, priority, 0);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+bool mux_request(network *n, evhttp_request *req)
+{
+    if (req->type != EVHTTP_REQ_GET || !streq(evhttp_request_get_uri(req), MUX_PATH) ||
+        !evhttp_find_header(req->input_headers, "X-Mux")) {
+        return false;
+    }
+    evhttp_connection *evcon = req->evcon;
+    sockaddr_storage addr;
+    socklen_t addrlen = evcon_peer_sockaddr(evcon, &addr);
+
+    bufferevent *bev = evhttp_connection_detach_bufferevent(evcon);
+    evhttp_connection_free(evcon);
+    evbuffer_add_printf(bufferevent_get_output(bev), "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: newnode-mux\r\nX-Mux: 1\r\n\r\n");
+
+    mux *m = mux_new(n, bev);
+    m->incoming = true;
+    m->ready = true;
+    memcpy(&m->addr, &addr, sizeof(addr));
+    m->addrlen = addrlen;
+    debug("mux:%p accepted from %s\n", m, sockaddr_str((const sockaddr *)&m->addr));
+    // streams may have followed the request in the same read
+    mux_read_cb(bev, m);
+    return true;
+}
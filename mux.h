@@ -0,0 +1,31 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include "network.h"
+#include "http.h"
+
+// a GET of this path with X-Mux asks the peer to carry many streams over the connection;
+// peers without a mux have no host to proxy it to and refuse it
+#define MUX_PATH "/.mux"
+
+#define MUX_PRIORITY_HIGH 0
+#define MUX_PRIORITY_DEFAULT 4
+#define MUX_PRIORITY_LOW 7
+
+typedef struct mux mux;
+// established is false when the connection closed before the peer agreed;
+// refused is true when the peer answered without agreeing, or broke the framing
+typedef void (^mux_closed_cb)(bool established, bool refused);
+
+mux* mux_connect(network *n, bufferevent *carrier, mux_closed_cb closed);
+// a connected stream, as far as the caller can tell; BEV_EVENT_CONNECTED arrives once the peer agrees
+// NULL when the mux already has as many streams as the peer will take, or all muxes together hold their share of fds
+bufferevent* mux_open(mux *m, uint8_t priority);
+// the peer agreed, so a stream opened now connects without a round trip
+bool mux_ready(mux *m);
+// for a stream from mux_open once it knows what it carries; the peer schedules its replies by it too
+bool mux_prioritize(mux *m, bufferevent *app, uint8_t priority);
+// takes over a GET of MUX_PATH, false for any other request
+bool mux_request(network *n, evhttp_request *req);
+
+#endif // __MUX_H__
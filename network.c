@@ -1,5 +1,9 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
@@ -12,9 +16,16 @@
 #include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#endif
 #include <poll.h>
 #include <netdb.h>
 #include <signal.h>
+#include <ctype.h>
+#include <sys/queue.h>
+#include <Block.h>
 
 #include <sodium.h>
 
@@ -32,9 +43,90 @@
 #include "d2d.h"
 #include "http.h"
 #include "timer.h"
+#include "thread.h"
 #include "network.h"
+#include "hash_table.h"
 #include "icmp_handler.h"
 #include "utp_bufferevent.h"
+#include "obfoo.h"
+
+
+#ifdef __linux__
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define UDP_RECV_BATCH 8
+#define UDP_SEND_BATCH 64
+#define UDP_SEND_MAX_DATAGRAM 2048
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 60000
+
+// pace uTP bursts per destination at a little above the rate they have been
+// sent at recently (libutp's window over its RTT), so a window opening doesn't
+// hit the path as one burst. SO_TXTIME hands the departure times to the fq
+// qdisc where that is the default, otherwise datagrams are held and released
+// from a timer. either way, datagrams to one destination leave in order.
+#define UDP_PACING 1
+#define PACING_GAIN 1.25
+#define PACING_WINDOW_US (50 * 1000)
+#define PACING_IDLE_US (1000 * 1000)
+#define PACING_MAX_DELAY_US (20 * 1000)
+#define PACING_SLACK_US 1000
+#define PACING_MIN_DATAGRAM 512
+#define PACING_MAX_HELD 256
+
+typedef struct mmsghdr mmsghdr;
+typedef struct cmsghdr cmsghdr;
+typedef struct sock_txtime sock_txtime;
+
+typedef struct {
+    sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    uint64_t txtime;
+    uint8_t buf[UDP_SEND_MAX_DATAGRAM];
+} udp_datagram;
+
+typedef struct {
+    sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t last_used;
+    uint64_t next_departure;
+    uint64_t window_start;
+    uint64_t window_bytes;
+    double rate; // bytes/us
+    // held by the timer pacer; later datagrams wait behind them
+    size_t num_held;
+    uint64_t last_held_departure;
+} udp_pacer;
+
+typedef struct udp_held {
+    uint64_t departure;
+    udp_pacer *pacer;
+    udp_datagram d;
+    TAILQ_ENTRY(udp_held) next;
+} udp_held;
+
+typedef struct {
+    int fd;
+    event flush_event;
+    event pace_event;
+    bool initialized:1;
+    bool scheduled:1;
+    bool gso:1;
+    bool txtime:1;
+    size_t count;
+    udp_datagram q[UDP_SEND_BATCH];
+    udp_pacer pacers[64];
+    TAILQ_HEAD(, udp_held) held;
+    size_t num_held;
+} udp_tx_queue;
+
+udp_tx_queue udp_tx;
+#endif
 
 
 uint64 utp_on_firewall(utp_callback_arguments *a)
@@ -73,7 +165,331 @@ void map6to4(const in6_addr *in, in_addr *out)
     ((uint8_t *)&out->s_addr)[3] = in->s6_addr[15];
 }
 
-int udp_sendto(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen)
+void udp_send_error(size_t len, const sockaddr *sa)
+{
+    if (errno == ECONNREFUSED || errno == ECONNRESET ||
+        errno == EHOSTUNREACH || errno == ENETUNREACH) {
+        // ICMP
+    } else {
+        debug("sendto(%zu, %s) failed %d %s\n", len, sockaddr_str(sa), errno, strerror(errno));
+    }
+}
+
+#ifdef __linux__
+void udp_flush()
+{
+    if (!udp_tx.count) {
+        return;
+    }
+    mmsghdr msgs[UDP_SEND_BATCH];
+    iovec iovs[UDP_SEND_BATCH];
+    uint8_t control[UDP_SEND_BATCH][CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    size_t firsts[UDP_SEND_BATCH];
+    size_t num_msgs = 0;
+    for (size_t i = 0; i < udp_tx.count;) {
+        udp_datagram *d = &udp_tx.q[i];
+        size_t j = i + 1;
+        size_t total = d->len;
+        if (udp_tx.gso && !d->txtime) {
+            // a run to the same destination of equal sized datagrams (the last may be shorter) is one GSO send
+            while (j < udp_tx.count && j - i < UDP_GSO_MAX_SEGMENTS &&
+                   udp_tx.q[j - 1].len == d->len && udp_tx.q[j].len <= d->len &&
+                   total + udp_tx.q[j].len <= UDP_GSO_MAX_BYTES && !udp_tx.q[j].txtime &&
+                   udp_tx.q[j].addrlen == d->addrlen && memeq(&udp_tx.q[j].addr, &d->addr, d->addrlen)) {
+                total += udp_tx.q[j].len;
+                j++;
+            }
+        }
+        for (size_t k = i; k < j; k++) {
+            iovs[k] = (iovec){ .iov_base = udp_tx.q[k].buf, .iov_len = udp_tx.q[k].len };
+        }
+        mmsghdr *m = &msgs[num_msgs];
+        *m = (mmsghdr){
+            .msg_hdr = {
+                .msg_name = &d->addr,
+                .msg_namelen = d->addrlen,
+                .msg_iov = &iovs[i],
+                .msg_iovlen = j - i
+            }
+        };
+        if (j - i > 1 || d->txtime) {
+            m->msg_hdr.msg_control = control[num_msgs];
+            m->msg_hdr.msg_controllen = sizeof(control[num_msgs]);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&m->msg_hdr);
+            size_t controllen = 0;
+            if (j - i > 1) {
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment_size = d->len;
+                memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+                controllen += CMSG_SPACE(sizeof(uint16_t));
+                cmsg = CMSG_NXTHDR(&m->msg_hdr, cmsg);
+            }
+#ifdef SCM_TXTIME
+            if (d->txtime) {
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_TXTIME;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                memcpy(CMSG_DATA(cmsg), &d->txtime, sizeof(d->txtime));
+                controllen += CMSG_SPACE(sizeof(uint64_t));
+            }
+#endif
+            m->msg_hdr.msg_controllen = controllen;
+        }
+        firsts[num_msgs] = i;
+        num_msgs++;
+        i = j;
+    }
+    for (size_t sent = 0; sent < num_msgs;) {
+        int r = sendmmsg(udp_tx.fd, &msgs[sent], num_msgs - sent, 0);
+        if (r > 0) {
+            sent += r;
+            continue;
+        }
+        mmsghdr *m = &msgs[sent];
+        udp_datagram *d = &udp_tx.q[firsts[sent]];
+        if (m->msg_hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+            debug("UDP_SEGMENT failed %d %s, disabling GSO\n", errno, strerror(errno));
+            udp_tx.gso = false;
+            for (size_t k = 0; k < m->msg_hdr.msg_iovlen; k++) {
+                udp_datagram *s = &udp_tx.q[firsts[sent] + k];
+                if (sendto(udp_tx.fd, s->buf, s->len, 0, (const sockaddr *)&s->addr, s->addrlen) < 0) {
+                    udp_send_error(s->len, (const sockaddr *)&s->addr);
+                }
+            }
+        } else {
+            udp_send_error(d->len, (const sockaddr *)&d->addr);
+        }
+        // drop it, like a failed sendto would
+        sent++;
+    }
+    udp_tx.count = 0;
+}
+
+void udp_flush_cb(evutil_socket_t fd, short events, void *arg)
+{
+    udp_tx.scheduled = false;
+    udp_flush();
+}
+
+uint64_t udp_pace(const sockaddr *sa, socklen_t salen, size_t len, udp_pacer **pacer)
+{
+    uint64_t now = us_clock();
+    udp_pacer *p = NULL;
+    udp_pacer *lru = NULL;
+    for (size_t i = 0; i < lenof(udp_tx.pacers); i++) {
+        udp_pacer *c = &udp_tx.pacers[i];
+        if (c->addrlen == salen && memeq(&c->addr, sa, salen)) {
+            p = c;
+            break;
+        }
+        // one with datagrams held keeps its place
+        if (!c->num_held && (!lru || c->last_used < lru->last_used)) {
+            lru = c;
+        }
+    }
+    if (!p && !lru) {
+        *pacer = NULL;
+        return 0;
+    }
+    if (!p) {
+        p = lru;
+        bzero(p, sizeof(udp_pacer));
+        memcpy(&p->addr, sa, salen);
+        p->addrlen = salen;
+    }
+    if (now - p->last_used > PACING_IDLE_US) {
+        // idle (or new), the rate no longer says anything about the path
+        p->rate = 0;
+        p->next_departure = 0;
+        p->window_start = now;
+        p->window_bytes = 0;
+    }
+    p->last_used = now;
+    *pacer = p;
+    if (now - p->window_start >= PACING_WINDOW_US) {
+        double sample = (double)p->window_bytes / (now - p->window_start);
+        p->rate = p->rate ? 0.75 * p->rate + 0.25 * sample : sample;
+        p->window_start = now;
+        p->window_bytes = 0;
+    }
+    p->window_bytes += len;
+    if (!p->rate || len < PACING_MIN_DATAGRAM) {
+        // acks and the first window go out as they are
+        return 0;
+    }
+    uint64_t departure = MIN(MAX(now, p->next_departure), now + PACING_MAX_DELAY_US);
+    p->next_departure = departure + (uint64_t)(len / (p->rate * PACING_GAIN));
+    return departure > now + PACING_SLACK_US ? departure : 0;
+}
+
+void udp_queue_datagram(const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen, uint64_t departure)
+{
+    if (udp_tx.count == lenof(udp_tx.q)) {
+        udp_flush();
+    }
+    udp_datagram *d = &udp_tx.q[udp_tx.count++];
+    memcpy(&d->addr, sa, salen);
+    d->addrlen = salen;
+    d->len = len;
+    d->txtime = departure * 1000;
+    memcpy(d->buf, buf, len);
+    if (!udp_tx.scheduled) {
+        // flush once the callbacks active in this loop iteration are done
+        udp_tx.scheduled = true;
+        event_active(&udp_tx.flush_event, EV_WRITE, 1);
+    }
+}
+
+void udp_pace_schedule()
+{
+    udp_held *h = NULL;
+    uint64_t first = UINT64_MAX;
+    TAILQ_FOREACH(h, &udp_tx.held, next) {
+        first = MIN(first, h->departure);
+    }
+    if (first == UINT64_MAX) {
+        return;
+    }
+    uint64_t now = us_clock();
+    uint64_t delay = first > now ? first - now : 0;
+    const timeval tv = { delay / 1000000, delay % 1000000 };
+    event_add(&udp_tx.pace_event, &tv);
+}
+
+void udp_held_release(udp_held *h)
+{
+    TAILQ_REMOVE(&udp_tx.held, h, next);
+    udp_tx.num_held--;
+    h->pacer->num_held--;
+    udp_queue_datagram(h->d.buf, h->d.len, (const sockaddr *)&h->d.addr, h->d.addrlen, 0);
+    free(h);
+}
+
+void udp_pace_cb(evutil_socket_t fd, short events, void *arg)
+{
+    uint64_t now = us_clock();
+    udp_held *h;
+    udp_held *t;
+    // departures per destination only increase, so each destination's datagrams go in order
+    for (h = TAILQ_FIRST(&udp_tx.held); h; h = t) {
+        t = TAILQ_NEXT(h, next);
+        if (h->departure > now + PACING_SLACK_US) {
+            continue;
+        }
+        udp_held_release(h);
+    }
+    udp_pace_schedule();
+}
+
+void udp_held_release_pacer(udp_pacer *p)
+{
+    udp_held *h;
+    udp_held *t;
+    for (h = TAILQ_FIRST(&udp_tx.held); h && p->num_held; h = t) {
+        t = TAILQ_NEXT(h, next);
+        if (h->pacer == p) {
+            udp_held_release(h);
+        }
+    }
+}
+
+void udp_held_clear()
+{
+    udp_held *h;
+    while ((h = TAILQ_FIRST(&udp_tx.held))) {
+        TAILQ_REMOVE(&udp_tx.held, h, next);
+        h->pacer->num_held = 0;
+        free(h);
+    }
+    udp_tx.num_held = 0;
+}
+
+bool udp_default_qdisc_is_fq()
+{
+    FILE *f = fopen("/proc/sys/net/core/default_qdisc", "r");
+    if (!f) {
+        return false;
+    }
+    char qdisc[32] = "";
+    bool fq = fgets(qdisc, sizeof(qdisc), f) && (!strcmp(qdisc, "fq\n") || !strcmp(qdisc, "etf\n"));
+    fclose(f);
+    return fq;
+}
+
+void udp_tx_init(network *n)
+{
+    if (udp_tx.initialized) {
+        // the old socket is gone
+        event_del(&udp_tx.flush_event);
+        event_del(&udp_tx.pace_event);
+        udp_held_clear();
+        udp_tx.count = 0;
+        udp_tx.scheduled = false;
+    } else {
+        TAILQ_INIT(&udp_tx.held);
+    }
+    udp_tx.fd = n->fd;
+    event_assign(&udp_tx.flush_event, n->evbase, -1, 0, udp_flush_cb, NULL);
+    evtimer_assign(&udp_tx.pace_event, n->evbase, udp_pace_cb, NULL);
+    int segment_size;
+    socklen_t optlen = sizeof(segment_size);
+    udp_tx.gso = !getsockopt(n->fd, SOL_UDP, UDP_SEGMENT, &segment_size, &optlen);
+    udp_tx.txtime = false;
+#ifdef SO_TXTIME
+    // departure times are only honoured by the fq (or etf) qdisc. anything else ignores them, and
+    // txtime datagrams can't share a GSO send, so use the timer unless fq is what interfaces get
+    if (UDP_PACING && udp_default_qdisc_is_fq()) {
+        sock_txtime txtime = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+        udp_tx.txtime = !setsockopt(n->fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+    }
+#endif
+    udp_tx.initialized = true;
+}
+
+bool udp_queue(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen, bool pace)
+{
+    if (!udp_tx.initialized || fd != udp_tx.fd) {
+        return false;
+    }
+    if (len > UDP_SEND_MAX_DATAGRAM) {
+        // keep the order
+        udp_flush();
+        return false;
+    }
+    udp_pacer *p = NULL;
+    uint64_t departure = UDP_PACING && pace ? udp_pace(sa, salen, len, &p) : 0;
+    if (p && p->num_held && !udp_tx.txtime) {
+        // behind what is already held for this destination, even if it could go now
+        departure = MAX(departure, p->last_held_departure);
+    }
+    if (departure && !udp_tx.txtime && udp_tx.num_held >= PACING_MAX_HELD) {
+        // out of room: give up pacing this destination for now rather than overtake what it has held
+        udp_held_release_pacer(p);
+        departure = 0;
+    }
+    if (departure && !udp_tx.txtime) {
+        udp_held *h = alloc(udp_held);
+        h->departure = departure;
+        h->pacer = p;
+        p->num_held++;
+        p->last_held_departure = departure;
+        memcpy(&h->d.addr, sa, salen);
+        h->d.addrlen = salen;
+        h->d.len = len;
+        memcpy(h->d.buf, buf, len);
+        TAILQ_INSERT_TAIL(&udp_tx.held, h, next);
+        udp_tx.num_held++;
+        udp_pace_schedule();
+        return true;
+    }
+    udp_queue_datagram(buf, len, sa, salen, udp_tx.txtime ? departure : 0);
+    return true;
+}
+#endif
+
+int udp_send(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen, bool pace)
 {
     ddebug("sendto(%zd, %s)\n", len, sockaddr_str(sa));
 
@@ -102,22 +518,336 @@ int udp_sendto(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, sockl
         }
     }
 
+#ifdef __linux__
+    if (udp_queue(fd, buf, len, sa, salen, pace)) {
+        return len;
+    }
+#endif
+
     ssize_t r = sendto(fd, buf, len, 0, sa, salen);
     if (r < 0 && errno != EHOSTUNREACH) {
-        if (errno == ECONNREFUSED || errno == ECONNRESET ||
-            errno == EHOSTUNREACH || errno == ENETUNREACH) {
-            // ICMP
-        } else {
-            debug("sendto(%zu, %s) failed %d %s\n", len, sockaddr_str(sa), errno, strerror(errno));
-        }
+        udp_send_error(len, sa);
     }
     return r;
 }
 
+int udp_sendto(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen)
+{
+    return udp_send(fd, buf, len, sa, salen, false);
+}
+
+// uTP connection migration
+//
+// libutp knows a connection by the peer's address and the connection id, so a
+// peer whose address changes (a phone moving between Wi-Fi and cellular) would
+// be reset as unknown. instead, a packet with the id of a connection we're
+// using, from an address we don't know, is dropped and the address is sent a
+// challenge. only an end of the connection's obfoo session can answer it, and
+// only if it receives at that address. once it does, packets from the new
+// address go to libutp as if from the old one, and libutp's go to the new one.
+// nothing else is sent to an address before it answers, and a challenge is no
+// bigger than the packet that prompted it.
+
+#define UTP_HEADER_SIZE 20
+#define UTP_VERSION 1
+#define UTP_ST_SYN 4
+// first bytes libutp and the dht ignore: uTP version 2
+#define UTP_PATH_CHALLENGE 0x02
+#define UTP_PATH_RESPONSE 0x12
+#define UTP_PATH_BUCKETS 256
+// a connection that hasn't sent for this long isn't followed to a new address
+#define UTP_PATH_IDLE 60
+#define UTP_PATH_EXPIRE (5 * 60)
+// seconds between challenges for a connection, and for the answer
+#define UTP_PATH_RETRY 1
+#define UTP_PATH_ANSWER 5
+#define UTP_PATH_MAC_BYTES crypto_generichash_BYTES_MIN
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    // the receiver's id for the connection, as in uTP
+    uint16_t conn_id;
+    uint8_t nonce[16];
+    // response only
+    uint8_t mac[UTP_PATH_MAC_BYTES];
+} PACKED utp_path_packet;
+static_assert(offsetof(utp_path_packet, mac) == UTP_HEADER_SIZE, "a challenge is the size of a bare uTP header");
+
+typedef struct utp_path {
+    struct utp_path *next;
+    // only compared, the socket may be gone
+    const utp_socket *socket;
+    // the peer as libutp knows it, and where it is now
+    sockaddr_storage addr;
+    sockaddr_storage path;
+    // challenged and not yet answered
+    sockaddr_storage probe;
+    uint8_t nonce[member_sizeof(utp_path_packet, nonce)];
+    uint8_t key[OBFOO_PATH_KEY_BYTES];
+    uint16_t recv_id;
+    uint16_t send_id;
+    time_t last_sent;
+    time_t challenged;
+} utp_path;
+
+utp_path *utp_paths[UTP_PATH_BUCKETS];
+
+utp_path** utp_path_bucket(uint16_t recv_id)
+{
+    return &utp_paths[recv_id % UTP_PATH_BUCKETS];
+}
+
+void utp_path_mac(const utp_path *p, utp_path_packet *r)
+{
+    crypto_generichash(r->mac, sizeof(r->mac), (const uint8_t *)r, offsetof(utp_path_packet, mac), p->key, sizeof(p->key));
+}
+
+utp_path* utp_path_sent(utp_socket *s, const uint8_t *buf, size_t len, const sockaddr *sa)
+{
+    if (!s || len < UTP_HEADER_SIZE || (buf[0] & 0x0f) != UTP_VERSION || (buf[0] >> 4) == UTP_ST_SYN) {
+        return NULL;
+    }
+    uint16_t send_id = (uint16_t)(buf[2] << 8 | buf[3]);
+    time_t now = time(NULL);
+    // bucketed by the id the peer sends on, one below ours for the connecting side, one above for the accepting side
+    uint16_t recv_ids[] = {send_id - 1, send_id + 1};
+    for (size_t i = 0; i < lenof(recv_ids); i++) {
+        for (utp_path **pp = utp_path_bucket(recv_ids[i]); *pp;) {
+            utp_path *p = *pp;
+            if (p->socket == s && p->send_id == send_id) {
+                p->last_sent = now;
+                return p;
+            }
+            if (now - p->last_sent > UTP_PATH_EXPIRE) {
+                *pp = p->next;
+                sodium_memzero(p->key, sizeof(p->key));
+                free(p);
+                continue;
+            }
+            pp = &p->next;
+        }
+    }
+    obfoo *o = utp_socket_obfoo(s);
+    uint8_t key[OBFOO_PATH_KEY_BYTES];
+    if (!o || !obfoo_path_key(o, key)) {
+        return NULL;
+    }
+    utp_path *p = alloc(utp_path);
+    p->socket = s;
+    memcpy(&p->addr, sa, sockaddr_get_length(sa));
+    memcpy(&p->path, sa, sockaddr_get_length(sa));
+    memcpy(p->key, key, sizeof(key));
+    sodium_memzero(key, sizeof(key));
+    p->send_id = send_id;
+    p->recv_id = o->incoming ? send_id + 1 : send_id - 1;
+    p->last_sent = now;
+    utp_path **bucket = utp_path_bucket(p->recv_id);
+    p->next = *bucket;
+    *bucket = p;
+    return p;
+}
+
+void utp_path_challenge(network *n, utp_path *p, const sockaddr *sa)
+{
+    time_t now = time(NULL);
+    if (now - p->challenged < UTP_PATH_RETRY) {
+        return;
+    }
+    debug("utp %u challenging %s", p->recv_id, sockaddr_str((const sockaddr *)&p->path));
+    debug(" -> %s\n", sockaddr_str(sa));
+    p->challenged = now;
+    memcpy(&p->probe, sa, sockaddr_get_length(sa));
+    randombytes_buf(p->nonce, sizeof(p->nonce));
+    utp_path_packet c = {.type = UTP_PATH_CHALLENGE, .conn_id = htons(p->send_id)};
+    memcpy(c.nonce, p->nonce, sizeof(c.nonce));
+    udp_sendto(n->fd, (const uint8_t *)&c, offsetof(utp_path_packet, mac), sa, sockaddr_get_length(sa));
+}
+
+// the address libutp knows the sender by, NULL if the packet waits on a challenge
+const sockaddr* utp_path_incoming(network *n, const uint8_t *buf, size_t len, const sockaddr *sa)
+{
+    if (len < UTP_HEADER_SIZE || (buf[0] & 0x0f) != UTP_VERSION || (buf[0] >> 4) == UTP_ST_SYN) {
+        return sa;
+    }
+    uint16_t recv_id = (uint16_t)(buf[2] << 8 | buf[3]);
+    utp_path *bucket = *utp_path_bucket(recv_id);
+    for (utp_path *p = bucket; p; p = p->next) {
+        if (p->recv_id == recv_id && sockaddr_eq(sa, (const sockaddr *)&p->path)) {
+            return (const sockaddr *)&p->addr;
+        }
+    }
+    time_t now = time(NULL);
+    const sockaddr *to = NULL;
+    bool challenged = false;
+    for (utp_path *p = bucket; p; p = p->next) {
+        if (p->recv_id != recv_id || now - p->last_sent > UTP_PATH_IDLE) {
+            continue;
+        }
+        utp_path_challenge(n, p, sa);
+        challenged = true;
+        if (sockaddr_eq(sa, (const sockaddr *)&p->addr)) {
+            // back where it started, which libutp takes as it is
+            to = sa;
+        }
+    }
+    return challenged ? to : sa;
+}
+
+void utp_path_received(network *n, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen)
+{
+    utp_path_packet r;
+    if (len != (buf[0] == UTP_PATH_CHALLENGE ? offsetof(utp_path_packet, mac) : sizeof(r))) {
+        return;
+    }
+    memcpy(&r, buf, len);
+    uint16_t recv_id = ntohs(r.conn_id);
+    time_t now = time(NULL);
+    for (utp_path *p = *utp_path_bucket(recv_id); p; p = p->next) {
+        if (p->recv_id != recv_id) {
+            continue;
+        }
+        if (r.type == UTP_PATH_CHALLENGE) {
+            // from the peer where we know it; we're the one that moved
+            if (!sockaddr_eq(sa, (const sockaddr *)&p->path)) {
+                continue;
+            }
+            r.type = UTP_PATH_RESPONSE;
+            r.conn_id = htons(p->send_id);
+            utp_path_mac(p, &r);
+            udp_sendto(n->fd, (const uint8_t *)&r, sizeof(r), sa, salen);
+            return;
+        }
+        if (!p->challenged || now - p->challenged > UTP_PATH_ANSWER ||
+            !sockaddr_eq(sa, (const sockaddr *)&p->probe) || sodium_memcmp(r.nonce, p->nonce, sizeof(r.nonce))) {
+            continue;
+        }
+        utp_path_packet expect = r;
+        utp_path_mac(p, &expect);
+        if (crypto_verify_16(r.mac, expect.mac)) {
+            continue;
+        }
+        debug("utp %u moved %s", p->recv_id, sockaddr_str((const sockaddr *)&p->path));
+        debug(" -> %s\n", sockaddr_str(sa));
+        memcpy(&p->path, sa, salen);
+        p->challenged = 0;
+        return;
+    }
+}
+
 uint64 utp_callback_sendto(utp_callback_arguments *a)
 {
     network *n = (network*)utp_context_get_userdata(a->context);
-    return udp_sendto(n->fd, a->buf, a->len, a->address, a->address_len);
+    utp_path *p = utp_path_sent(a->socket, a->buf, a->len, a->address);
+    if (p && !sockaddr_eq((const sockaddr *)&p->path, (const sockaddr *)&p->addr)) {
+        const sockaddr *path = (const sockaddr *)&p->path;
+        return udp_send(n->fd, a->buf, a->len, path, sockaddr_get_length(path), !!a->socket);
+    }
+    return udp_send(n->fd, a->buf, a->len, a->address, a->address_len, !!a->socket);
+}
+
+#define PMTU_CACHE_SIZE 256
+#define PMTU_EXPIRE (10 * 60)
+#define PMTU_MIN 576
+// as libutp's utp_default_get_udp_mtu: room for tunnel headers, and IPv6 assumed to be Teredo
+#define UDP_IPV4_MTU 1402
+#define UDP_TEREDO_MTU 1232
+
+typedef struct {
+    in6_addr addr;
+    uint16_t mtu;
+    time_t updated;
+    time_t last_used;
+} pmtu_entry;
+
+pmtu_entry pmtu_cache[PMTU_CACHE_SIZE];
+
+bool pmtu_key(const sockaddr *sa, in6_addr *key)
+{
+    if (sa->sa_family == AF_INET) {
+        bzero(key, sizeof(in6_addr));
+        key->s6_addr[10] = 0xff;
+        key->s6_addr[11] = 0xff;
+        memcpy(&key->s6_addr[12], &((const sockaddr_in *)sa)->sin_addr, sizeof(in_addr));
+        return true;
+    }
+    if (sa->sa_family == AF_INET6) {
+        memcpy(key, &((const sockaddr_in6 *)sa)->sin6_addr, sizeof(in6_addr));
+        return true;
+    }
+    return false;
+}
+
+pmtu_entry* pmtu_find(const in6_addr *key)
+{
+    time_t now = time(NULL);
+    for (size_t i = 0; i < lenof(pmtu_cache); i++) {
+        pmtu_entry *e = &pmtu_cache[i];
+        if (e->mtu && memeq(&e->addr, key, sizeof(in6_addr))) {
+            if (now - e->updated > PMTU_EXPIRE) {
+                // paths change, probe again
+                e->mtu = 0;
+                return NULL;
+            }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void pmtu_update(const sockaddr *sa, uint16_t mtu)
+{
+    in6_addr key;
+    if (!pmtu_key(sa, &key) || mtu < PMTU_MIN) {
+        return;
+    }
+    time_t now = time(NULL);
+    pmtu_entry *e = pmtu_find(&key);
+    if (!e) {
+        e = &pmtu_cache[0];
+        for (size_t i = 0; i < lenof(pmtu_cache); i++) {
+            pmtu_entry *c = &pmtu_cache[i];
+            if (!c->mtu) {
+                e = c;
+                break;
+            }
+            if (c->last_used < e->last_used) {
+                e = c;
+            }
+        }
+        e->addr = key;
+    }
+    ddebug("pmtu %s %u\n", sockaddr_str(sa), mtu);
+    e->mtu = mtu;
+    e->updated = now;
+    e->last_used = now;
+}
+
+uint16_t pmtu_get(const sockaddr *sa)
+{
+    in6_addr key;
+    if (!pmtu_key(sa, &key)) {
+        return 0;
+    }
+    pmtu_entry *e = pmtu_find(&key);
+    if (!e) {
+        return 0;
+    }
+    e->last_used = time(NULL);
+    return e->mtu;
+}
+
+uint64 utp_callback_get_udp_mtu(utp_callback_arguments *a)
+{
+    bool v6 = a->address->sa_family == AF_INET6;
+    uint16_t mtu = v6 ? UDP_TEREDO_MTU : UDP_IPV4_MTU;
+    uint16_t pmtu = pmtu_get(a->address);
+    if (pmtu) {
+        // start below what the path is known to carry, instead of probing down to it again
+        uint16_t overhead = (v6 ? 40 : 20) + 8;
+        mtu = MAX(MIN(mtu, (uint16_t)(pmtu - overhead)), PMTU_MIN);
+    }
+    return mtu;
 }
 
 uint64 utp_callback_log(utp_callback_arguments *a)
@@ -169,6 +899,14 @@ bool network_make_socket(network *n)
     if (setsockopt(n->fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) != 0) {
         pdie("setsockopt");
     }
+    // ICMPv6 (packet too big, for the PMTU cache) only reaches the error queue with this
+    if (res->ai_addr->sa_family == AF_INET6 && setsockopt(n->fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on)) != 0) {
+        debug("IPV6_RECVERR failed %d %s\n", errno, strerror(errno));
+    }
+    // let the kernel coalesce bursts of same-sized datagrams; udp_read splits them again
+    if (setsockopt(n->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0) {
+        debug("UDP_GRO not supported %d %s\n", errno, strerror(errno));
+    }
 #endif
 
 #ifdef SO_RECV_ANYIF
@@ -199,6 +937,10 @@ bool network_make_socket(network *n)
     evutil_make_socket_closeonexec(n->fd);
     evutil_make_socket_nonblocking(n->fd);
 
+#ifdef __linux__
+    udp_tx_init(n);
+#endif
+
     event_assign(&n->udp_event, n->evbase, n->fd, EV_READ|EV_PERSIST, udp_read, n);
     if (event_add(&n->udp_event, NULL) < 0) {
         fprintf(stderr, "event_add udp_read failed\n");
@@ -226,7 +968,16 @@ bool network_make_socket(network *n)
 bool udp_received(network *n, uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen)
 {
     ddebug("udp_received(%zu, %s)\n", len, sockaddr_str(sa));
-    if (utp_process_udp(n->utp, buf, len, sa, salen)) {
+    if (len && (buf[0] == UTP_PATH_CHALLENGE || buf[0] == UTP_PATH_RESPONSE)) {
+        utp_path_received(n, buf, len, sa, salen);
+        return true;
+    }
+    const sockaddr *from = utp_path_incoming(n, buf, len, sa);
+    if (!from) {
+        // a connection we have, at an address that hasn't answered yet
+        return true;
+    }
+    if (utp_process_udp(n->utp, buf, len, from, from == sa ? salen : sockaddr_get_length(from))) {
         return true;
     }
     time_t tosleep;
@@ -235,73 +986,142 @@ bool udp_received(network *n, uint8_t *buf, size_t len, const sockaddr *sa, sock
     return r;
 }
 
-void udp_read(evutil_socket_t fd, short events, void *arg)
+void udp_read_error(network *n)
 {
-    network *n = (network*)arg;
-
+    int err = errno;
 #ifdef __linux__
-    // ugg, libevent doesn't tell us about POLLERR
-    // https://github.com/libevent/libevent/issues/495
+    // any socket error may mean ICMP is waiting on the error queue, including EMSGSIZE for
+    // frag-needed / packet-too-big and EPROTO for parameter problems. left there, POLLERR stays set
+    // (libevent doesn't tell us about POLLERR https://github.com/libevent/libevent/issues/495)
     icmp_handler(n);
+    if (err == ECONNREFUSED || err == ECONNRESET || err == EHOSTUNREACH || err == ENETUNREACH ||
+        err == EMSGSIZE || err == EPROTO) {
+        return;
+    }
+#endif
+    errno = err;
+    debug("%s recv error %d %s\n", __func__, errno, strerror(errno));
+    if (errno == ENOTCONN) {
+        // recreate socket
+        debug("%s recreating socket\n", __func__);
+        event_del(&n->udp_event);
+        evutil_closesocket(n->fd);
+        network_make_socket(n);
+    }
+}
+
+void udp_received_from(network *n, uint8_t *buf, size_t len, size_t segment_size, const sockaddr_storage *src_addr)
+{
+    ddebug("recvfrom(%zu, %s)\n", len, sockaddr_str((const sockaddr *)src_addr));
+
+    const sockaddr *sa = (const sockaddr *)src_addr;
+    socklen_t salen = sockaddr_get_length(sa);
+
+    sockaddr_in sin = {0};
+    if (src_addr->ss_family == AF_INET6) {
+        const sockaddr_in6 *sin6 = (const sockaddr_in6 *)src_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            sin.sin_family = AF_INET;
+            sin.sin_port = sin6->sin6_port;
+#ifdef __APPLE__
+            sin.sin_len = sizeof(sin);
 #endif
+            map6to4(&sin6->sin6_addr, &sin.sin_addr);
+            sa = (const sockaddr *)&sin;
+            salen = sizeof(sin);
+        }
+    }
+
+    if (o_debug >= 3) {
+        hexdump(buf, len);
+    }
+
+    if (!segment_size) {
+        segment_size = len;
+    }
+    for (size_t offset = 0; offset < len; offset += segment_size) {
+        uint8_t *p = buf + offset;
+        size_t l = MIN(segment_size, len - offset);
+        // the dht NUL terminates in place, don't clobber the next segment
+        uint8_t next = p[l];
+        udp_received(n, p, l, sa, salen);
+        p[l] = next;
+    }
+}
+
+#ifdef __linux__
+void udp_read(evutil_socket_t fd, short events, void *arg)
+{
+    network *n = (network*)arg;
+    static uint8_t bufs[UDP_RECV_BATCH][64 * 1024 + 1];
 
     for (;;) {
-        sockaddr_storage src_addr;
-        socklen_t addrlen = sizeof(src_addr);
-        uint8_t buf[64 * 1024 + 1];
-        ssize_t len = recvfrom(n->fd, buf, sizeof(buf), 0, (sockaddr *)&src_addr, &addrlen);
-        if (len < 0) {
+        mmsghdr msgs[UDP_RECV_BATCH];
+        iovec iovs[UDP_RECV_BATCH];
+        sockaddr_storage addrs[UDP_RECV_BATCH];
+        uint8_t control[UDP_RECV_BATCH][CMSG_SPACE(sizeof(int))];
+        for (size_t i = 0; i < lenof(msgs); i++) {
+            iovs[i] = (iovec){ .iov_base = bufs[i], .iov_len = sizeof(bufs[i]) - 1 };
+            msgs[i] = (mmsghdr){
+                .msg_hdr = {
+                    .msg_name = &addrs[i],
+                    .msg_namelen = sizeof(addrs[i]),
+                    .msg_iov = &iovs[i],
+                    .msg_iovlen = 1,
+                    .msg_control = control[i],
+                    .msg_controllen = sizeof(control[i])
+                }
+            };
+        }
+        int r = recvmmsg(n->fd, msgs, lenof(msgs), MSG_DONTWAIT, NULL);
+        if (r < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 utp_issue_deferred_acks(n->utp);
                 break;
             }
-            if (errno == ECONNREFUSED || errno == ECONNRESET ||
-                errno == EHOSTUNREACH || errno == ENETUNREACH) {
-#ifdef __linux__
-                // ugg, libevent doesn't tell us about POLLERR
-                // https://github.com/libevent/libevent/issues/495
-                icmp_handler(n);
-                break;
-#endif
-            }
-            debug("%s recvfrom error %d %s\n", __func__, errno, strerror(errno));
-            if (errno == ENOTCONN) {
-                // recreate socket
-                debug("%s recreating socket\n", __func__);
-                event_del(&n->udp_event);
-                evutil_closesocket(n->fd);
-                network_make_socket(n);
-            }
+            udp_read_error(n);
             break;
         }
-
-        ddebug("recvfrom(%zu, %s)\n", len, sockaddr_str((const sockaddr *)&src_addr));
-
-        const sockaddr *sa = (const sockaddr *)&src_addr;
-        socklen_t salen = sockaddr_get_length(sa);
-
-        sockaddr_in sin = {0};
-        if (src_addr.ss_family == AF_INET6) {
-            const sockaddr_in6 *sin6 = (const sockaddr_in6 *)&src_addr;
-            if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
-                sin.sin_family = AF_INET;
-                sin.sin_port = sin6->sin6_port;
-#ifdef __APPLE__
-                sin.sin_len = sizeof(sin);
-#endif
-                map6to4(&sin6->sin6_addr, &sin.sin_addr);
-                sa = (const sockaddr *)&sin;
-                salen = sizeof(sin);
+        for (int i = 0; i < r; i++) {
+            size_t segment_size = 0;
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                    segment_size = gso_size;
+                }
             }
+            udp_received_from(n, bufs[i], msgs[i].msg_len, segment_size, &addrs[i]);
         }
-
-        if (o_debug >= 3) {
-            hexdump(buf, len);
+        if (r < (int)lenof(msgs)) {
+            // drained
+            utp_issue_deferred_acks(n->utp);
+            break;
         }
+    }
+}
+#else
+void udp_read(evutil_socket_t fd, short events, void *arg)
+{
+    network *n = (network*)arg;
 
-        udp_received(n, buf, len, sa, salen);
+    for (;;) {
+        sockaddr_storage src_addr;
+        socklen_t addrlen = sizeof(src_addr);
+        uint8_t buf[64 * 1024 + 1];
+        ssize_t len = recvfrom(n->fd, buf, sizeof(buf) - 1, 0, (sockaddr *)&src_addr, &addrlen);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                utp_issue_deferred_acks(n->utp);
+                break;
+            }
+            udp_read_error(n);
+            break;
+        }
+        udp_received_from(n, buf, len, 0, &src_addr);
     }
 }
+#endif
 
 void evbuffer_hash_update(evbuffer *buf, crypto_generichash_state *content_state)
 {
@@ -469,17 +1289,17 @@ int sockaddr_cmp(const struct sockaddr * sa, const struct sockaddr * sb)
     switch (sa->sa_family) {
     case AF_INET: {
         const sockaddr_in *sina = (const sockaddr_in*)sa;
-        const sockaddr_in *sinb = (const sockaddr_in*)sa;
+        const sockaddr_in *sinb = (const sockaddr_in*)sb;
         return sina->sin_addr.s_addr - sinb->sin_addr.s_addr;
     }
     case AF_INET6: {
         const sockaddr_in6 *sin6a = (const sockaddr_in6*)sa;
-        const sockaddr_in6 *sin6b = (const sockaddr_in6*)sa;
+        const sockaddr_in6 *sin6b = (const sockaddr_in6*)sb;
         return memcmp(&sin6a->sin6_addr, &sin6b->sin6_addr, sizeof(sin6a->sin6_addr));
     }
     case AF_LOCAL: {
         const sockaddr_un *suna = (const sockaddr_un*)sa;
-        const sockaddr_un *sunb = (const sockaddr_un*)sa;
+        const sockaddr_un *sunb = (const sockaddr_un*)sb;
         return strcmp(suna->sun_path, sunb->sun_path);
     }
     default:
@@ -545,10 +1365,32 @@ bool sockaddr_is_localhost(const sockaddr *sa, socklen_t salen)
     return false;
 }
 
+bool sockaddr_is_private(const sockaddr *sa)
+{
+    switch(sa->sa_family) {
+    case AF_INET: {
+        uint32_t a = ntohl(((const sockaddr_in *)sa)->sin_addr.s_addr);
+        // 10/8, 172.16/12, 192.168/16, 169.254/16
+        return (a >> 24) == 10 || (a >> 20) == 0xAC1 || (a >> 16) == 0xC0A8 || (a >> 16) == 0xA9FE;
+    }
+    case AF_INET6: {
+        const in6_addr *a6 = &((const sockaddr_in6 *)sa)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            sockaddr_in sin = {.sin_family = AF_INET};
+            memcpy(&sin.sin_addr, &a6->s6_addr[12], sizeof(sin.sin_addr));
+            return sockaddr_is_private((const sockaddr *)&sin);
+        }
+        // fc00::/7, fe80::/10
+        return (a6->s6_addr[0] & 0xfe) == 0xfc || IN6_IS_ADDR_LINKLOCAL(a6);
+    }
+    }
+    return false;
+}
+
 bool bufferevent_is_localhost(const bufferevent *bev)
 {
     int fd = bufferevent_getfd((bufferevent*)bev);
-    sockaddr_storage ss;
+    sockaddr_storage ss = {0};
     socklen_t len = sizeof(ss);
     getsockname(fd, (sockaddr *)&ss, &len);
     // AF_LOCAL is from socketpair(), which means utp
@@ -558,6 +1400,500 @@ bool bufferevent_is_localhost(const bufferevent *bev)
     return sockaddr_is_localhost((sockaddr *)&ss, len);
 }
 
+#define DNS_MAX_ADDRS 8
+#define DNS_MIN_TTL 30
+#define DNS_MAX_TTL (60 * 60)
+#define DNS_NEGATIVE_TTL 30
+#define DNS_ERROR_TTL 5
+#define DNS_PREFETCH_WINDOW 15
+#define DNS_PREFETCH_IDLE (5 * 60)
+#define DNS_EXPIRE_IDLE (60 * 60)
+
+// RFC 8305
+#define HAPPY_EYEBALLS_RESOLUTION_DELAY_MS 50
+#define HAPPY_EYEBALLS_ATTEMPT_DELAY_MS 250
+
+typedef struct dns_waiter {
+    dns_callback cb;
+    TAILQ_ENTRY(dns_waiter) next;
+} dns_waiter;
+
+typedef struct dns_entry dns_entry;
+
+typedef struct {
+    dns_entry *entry;
+    int family;
+    sockaddr_storage addrs[DNS_MAX_ADDRS];
+    uint8_t num_addrs;
+    time_t expires;
+    struct evdns_request *req;
+    TAILQ_HEAD(, dns_waiter) waiters;
+} dns_answer;
+
+struct dns_entry {
+    char *host;
+    time_t last_used;
+    dns_answer v4;
+    dns_answer v6;
+};
+
+hash_table *dns_cache;
+timer *dns_prefetch_timer;
+int dns_preferred_family = AF_INET;
+
+void dns_answer_notify(dns_answer *a)
+{
+    dns_waiter *w;
+    while ((w = TAILQ_FIRST(&a->waiters))) {
+        TAILQ_REMOVE(&a->waiters, w, next);
+        w->cb(a->addrs, a->num_addrs);
+        Block_release(w->cb);
+        free(w);
+    }
+}
+
+void dns_evdns_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+    dns_answer *a = (dns_answer*)arg;
+    a->req = NULL;
+    time_t now = time(NULL);
+    ddebug("dns %s family:%d result:%d count:%d ttl:%d\n", a->entry->host, a->family, result, count, ttl);
+    if (result == DNS_ERR_NONE && count > 0) {
+        a->num_addrs = 0;
+        for (int i = 0; i < count && a->num_addrs < lenof(a->addrs); i++) {
+            sockaddr_storage *ss = &a->addrs[a->num_addrs];
+            bzero(ss, sizeof(*ss));
+            if (type == DNS_IPv4_A) {
+                sockaddr_in *sin = (sockaddr_in*)ss;
+                sin->sin_family = AF_INET;
+                sin->sin_addr.s_addr = ((uint32_t*)addresses)[i];
+#ifdef __APPLE__
+                sin->sin_len = sizeof(sockaddr_in);
+#endif
+            } else if (type == DNS_IPv6_AAAA) {
+                sockaddr_in6 *sin6 = (sockaddr_in6*)ss;
+                sin6->sin6_family = AF_INET6;
+                memcpy(&sin6->sin6_addr, &((in6_addr*)addresses)[i], sizeof(in6_addr));
+#ifdef __APPLE__
+                sin6->sin6_len = sizeof(sockaddr_in6);
+#endif
+            } else {
+                continue;
+            }
+            a->num_addrs++;
+        }
+        a->expires = now + MIN(MAX(ttl, DNS_MIN_TTL), DNS_MAX_TTL);
+    } else if (result == DNS_ERR_NONE || result == DNS_ERR_NOTEXIST) {
+        // negative answer
+        a->num_addrs = 0;
+        a->expires = now + DNS_NEGATIVE_TTL;
+    } else {
+        // timeout or server failure. keep serving what we had for a little while
+        a->expires = now + DNS_ERROR_TTL;
+    }
+    dns_answer_notify(a);
+}
+
+void dns_answer_query(network *n, dns_answer *a)
+{
+    if (a->req) {
+        return;
+    }
+    if (a->family == AF_INET6) {
+        a->req = evdns_base_resolve_ipv6(n->evdns, a->entry->host, 0, dns_evdns_cb, a);
+    } else {
+        a->req = evdns_base_resolve_ipv4(n->evdns, a->entry->host, 0, dns_evdns_cb, a);
+    }
+    if (!a->req) {
+        a->expires = time(NULL) + DNS_ERROR_TTL;
+        timer_start(n, 0, ^{
+            dns_answer_notify(a);
+        });
+    }
+}
+
+void dns_entry_refresh(network *n, dns_entry *e, time_t window)
+{
+    time_t now = time(NULL);
+    if (e->v4.expires <= now + window) {
+        dns_answer_query(n, &e->v4);
+    }
+    if (e->v6.expires <= now + window) {
+        dns_answer_query(n, &e->v6);
+    }
+}
+
+void dns_prefetch_start(network *n)
+{
+    if (dns_prefetch_timer) {
+        return;
+    }
+    dns_prefetch_timer = timer_repeating(n, 5000, ^{
+        time_t now = time(NULL);
+        hash_iter(dns_cache, ^bool (const char *host, void *val) {
+            dns_entry *e = (dns_entry*)val;
+            if (now - e->last_used < DNS_PREFETCH_IDLE) {
+                // recently used, keep it warm
+                dns_entry_refresh(n, e, DNS_PREFETCH_WINDOW);
+            } else if (now - e->last_used > DNS_EXPIRE_IDLE && !e->v4.req && !e->v6.req &&
+                       TAILQ_EMPTY(&e->v4.waiters) && TAILQ_EMPTY(&e->v6.waiters)) {
+                hash_remove(dns_cache, host);
+                free(e->host);
+                free(e);
+            }
+            return true;
+        });
+    });
+}
+
+dns_entry* dns_entry_get(network *n, const char *host)
+{
+    if (!dns_cache) {
+        dns_cache = hash_table_create();
+    }
+    dns_prefetch_start(n);
+    char name[NI_MAXHOST];
+    snprintf(name, sizeof(name), "%s", host);
+    for (char *c = name; *c; c++) {
+        *c = tolower(*c);
+    }
+    dns_entry *e = hash_get(dns_cache, name);
+    if (!e) {
+        e = alloc(dns_entry);
+        e->host = strdup(name);
+        e->v4.entry = e;
+        e->v4.family = AF_INET;
+        TAILQ_INIT(&e->v4.waiters);
+        e->v6.entry = e;
+        e->v6.family = AF_INET6;
+        TAILQ_INIT(&e->v6.waiters);
+        hash_set(dns_cache, e->host, e);
+    }
+    e->last_used = time(NULL);
+    return e;
+}
+
+bool dns_parse_numeric(const char *host, int family, sockaddr_storage *ss)
+{
+    char name[NI_MAXHOST];
+    snprintf(name, sizeof(name), "%s", host);
+    // IPv6 literals from URIs keep their brackets
+    size_t len = strlen(name);
+    if (len >= 2 && name[0] == '[' && name[len - 1] == ']') {
+        memmove(name, name + 1, len - 2);
+        name[len - 2] = '\0';
+    }
+    bzero(ss, sizeof(*ss));
+    if (family == AF_INET) {
+        sockaddr_in *sin = (sockaddr_in*)ss;
+        if (evutil_inet_pton(AF_INET, name, &sin->sin_addr) != 1) {
+            return false;
+        }
+        sin->sin_family = AF_INET;
+#ifdef __APPLE__
+        sin->sin_len = sizeof(sockaddr_in);
+#endif
+    } else {
+        sockaddr_in6 *sin6 = (sockaddr_in6*)ss;
+        if (evutil_inet_pton(AF_INET6, name, &sin6->sin6_addr) != 1) {
+            return false;
+        }
+        sin6->sin6_family = AF_INET6;
+#ifdef __APPLE__
+        sin6->sin6_len = sizeof(sockaddr_in6);
+#endif
+    }
+    return true;
+}
+
+bool dns_is_numeric(const char *host)
+{
+    sockaddr_storage ss;
+    return dns_parse_numeric(host, AF_INET, &ss) || dns_parse_numeric(host, AF_INET6, &ss);
+}
+
+void dns_resolve(network *n, const char *host, int family, dns_callback cb)
+{
+    assert(family == AF_INET || family == AF_INET6);
+    if (dns_is_numeric(host)) {
+        sockaddr_storage ss;
+        bool found = dns_parse_numeric(host, family, &ss);
+        timer_start(n, 0, ^{
+            cb(&ss, found ? 1 : 0);
+        });
+        return;
+    }
+    dns_entry *e = dns_entry_get(n, host);
+    dns_answer *a = family == AF_INET6 ? &e->v6 : &e->v4;
+    if (a->expires > time(NULL)) {
+        timer_start(n, 0, ^{
+            cb(a->addrs, a->num_addrs);
+        });
+        return;
+    }
+    dns_waiter *w = alloc(dns_waiter);
+    w->cb = Block_copy(cb);
+    TAILQ_INSERT_TAIL(&a->waiters, w, next);
+    dns_answer_query(n, a);
+}
+
+bool dns_cached_address(network *n, const char *host, sockaddr_storage *addr)
+{
+    if (dns_is_numeric(host)) {
+        return dns_parse_numeric(host, AF_INET, addr) || dns_parse_numeric(host, AF_INET6, addr);
+    }
+    dns_entry *e = dns_entry_get(n, host);
+    dns_entry_refresh(n, e, DNS_PREFETCH_WINDOW);
+    time_t now = time(NULL);
+    dns_answer *order[2] = {&e->v4, &e->v6};
+    if (dns_preferred_family == AF_INET6) {
+        order[0] = &e->v6;
+        order[1] = &e->v4;
+    }
+    for (size_t i = 0; i < lenof(order); i++) {
+        dns_answer *a = order[i];
+        if (a->expires > now && a->num_addrs) {
+            memcpy(addr, &a->addrs[randombytes_uniform(a->num_addrs)], sizeof(sockaddr_storage));
+            return true;
+        }
+    }
+    return false;
+}
+
+struct happy_eyeballs {
+    network *n;
+    port_t port;
+    uint64_t timeout_ms;
+    happy_eyeballs_callback cb;
+
+    sockaddr_storage v6[DNS_MAX_ADDRS];
+    sockaddr_storage v4[DNS_MAX_ADDRS];
+    uint8_t num_v6;
+    uint8_t num_v4;
+    uint8_t next_v6;
+    uint8_t next_v4;
+    int last_family;
+
+    bufferevent *attempts[2 * DNS_MAX_ADDRS];
+    timer *attempt_timer;
+    timer *resolution_timer;
+
+    int error;
+    uint8_t dns_pending;
+    bool v6_done:1;
+    bool started:1;
+    bool done:1;
+};
+
+void happy_eyeballs_maybe_free(happy_eyeballs *he)
+{
+    if (!he->done || he->dns_pending) {
+        return;
+    }
+    Block_release(he->cb);
+    free(he);
+}
+
+void happy_eyeballs_stop(happy_eyeballs *he, bufferevent *keep)
+{
+    he->done = true;
+    if (he->attempt_timer) {
+        timer_cancel(he->attempt_timer);
+        he->attempt_timer = NULL;
+    }
+    if (he->resolution_timer) {
+        timer_cancel(he->resolution_timer);
+        he->resolution_timer = NULL;
+    }
+    for (size_t i = 0; i < lenof(he->attempts); i++) {
+        if (he->attempts[i] && he->attempts[i] != keep) {
+            bufferevent_free(he->attempts[i]);
+        }
+        he->attempts[i] = NULL;
+    }
+}
+
+void happy_eyeballs_finish(happy_eyeballs *he, bufferevent *bev, int error)
+{
+    happy_eyeballs_stop(he, bev);
+    if (bev) {
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        bufferevent_set_timeouts(bev, NULL, NULL);
+        sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        if (!getpeername(bufferevent_getfd(bev), (sockaddr *)&ss, &len)) {
+            dns_preferred_family = ss.ss_family;
+        }
+    }
+    he->cb(bev, error);
+    happy_eyeballs_maybe_free(he);
+}
+
+bool happy_eyeballs_any_attempts(happy_eyeballs *he)
+{
+    for (size_t i = 0; i < lenof(he->attempts); i++) {
+        if (he->attempts[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void happy_eyeballs_check_failed(happy_eyeballs *he)
+{
+    if (he->dns_pending || he->resolution_timer || happy_eyeballs_any_attempts(he)) {
+        return;
+    }
+    happy_eyeballs_finish(he, NULL, he->error ?: EHOSTUNREACH);
+}
+
+sockaddr_storage* happy_eyeballs_pick(happy_eyeballs *he)
+{
+    // interleave address families, IPv6 first
+    int first = he->last_family == AF_INET6 ? AF_INET : AF_INET6;
+    for (int k = 0; k < 2; k++) {
+        int family = !k ? first : (first == AF_INET6 ? AF_INET : AF_INET6);
+        if (family == AF_INET6 && he->next_v6 < he->num_v6) {
+            he->last_family = family;
+            return &he->v6[he->next_v6++];
+        }
+        if (family == AF_INET && he->next_v4 < he->num_v4) {
+            he->last_family = family;
+            return &he->v4[he->next_v4++];
+        }
+    }
+    return NULL;
+}
+
+void happy_eyeballs_event_cb(bufferevent *bev, short events, void *ctx);
+
+void happy_eyeballs_attempt_next(happy_eyeballs *he)
+{
+    if (he->attempt_timer) {
+        timer_cancel(he->attempt_timer);
+        he->attempt_timer = NULL;
+    }
+    for (;;) {
+        sockaddr_storage *ss = happy_eyeballs_pick(he);
+        if (!ss) {
+            happy_eyeballs_check_failed(he);
+            return;
+        }
+        size_t i;
+        for (i = 0; i < lenof(he->attempts) && he->attempts[i]; i++);
+        assert(i < lenof(he->attempts));
+        bufferevent *bev = bufferevent_socket_new(he->n->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+        bufferevent_setcb(bev, NULL, NULL, happy_eyeballs_event_cb, he);
+        if (he->timeout_ms) {
+            const timeval tv = { he->timeout_ms / 1000, (he->timeout_ms % 1000) * 1000 };
+            bufferevent_set_timeouts(bev, &tv, &tv);
+        }
+        bufferevent_enable(bev, EV_READ);
+        // TODO: if the request is from a peer, use LEDBAT: setsocketopt(sock, SOL_SOCKET, O_TRAFFIC_CLASS, SO_TC_BK, sizeof(int))
+        debug("he:%p attempt %s\n", he, sockaddr_str((const sockaddr*)ss));
+        if (bufferevent_socket_connect(bev, (sockaddr*)ss, sockaddr_get_length((const sockaddr*)ss)) < 0) {
+            he->error = errno;
+            bufferevent_free(bev);
+            continue;
+        }
+        he->attempts[i] = bev;
+        break;
+    }
+    he->attempt_timer = timer_start(he->n, HAPPY_EYEBALLS_ATTEMPT_DELAY_MS, ^{
+        he->attempt_timer = NULL;
+        happy_eyeballs_attempt_next(he);
+    });
+}
+
+void happy_eyeballs_event_cb(bufferevent *bev, short events, void *ctx)
+{
+    happy_eyeballs *he = (happy_eyeballs*)ctx;
+    for (size_t i = 0; i < lenof(he->attempts); i++) {
+        if (he->attempts[i] == bev) {
+            he->attempts[i] = NULL;
+            break;
+        }
+    }
+    if (events & BEV_EVENT_CONNECTED) {
+        happy_eyeballs_finish(he, bev, 0);
+        return;
+    }
+    he->error = (events & BEV_EVENT_TIMEOUT) ? ETIMEDOUT : bufferevent_get_error(bev);
+    debug("he:%p attempt failed %d %s\n", he, he->error, strerror(he->error));
+    bufferevent_free(bev);
+    // don't wait for the delay, move on to the next address now
+    happy_eyeballs_attempt_next(he);
+}
+
+void happy_eyeballs_start(happy_eyeballs *he)
+{
+    // the pending delay picks up any new addresses. with none pending, the last attempt has had its
+    // head start, so a late answer (A after AAAA) races it now instead of waiting out its connect
+    if (he->attempt_timer) {
+        return;
+    }
+    he->started = true;
+    happy_eyeballs_attempt_next(he);
+}
+
+void happy_eyeballs_resolved(happy_eyeballs *he, int family, const sockaddr_storage *addrs, size_t num_addrs)
+{
+    he->dns_pending--;
+    if (he->done) {
+        happy_eyeballs_maybe_free(he);
+        return;
+    }
+    sockaddr_storage *list = family == AF_INET6 ? he->v6 : he->v4;
+    uint8_t *num = family == AF_INET6 ? &he->num_v6 : &he->num_v4;
+    for (size_t i = 0; i < num_addrs && *num < DNS_MAX_ADDRS; i++) {
+        memcpy(&list[*num], &addrs[i], sizeof(sockaddr_storage));
+        sockaddr_set_port((sockaddr*)&list[*num], he->port);
+        (*num)++;
+    }
+    if (family == AF_INET6) {
+        he->v6_done = true;
+        if (he->resolution_timer) {
+            timer_cancel(he->resolution_timer);
+            he->resolution_timer = NULL;
+        }
+        happy_eyeballs_start(he);
+        return;
+    }
+    if (!he->v6_done && num_addrs && !he->started) {
+        // give AAAA a moment to arrive
+        he->resolution_timer = timer_start(he->n, HAPPY_EYEBALLS_RESOLUTION_DELAY_MS, ^{
+            he->resolution_timer = NULL;
+            happy_eyeballs_start(he);
+        });
+        return;
+    }
+    happy_eyeballs_start(he);
+}
+
+happy_eyeballs* happy_eyeballs_connect(network *n, const char *host, port_t port, uint64_t timeout_ms, happy_eyeballs_callback cb)
+{
+    happy_eyeballs *he = alloc(happy_eyeballs);
+    he->n = n;
+    he->port = port;
+    he->timeout_ms = timeout_ms;
+    he->cb = Block_copy(cb);
+    he->dns_pending = 2;
+    debug("he:%p connecting to %s:%u\n", he, host, port);
+    dns_resolve(n, host, AF_INET6, ^(const sockaddr_storage *addrs, size_t num_addrs) {
+        happy_eyeballs_resolved(he, AF_INET6, addrs, num_addrs);
+    });
+    dns_resolve(n, host, AF_INET, ^(const sockaddr_storage *addrs, size_t num_addrs) {
+        happy_eyeballs_resolved(he, AF_INET, addrs, num_addrs);
+    });
+    return he;
+}
+
+void happy_eyeballs_cancel(happy_eyeballs *he)
+{
+    happy_eyeballs_stop(he, NULL);
+    happy_eyeballs_maybe_free(he);
+}
+
 void set_max_nofile()
 {
     rlimit nofile;
@@ -670,7 +2006,7 @@ network* network_setup(char *address, port_t port)
     // don't add any content type automatically
     evhttp_set_default_content_type(n->http, NULL);
     evhttp_set_bevcb(n->http, create_bev, NULL);
-    evhttp_set_timeout(n->http, 50);
+    evhttp_set_timeout(n->http, HTTP_IDLE_TIMEOUT);
 
     if (evthread_make_base_notifiable(n->evbase)) {
         fprintf(stderr, "evthread_make_base_notifiable failed\n");
@@ -691,12 +2027,15 @@ network* network_setup(char *address, port_t port)
 
     n->utp = utp_init(2);
     lsd_setup(n);
+    obfoo_setup(n);
+    thread_pool_setup(n);
 
     utp_context_set_userdata(n->utp, n);
 
     utp_set_callback(n->utp, UTP_GET_RANDOM, &utp_callback_get_random);
     utp_set_callback(n->utp, UTP_LOG, &utp_callback_log);
     utp_set_callback(n->utp, UTP_SENDTO, &utp_callback_sendto);
+    utp_set_callback(n->utp, UTP_GET_UDP_MTU, &utp_callback_get_udp_mtu);
     utp_set_callback(n->utp, UTP_ON_FIREWALL, &utp_on_firewall);
     utp_set_callback(n->utp, UTP_ON_ACCEPT, &utp_on_accept);
     utp_set_callback(n->utp, UTP_ON_ERROR, &utp_on_error);
@@ -1,6 +1,9 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <assert.h>
+#include <netinet/in.h>
+
 #include <event2/event.h>
 #include <event2/event_struct.h>
 #include <event2/dns.h>
@@ -42,6 +45,9 @@ typedef struct network network;
 #endif
 #endif
 
+// seconds an idle HTTP connection is kept open by evhttp, on both ends of a peer connection
+#define HTTP_IDLE_TIMEOUT 50
+
 typedef struct event_base event_base;
 typedef struct evdns_base evdns_base;
 typedef struct event event;
@@ -74,6 +80,19 @@ typedef enum bufferevent_flush_mode bufferevent_flush_mode;
 typedef enum bufferevent_filter_result bufferevent_filter_result;
 typedef in_port_t port_t;
 
+// compact addresses, as in DHT values and X-Peers4 / X-Peers6
+typedef struct {
+    in_addr_t ip;
+    port_t port;
+} PACKED packed_ipv4;
+static_assert(sizeof(packed_ipv4) == 6, "packed_ipv4 should be 6 bytes");
+
+typedef struct {
+    in6_addr ip;
+    port_t port;
+} PACKED packed_ipv6;
+static_assert(sizeof(packed_ipv6) == 18, "packed_ipv6 should be 18 bytes");
+
 #include "timer.h"
 
 
@@ -106,8 +125,22 @@ int sockaddr_cmp(const struct sockaddr * sa, const struct sockaddr * sb);
 bool sockaddr_eq(const struct sockaddr * sa, const struct sockaddr * sb);
 const char* sockaddr_str(const sockaddr *ss);
 bool sockaddr_is_localhost(const sockaddr *sa, socklen_t salen);
+bool sockaddr_is_private(const sockaddr *sa);
 bool bufferevent_is_localhost(const bufferevent *bev);
 
+typedef struct happy_eyeballs happy_eyeballs;
+typedef void (^dns_callback)(const sockaddr_storage *addrs, size_t num_addrs);
+typedef void (^happy_eyeballs_callback)(bufferevent *bev, int error);
+
+void dns_resolve(network *n, const char *host, int family, dns_callback cb);
+bool dns_parse_numeric(const char *host, int family, sockaddr_storage *ss);
+bool dns_cached_address(network *n, const char *host, sockaddr_storage *addr);
+happy_eyeballs* happy_eyeballs_connect(network *n, const char *host, port_t port, uint64_t timeout_ms, happy_eyeballs_callback cb);
+void happy_eyeballs_cancel(happy_eyeballs *he);
+
+void pmtu_update(const sockaddr *sa, uint16_t mtu);
+uint16_t pmtu_get(const sockaddr *sa);
+
 int udp_sendto(int fd, const uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen);
 bool udp_received(network *n, uint8_t *buf, size_t len, const sockaddr *sa, socklen_t salen);
 network* network_setup(char *address, port_t port);
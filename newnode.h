@@ -10,3 +10,5 @@ typedef void (^https_callback)(const char *url, https_complete_callback cb);
 network* newnode_init(const char *app_name, const char *app_id, port_t *http_port, port_t *socks_port, https_callback https_cb);
 int newnode_run(network *n);
 void newnode_thread(network *n);
+// don't encrypt connections to peers found on the local network, if they allow it too
+void newnode_set_lan_null_cipher(bool enabled);
@@ -1,53 +1,357 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/queue.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 
+#ifdef __APPLE__
+#include <CommonCrypto/CommonCryptor.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "timer.h"
+#include "hash_table.h"
 #include "obfoo.h"
 
 
+#define AES256_KEY_LENGTH 32
+
+#define TICKET_LIFETIME (10 * 60)
+// clients give up on a ticket before the server forgets it
+#define TICKET_CLIENT_LIFETIME (8 * 60)
+// past this the server forgets the ticket closest to expiring
+#define TICKETS_ISSUED_MAX 4096
+
+typedef struct obfoo_ticket {
+    char *key;
+    uint8_t ticket[TICKET_BYTES];
+    uint8_t secret[TICKET_BYTES];
+    time_t expires;
+    // server: in issue order, which is expiry order since they all live TICKET_LIFETIME
+    TAILQ_ENTRY(obfoo_ticket) next;
+} obfoo_ticket;
+
+// server: hex(ticket) -> obfoo_ticket
+hash_table *tickets_issued;
+TAILQ_HEAD(, obfoo_ticket) tickets_expiring = TAILQ_HEAD_INITIALIZER(tickets_expiring);
+// client: peer address -> obfoo_ticket
+hash_table *tickets_held;
+
 int crypto_stream_chacha20_xor_ic_bytes(uint8_t *c, const uint8_t *m, size_t mlen,
                                         const unsigned char *n, uint64_t ic_bytes,
-                                        const unsigned char *k)
+                                        const unsigned char *k, keystream *ks)
 {
     size_t partial = ic_bytes % crypto_stream_chacha20_BLOCK_LENGTH;
-    if (partial) {
-        uint8_t block[crypto_stream_chacha20_BLOCK_LENGTH] = {0};
-        uint8_t *p = &block[partial];
+    if (partial && mlen) {
+        uint64_t ic = ic_bytes / crypto_stream_chacha20_BLOCK_LENGTH;
+        if (ks->ic != ic + 1) {
+            memset(ks->block, 0, sizeof(ks->block));
+            int r = crypto_stream_chacha20_xor_ic(ks->block, ks->block, sizeof(ks->block), n, ic, k);
+            if (r != 0) {
+                return r;
+            }
+            ks->ic = ic + 1;
+        }
         size_t plen = MIN(crypto_stream_chacha20_BLOCK_LENGTH - partial, mlen);
-        memcpy(p, m, plen);
-        int r = crypto_stream_chacha20_xor_ic(block, block, &p[plen] - block, n, ic_bytes / crypto_stream_chacha20_BLOCK_LENGTH, k);
+        for (size_t i = 0; i < plen; i++) {
+            c[i] = m[i] ^ ks->block[partial + i];
+        }
+        c += plen;
+        m += plen;
+        mlen -= plen;
+        ic_bytes += plen;
+    }
+    // whole blocks in one call, so libsodium can use its multi-block implementation
+    size_t whole = mlen - mlen % crypto_stream_chacha20_BLOCK_LENGTH;
+    if (whole) {
+        int r = crypto_stream_chacha20_xor_ic(c, m, whole, n, ic_bytes / crypto_stream_chacha20_BLOCK_LENGTH, k);
+        if (r != 0) {
+            return r;
+        }
+        c += whole;
+        m += whole;
+        mlen -= whole;
+        ic_bytes += whole;
+    }
+    if (mlen) {
+        // generate the last block once, keep the rest for the next call
+        uint64_t ic = ic_bytes / crypto_stream_chacha20_BLOCK_LENGTH;
+        memset(ks->block, 0, sizeof(ks->block));
+        int r = crypto_stream_chacha20_xor_ic(ks->block, ks->block, sizeof(ks->block), n, ic, k);
         if (r != 0) {
             return r;
         }
-        memcpy(c, p, plen);
+        ks->ic = ic + 1;
+        for (size_t i = 0; i < mlen; i++) {
+            c[i] = m[i] ^ ks->block[i];
+        }
+    }
+    return 0;
+}
+
+#ifdef __APPLE__
+
+struct aes_stream {
+    CCCryptorRef cryptor;
+};
+
+bool aes_stream_available(void)
+{
+    return true;
+}
+
+aes_stream* aes_stream_new(const uint8_t *key, const uint8_t *nonce)
+{
+    uint8_t k[AES256_KEY_LENGTH];
+    crypto_generichash(k, sizeof(k), (const uint8_t *)"aes256ctr", strlen("aes256ctr"), key, crypto_kx_SESSIONKEYBYTES);
+    uint8_t iv[AES_BLOCK_LENGTH] = {0};
+    memcpy(iv, nonce, crypto_stream_chacha20_NONCEBYTES);
+    aes_stream *a = alloc(aes_stream);
+    CCCryptorStatus s = CCCryptorCreateWithMode(kCCEncrypt, kCCModeCTR, kCCAlgorithmAES, ccNoPadding, iv, k, sizeof(k),
+                                                NULL, 0, 0, kCCModeOptionCTR_BE, &a->cryptor);
+    sodium_memzero(k, sizeof(k));
+    if (s != kCCSuccess) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+int aes_stream_xor(aes_stream *a, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+    // CommonCrypto keeps the counter and the partial block between calls
+    size_t moved;
+    return CCCryptorUpdate(a->cryptor, m, mlen, c, mlen, &moved) == kCCSuccess ? 0 : -1;
+}
+
+void aes_stream_free(aes_stream *a)
+{
+    if (a) {
+        CCCryptorRelease(a->cryptor);
+        free(a);
+    }
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#define AES256_ROUNDS 14
+
+struct aes_stream {
+    uint8_t round_keys[AES256_ROUNDS + 1][AES_BLOCK_LENGTH];
+    uint8_t nonce[crypto_stream_chacha20_NONCEBYTES];
+    uint64_t ic_bytes;
+    uint8_t block[AES_BLOCK_LENGTH];
+    // block counter + 1, 0 if empty
+    uint64_t ic;
+};
+
+bool aes_stream_available(void)
+{
+    return sodium_runtime_has_aesni();
+}
+
+__attribute__((target("aes,sse2")))
+__m128i aes256_expand_even(__m128i k, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 8));
+    return _mm_xor_si128(k, assist);
+}
+
+__attribute__((target("aes,sse2")))
+__m128i aes256_expand_odd(__m128i k, __m128i even)
+{
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0), 0xaa);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 8));
+    return _mm_xor_si128(k, assist);
+}
+
+// the round constant has to be an immediate
+#define AES256_EXPAND(rk, i, rcon) \
+    rk[i] = aes256_expand_even(rk[i - 2], _mm_aeskeygenassist_si128(rk[i - 1], rcon)); \
+    rk[i + 1] = aes256_expand_odd(rk[i - 1], rk[i]);
+
+__attribute__((target("aes,sse2")))
+void aes256_key_schedule(aes_stream *a, const uint8_t *key)
+{
+    __m128i rk[AES256_ROUNDS + 1];
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + AES_BLOCK_LENGTH));
+    AES256_EXPAND(rk, 2, 0x01);
+    AES256_EXPAND(rk, 4, 0x02);
+    AES256_EXPAND(rk, 6, 0x04);
+    AES256_EXPAND(rk, 8, 0x08);
+    AES256_EXPAND(rk, 10, 0x10);
+    AES256_EXPAND(rk, 12, 0x20);
+    rk[14] = aes256_expand_even(rk[12], _mm_aeskeygenassist_si128(rk[13], 0x40));
+    for (size_t i = 0; i <= AES256_ROUNDS; i++) {
+        _mm_storeu_si128((__m128i *)a->round_keys[i], rk[i]);
+    }
+    sodium_memzero(rk, sizeof(rk));
+}
+
+// xor whole blocks starting at block counter ic, four at a time so the AES units stay busy
+__attribute__((target("aes,sse2")))
+void aes256_ctr_blocks(const aes_stream *a, uint8_t *c, const uint8_t *m, size_t blocks, uint64_t ic)
+{
+    __m128i rk[AES256_ROUNDS + 1];
+    for (size_t i = 0; i <= AES256_ROUNDS; i++) {
+        rk[i] = _mm_loadu_si128((const __m128i *)a->round_keys[i]);
+    }
+    uint8_t counter[AES_BLOCK_LENGTH];
+    memcpy(counter, a->nonce, sizeof(a->nonce));
+    while (blocks) {
+        size_t n = MIN(blocks, 4);
+        __m128i x[4];
+        for (size_t j = 0; j < n; j++) {
+            uint64_t be = ic + j;
+            for (size_t i = 0; i < sizeof(be); i++) {
+                counter[sizeof(a->nonce) + i] = (uint8_t)(be >> (8 * (sizeof(be) - 1 - i)));
+            }
+            x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)counter), rk[0]);
+        }
+        for (size_t r = 1; r < AES256_ROUNDS; r++) {
+            for (size_t j = 0; j < n; j++) {
+                x[j] = _mm_aesenc_si128(x[j], rk[r]);
+            }
+        }
+        for (size_t j = 0; j < n; j++) {
+            x[j] = _mm_aesenclast_si128(x[j], rk[AES256_ROUNDS]);
+            __m128i p = _mm_loadu_si128((const __m128i *)(m + j * AES_BLOCK_LENGTH));
+            _mm_storeu_si128((__m128i *)(c + j * AES_BLOCK_LENGTH), _mm_xor_si128(p, x[j]));
+        }
+        c += n * AES_BLOCK_LENGTH;
+        m += n * AES_BLOCK_LENGTH;
+        blocks -= n;
+        ic += n;
+    }
+}
+
+aes_stream* aes_stream_new(const uint8_t *key, const uint8_t *nonce)
+{
+    uint8_t k[AES256_KEY_LENGTH];
+    crypto_generichash(k, sizeof(k), (const uint8_t *)"aes256ctr", strlen("aes256ctr"), key, crypto_kx_SESSIONKEYBYTES);
+    aes_stream *a = alloc(aes_stream);
+    aes256_key_schedule(a, k);
+    sodium_memzero(k, sizeof(k));
+    memcpy(a->nonce, nonce, sizeof(a->nonce));
+    return a;
+}
+
+int aes_stream_xor(aes_stream *a, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+    size_t partial = a->ic_bytes % AES_BLOCK_LENGTH;
+    if (partial && mlen) {
+        uint64_t ic = a->ic_bytes / AES_BLOCK_LENGTH;
+        if (a->ic != ic + 1) {
+            memset(a->block, 0, sizeof(a->block));
+            aes256_ctr_blocks(a, a->block, a->block, 1, ic);
+            a->ic = ic + 1;
+        }
+        size_t plen = MIN(AES_BLOCK_LENGTH - partial, mlen);
+        for (size_t i = 0; i < plen; i++) {
+            c[i] = m[i] ^ a->block[partial + i];
+        }
         c += plen;
         m += plen;
         mlen -= plen;
-        ic_bytes += plen;
+        a->ic_bytes += plen;
+    }
+    size_t whole = mlen / AES_BLOCK_LENGTH;
+    if (whole) {
+        aes256_ctr_blocks(a, c, m, whole, a->ic_bytes / AES_BLOCK_LENGTH);
+        c += whole * AES_BLOCK_LENGTH;
+        m += whole * AES_BLOCK_LENGTH;
+        mlen -= whole * AES_BLOCK_LENGTH;
+        a->ic_bytes += whole * AES_BLOCK_LENGTH;
+    }
+    if (mlen) {
+        // generate the last block once, keep the rest for the next call
+        uint64_t ic = a->ic_bytes / AES_BLOCK_LENGTH;
+        memset(a->block, 0, sizeof(a->block));
+        aes256_ctr_blocks(a, a->block, a->block, 1, ic);
+        a->ic = ic + 1;
+        for (size_t i = 0; i < mlen; i++) {
+            c[i] = m[i] ^ a->block[i];
+        }
+        a->ic_bytes += mlen;
     }
-    return crypto_stream_chacha20_xor_ic(c, m, mlen, n, ic_bytes / crypto_stream_chacha20_BLOCK_LENGTH, k);
+    return 0;
+}
+
+void aes_stream_free(aes_stream *a)
+{
+    if (a) {
+        sodium_memzero(a, sizeof(*a));
+        free(a);
+    }
+}
+
+#else
+
+// no AES instructions we can reach, ChaCha20 is faster in software
+bool aes_stream_available(void)
+{
+    return false;
+}
+
+aes_stream* aes_stream_new(const uint8_t *key, const uint8_t *nonce)
+{
+    return NULL;
+}
+
+int aes_stream_xor(aes_stream *a, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+    return -1;
+}
+
+void aes_stream_free(aes_stream *a)
+{
 }
 
+#endif
+
 int obfoo_encrypt(obfoo *o, uint8_t *c, const uint8_t *m, size_t mlen)
 {
-    int r = crypto_stream_chacha20_xor_ic_bytes(c, m, mlen, o->tx_nonce, o->tx_ic_bytes, o->tx);
+    int r;
+    if (o->tx_aes) {
+        r = aes_stream_xor(o->tx_aes, c, m, mlen);
+    } else {
+        r = crypto_stream_chacha20_xor_ic_bytes(c, m, mlen, o->tx_nonce, o->tx_ic_bytes, o->tx, &o->tx_keystream);
+    }
     o->tx_ic_bytes += mlen;
     return r;
 }
 
 int obfoo_decrypt(obfoo *o, uint8_t *m, const uint8_t *c, size_t clen)
 {
-    int r = crypto_stream_chacha20_xor_ic_bytes(m, c, clen, o->rx_nonce, o->rx_ic_bytes, o->rx);
+    int r;
+    if (o->rx_aes) {
+        r = aes_stream_xor(o->rx_aes, m, c, clen);
+    } else {
+        r = crypto_stream_chacha20_xor_ic_bytes(m, c, clen, o->rx_nonce, o->rx_ic_bytes, o->rx, &o->rx_keystream);
+    }
     o->rx_ic_bytes += clen;
     return r;
 }
 
+uint32_t obfoo_crypto_available(void)
+{
+    return OBFOO_CHACHA20 | OBFOO_NULL | (aes_stream_available() ? OBFOO_AES256_CTR : 0);
+}
+
 void obfoo_write_intro(obfoo *o, evbuffer *out)
 {
+    if (!o->incoming && !o->resuming) {
+        crypto_kx_keypair(o->pk, o->sk);
+    }
     evbuffer *buf = evbuffer_new();
     evbuffer_add(buf, o->pk, sizeof(o->pk));
     evbuffer_add(buf, o->tx_nonce, sizeof(o->tx_nonce));
@@ -59,16 +363,188 @@ void obfoo_write_intro(obfoo *o, evbuffer *out)
     evbuffer_free(buf);
 }
 
+void obfoo_ticket_free(obfoo_ticket *t)
+{
+    sodium_memzero(t->secret, sizeof(t->secret));
+    free(t->key);
+    free(t);
+}
+
+void obfoo_ticket_unlink(hash_table *h, obfoo_ticket *t)
+{
+    hash_remove(h, t->key);
+    if (h == tickets_issued) {
+        TAILQ_REMOVE(&tickets_expiring, t, next);
+    }
+}
+
+void obfoo_tickets_expire(time_t now)
+{
+    obfoo_ticket *t;
+    while ((t = TAILQ_FIRST(&tickets_expiring)) && t->expires <= now) {
+        obfoo_ticket_unlink(tickets_issued, t);
+        obfoo_ticket_free(t);
+    }
+    hash_iter(tickets_held, ^bool (const char *key, void *val) {
+        obfoo_ticket *held = (obfoo_ticket*)val;
+        if (held->expires <= now) {
+            hash_remove(tickets_held, key);
+            obfoo_ticket_free(held);
+        }
+        return true;
+    });
+}
+
+void obfoo_setup(network *n)
+{
+    tickets_issued = hash_table_create();
+    tickets_held = hash_table_create();
+    timer_repeating(n, 60 * 1000, ^{
+        obfoo_tickets_expire(time(NULL));
+    });
+}
+
+// the ticket is the public half of a keypair seeded by the secret, so a
+// server that doesn't know it can still do a full exchange with it
+void obfoo_ticket_keypair(uint8_t *pk, uint8_t *sk, const uint8_t *secret)
+{
+    uint8_t seed[crypto_kx_SEEDBYTES];
+    crypto_generichash(seed, sizeof(seed), (const uint8_t *)"ticket", strlen("ticket"), secret, TICKET_BYTES);
+    crypto_kx_seed_keypair(pk, sk, seed);
+    sodium_memzero(seed, sizeof(seed));
+}
+
+obfoo_ticket* obfoo_ticket_take(hash_table *h, const char *key)
+{
+    if (!h) {
+        return NULL;
+    }
+    obfoo_ticket *t = hash_get(h, key);
+    if (!t) {
+        return NULL;
+    }
+    obfoo_ticket_unlink(h, t);
+    if (t->expires <= time(NULL)) {
+        obfoo_ticket_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void obfoo_issue_ticket(obfoo *o)
+{
+    hash_table *h = o->incoming ? tickets_issued : tickets_held;
+    if (!h || !o->peer_tickets || (!o->incoming && !o->resume_addr)) {
+        return;
+    }
+    const uint8_t *client_tx = o->incoming ? o->rx : o->tx;
+    const uint8_t *server_tx = o->incoming ? o->tx : o->rx;
+    obfoo_ticket *t = alloc(obfoo_ticket);
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, sizeof(t->secret));
+    crypto_generichash_update(&state, client_tx, crypto_kx_SESSIONKEYBYTES);
+    crypto_generichash_update(&state, server_tx, crypto_kx_SESSIONKEYBYTES);
+    crypto_generichash_final(&state, t->secret, sizeof(t->secret));
+    if (o->incoming) {
+        // the client derives the keypair again when it resumes
+        uint8_t sk[crypto_kx_SECRETKEYBYTES];
+        obfoo_ticket_keypair(t->ticket, sk, t->secret);
+        sodium_memzero(sk, sizeof(sk));
+        char hex[TICKET_BYTES * 2 + 1];
+        sodium_bin2hex(hex, sizeof(hex), t->ticket, sizeof(t->ticket));
+        t->key = strdup(hex);
+        t->expires = time(NULL) + TICKET_LIFETIME;
+    } else {
+        t->key = strdup(o->resume_addr);
+        t->expires = time(NULL) + TICKET_CLIENT_LIFETIME;
+    }
+    obfoo_ticket *old = hash_get(h, t->key);
+    if (old) {
+        obfoo_ticket_unlink(h, old);
+        obfoo_ticket_free(old);
+    }
+    hash_set(h, t->key, t);
+    if (o->incoming) {
+        TAILQ_INSERT_TAIL(&tickets_expiring, t, next);
+        if (hash_length(h) > TICKETS_ISSUED_MAX) {
+            old = TAILQ_FIRST(&tickets_expiring);
+            obfoo_ticket_unlink(h, old);
+            obfoo_ticket_free(old);
+        }
+    }
+}
+
+void obfoo_resume_tag(uint8_t *tag, const uint8_t *secret, const uint8_t *client_nonce)
+{
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, secret, TICKET_BYTES, crypto_kx_PUBLICKEYBYTES);
+    crypto_generichash_update(&state, (const uint8_t *)"ack", strlen("ack"));
+    crypto_generichash_update(&state, client_nonce, crypto_stream_chacha20_NONCEBYTES);
+    crypto_generichash_final(&state, tag, crypto_kx_PUBLICKEYBYTES);
+}
+
+void obfoo_resume_keys(obfoo *o)
+{
+    const uint8_t *client_nonce = o->incoming ? o->rx_nonce : o->tx_nonce;
+    const uint8_t *server_nonce = o->incoming ? o->tx_nonce : o->rx_nonce;
+    uint8_t keys[2 * crypto_kx_SESSIONKEYBYTES];
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, o->resume_secret, sizeof(o->resume_secret), sizeof(keys));
+    crypto_generichash_update(&state, (const uint8_t *)"resume", strlen("resume"));
+    crypto_generichash_update(&state, client_nonce, crypto_stream_chacha20_NONCEBYTES);
+    crypto_generichash_update(&state, server_nonce, crypto_stream_chacha20_NONCEBYTES);
+    crypto_generichash_final(&state, keys, sizeof(keys));
+    const uint8_t *client_tx = keys;
+    const uint8_t *server_tx = &keys[crypto_kx_SESSIONKEYBYTES];
+    memcpy(o->tx, o->incoming ? server_tx : client_tx, sizeof(o->tx));
+    memcpy(o->rx, o->incoming ? client_tx : server_tx, sizeof(o->rx));
+    sodium_memzero(keys, sizeof(keys));
+    sodium_memzero(o->resume_secret, sizeof(o->resume_secret));
+}
+
+void obfoo_resume(obfoo *o, const sockaddr *peer)
+{
+    o->resume_addr = strdup(sockaddr_str(peer));
+    obfoo_ticket *t = obfoo_ticket_take(tickets_held, o->resume_addr);
+    if (!t) {
+        return;
+    }
+    // tickets are single use, the session hands out the next one
+    obfoo_ticket_keypair(o->pk, o->sk, t->secret);
+    memcpy(o->resume_secret, t->secret, sizeof(o->resume_secret));
+    o->resuming = true;
+    obfoo_ticket_free(t);
+}
+
+bool obfoo_path_key(const obfoo *o, uint8_t *key)
+{
+    if (o->state != OF_STATE_READY) {
+        return false;
+    }
+    const uint8_t *client_tx = o->incoming ? o->rx : o->tx;
+    const uint8_t *server_tx = o->incoming ? o->tx : o->rx;
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, OBFOO_PATH_KEY_BYTES);
+    crypto_generichash_update(&state, (const uint8_t *)"path", strlen("path"));
+    crypto_generichash_update(&state, client_tx, crypto_kx_SESSIONKEYBYTES);
+    crypto_generichash_update(&state, server_tx, crypto_kx_SESSIONKEYBYTES);
+    crypto_generichash_final(&state, key, OBFOO_PATH_KEY_BYTES);
+    return true;
+}
+
 obfoo* obfoo_new()
 {
     obfoo *o = alloc(obfoo);
-    crypto_kx_keypair(o->pk, o->sk);
     randombytes_buf(o->tx_nonce, sizeof(o->tx_nonce));
+    o->crypto_provide = OBFOO_CHACHA20 | OBFOO_AES256_CTR;
     return o;
 }
 
 void obfoo_free(obfoo *o)
 {
+    aes_stream_free(o->rx_aes);
+    aes_stream_free(o->tx_aes);
+    free(o->resume_addr);
     free(o);
 }
 
@@ -76,12 +552,21 @@ ssize_t evbuffer_filter(evbuffer *in, evbuffer *out, bool (^cb)(evbuffer_iovec v
 {
     evbuffer_ptr ptr;
     evbuffer_ptr_set(in, &ptr, 0, EVBUFFER_PTR_SET);
-    evbuffer_iovec v;
-    while (evbuffer_peek(in, -1, &ptr, &v, 1) > 0) {
-        if (!cb(v)) {
-            return -1;
+    evbuffer_iovec v[16];
+    for (;;) {
+        int n = evbuffer_peek(in, -1, &ptr, v, lenof(v));
+        if (n <= 0) {
+            break;
         }
-        if (evbuffer_ptr_set(in, &ptr, v.iov_len, EVBUFFER_PTR_ADD) < 0) {
+        n = MIN(n, (int)lenof(v));
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            if (!cb(v[i])) {
+                return -1;
+            }
+            len += v[i].iov_len;
+        }
+        if (evbuffer_ptr_set(in, &ptr, len, EVBUFFER_PTR_ADD) < 0) {
             break;
         }
     }
@@ -97,12 +582,42 @@ ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o)
         if (evbuffer_get_length(in) < INTRO_BYTES) {
             return 0;
         }
-        uint8_t *other_pk = evbuffer_pullup(in, crypto_kx_PUBLICKEYBYTES);
+        uint8_t other_pk[crypto_kx_PUBLICKEYBYTES];
+        evbuffer_remove(in, other_pk, sizeof(other_pk));
+        evbuffer_remove(in, o->rx_nonce, sizeof(o->rx_nonce));
 
         if (o->incoming) {
-            if (crypto_kx_server_session_keys(o->rx, o->tx, o->pk, o->sk, other_pk)) {
-                debug("suspicious client public key\n");
-                return -1;
+            char hex[TICKET_BYTES * 2 + 1];
+            sodium_bin2hex(hex, sizeof(hex), other_pk, sizeof(other_pk));
+            obfoo_ticket *t = obfoo_ticket_take(tickets_issued, hex);
+            if (t) {
+                o->resuming = true;
+                memcpy(o->resume_secret, t->secret, sizeof(o->resume_secret));
+                obfoo_ticket_free(t);
+                obfoo_resume_tag(o->pk, o->resume_secret, o->rx_nonce);
+                obfoo_resume_keys(o);
+            } else {
+                crypto_kx_keypair(o->pk, o->sk);
+                if (crypto_kx_server_session_keys(o->rx, o->tx, o->pk, o->sk, other_pk)) {
+                    debug("suspicious client public key\n");
+                    return -1;
+                }
+            }
+        } else if (o->resuming) {
+            uint8_t tag[crypto_kx_PUBLICKEYBYTES];
+            obfoo_resume_tag(tag, o->resume_secret, o->tx_nonce);
+            if (!sodium_memcmp(tag, other_pk, sizeof(tag))) {
+                obfoo_resume_keys(o);
+            } else {
+                // the server doesn't know the ticket and answered with its own public key,
+                // which we can finish with the ticket's secret key
+                debug("resumption ticket rejected, full exchange\n");
+                o->resuming = false;
+                sodium_memzero(o->resume_secret, sizeof(o->resume_secret));
+                if (crypto_kx_client_session_keys(o->rx, o->tx, o->pk, o->sk, other_pk)) {
+                    debug("suspicious server public key\n");
+                    return -1;
+                }
             }
         } else {
             if (crypto_kx_client_session_keys(o->rx, o->tx, o->pk, o->sk, other_pk)) {
@@ -113,9 +628,6 @@ ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o)
         // session keys are generated, destroy secret key
         memset(o->sk, 0, sizeof(o->sk));
 
-        evbuffer_drain(in, crypto_kx_PUBLICKEYBYTES);
-        evbuffer_remove(in, o->rx_nonce, sizeof(o->rx_nonce));
-
         crypto_generichash_state state;
         crypto_generichash_init(&state, NULL, 0, sizeof(SYNC_HASH_LEN));
         crypto_generichash_update(&state, (const uint8_t *)"req1", strlen("req1"));
@@ -138,13 +650,32 @@ ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o)
                 uint8_t buf[sizeof(crypt_intro) + PAD_MAX + sizeof(uint16_t)];
                 crypt_intro ci;
             } r = {.buf = {0}};
-            r.ci.crypto_provide = 0x01;
-            r.ci.pad_len = (uint16_t)randombytes_uniform(PAD_MAX);
+            o->crypto_provide &= obfoo_crypto_available();
+            // older peers refuse any other bit here, the full set goes in the extension
+            r.ci.crypto_provide = o->crypto_provide & OBFOO_CHACHA20;
+            obfoo_ext *ext = (obfoo_ext*)r.ci.pad;
+            r.ci.pad_len = (uint16_t)(sizeof(obfoo_ext) + randombytes_uniform(PAD_MAX - sizeof(obfoo_ext)));
             randombytes_buf(r.ci.pad, r.ci.pad_len);
+            memcpy(ext->magic, OBFOO_EXT_MAGIC, sizeof(ext->magic));
+            ext->crypto_provide = o->crypto_provide;
+            ext->flags = o->resume_addr ? OBFOO_EXT_TICKETS : 0;
             size_t crypt_len = sizeof(crypt_intro) + r.ci.pad_len + sizeof(uint16_t);
+            size_t early = o->early_input ? MIN(evbuffer_get_length(o->early_input), EARLY_DATA_MAX) : 0;
+            uint16_t ia_len = (uint16_t)early;
+            memcpy(&r.buf[crypt_len - sizeof(ia_len)], &ia_len, sizeof(ia_len));
             obfoo_encrypt(o, r.buf, r.buf, crypt_len);
             evbuffer_add(buf, r.buf, crypt_len);
 
+            // don't wait for crypto_select to send what we already have
+            if (early) {
+                evbuffer *ia = evbuffer_new();
+                evbuffer_remove_buffer(o->early_input, ia, early);
+                evbuffer_filter(ia, buf, ^bool (evbuffer_iovec v) {
+                    return !obfoo_encrypt(o, v.iov_base, v.iov_base, v.iov_len);
+                });
+                evbuffer_free(ia);
+            }
+
             evbuffer_add_buffer(o->output, buf);
             evbuffer_free(buf);
 
@@ -183,30 +714,75 @@ ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o)
             debug("incorrect vc: %llu != 0\n", (unsigned long long)ci->vc);
             return -1;
         }
-        if (ci->crypto_provide > 0x01) {
-            debug("unsupported crypto_provide: %u > 0x01\n", ci->crypto_provide);
-            return -1;
-        }
+        // incoming: what the client provided so far, outgoing: what the server selected
+        o->crypto_select = ci->crypto_provide;
         o->discarding = ci->pad_len;
         evbuffer_drain(in, sizeof(crypt_intro));
 
+        o->state = OF_STATE_EXT;
+    }
+    case OF_STATE_EXT: {
+        if (o->discarding >= sizeof(obfoo_ext)) {
+            if (evbuffer_get_length(in) < sizeof(obfoo_ext)) {
+                return 0;
+            }
+            obfoo_ext ext;
+            evbuffer_remove(in, &ext, sizeof(ext));
+            obfoo_decrypt(o, (uint8_t*)&ext, (uint8_t*)&ext, sizeof(ext));
+            o->discarding -= sizeof(ext);
+            if (memeq(ext.magic, OBFOO_EXT_MAGIC, sizeof(ext.magic))) {
+                if (o->incoming) {
+                    o->crypto_select |= ext.crypto_provide;
+                }
+                o->peer_tickets = !!(ext.flags & OBFOO_EXT_TICKETS);
+            }
+        }
         if (o->incoming) {
-            // len(ia)
-            o->discarding += sizeof(uint16_t);
+            // reserved bits are ignored, the fastest cipher both sides allow wins
+            uint32_t common = o->crypto_select & o->crypto_provide & obfoo_crypto_available();
+            if (common & OBFOO_NULL) {
+                o->crypto_select = OBFOO_NULL;
+            } else if (common & OBFOO_AES256_CTR) {
+                o->crypto_select = OBFOO_AES256_CTR;
+            } else if (common & OBFOO_CHACHA20) {
+                o->crypto_select = OBFOO_CHACHA20;
+            } else {
+                debug("unsupported crypto_provide: 0x%x\n", o->crypto_select);
+                return -1;
+            }
+        } else {
+            // exactly one of the bits we provided
+            uint32_t select = o->crypto_select;
+            if (!select || (select & (select - 1)) || !(select & o->crypto_provide)) {
+                debug("unsupported crypto_select: 0x%x (provided 0x%x)\n", select, o->crypto_provide);
+                return -1;
+            }
+        }
 
+        if (o->incoming) {
             // vc,crypto_provide,(uint16_t)len(pad),pad
             union {
                 uint8_t buf[sizeof(crypt_intro) + PAD_MAX];
                 crypt_intro ci;
             } r = {.buf = {0}};
-            r.ci.crypto_provide = 0x01;
-            r.ci.pad_len = (uint16_t)randombytes_uniform(PAD_MAX);
+            r.ci.crypto_provide = o->crypto_select;
+            obfoo_ext *ext = (obfoo_ext*)r.ci.pad;
+            r.ci.pad_len = (uint16_t)(sizeof(obfoo_ext) + randombytes_uniform(PAD_MAX - sizeof(obfoo_ext)));
             randombytes_buf(r.ci.pad, r.ci.pad_len);
+            memcpy(ext->magic, OBFOO_EXT_MAGIC, sizeof(ext->magic));
+            ext->crypto_provide = o->crypto_select;
+            // only clients that keep tickets get one
+            ext->flags = o->peer_tickets ? OBFOO_EXT_TICKETS : 0;
             size_t crypt_len = sizeof(r.ci) + r.ci.pad_len;
             obfoo_encrypt(o, r.buf, r.buf, crypt_len);
             evbuffer_add(o->output, r.buf, crypt_len);
         }
 
+        // everything we send from here on is payload
+        if (o->crypto_select == OBFOO_AES256_CTR) {
+            o->tx_aes = aes_stream_new(o->tx, o->tx_nonce);
+        }
+
         o->state = OF_STATE_DISCARD;
     }
     case OF_STATE_DISCARD: {
@@ -217,9 +793,45 @@ ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o)
         if (o->discarding) {
             return discard;
         }
+        o->state = OF_STATE_EARLY_DATA;
+    }
+    case OF_STATE_EARLY_DATA: {
+        if (o->incoming) {
+            if (!o->early_data_len) {
+                if (evbuffer_get_length(in) < sizeof(o->early_data)) {
+                    return 0;
+                }
+                evbuffer_remove(in, &o->early_data, sizeof(o->early_data));
+                obfoo_decrypt(o, (uint8_t*)&o->early_data, (uint8_t*)&o->early_data, sizeof(o->early_data));
+                o->early_data_len = true;
+            }
+            size_t early = MIN(evbuffer_get_length(in), o->early_data);
+            if (early) {
+                evbuffer *ia = evbuffer_new();
+                evbuffer_remove_buffer(in, ia, early);
+                ssize_t r = evbuffer_filter(ia, out, ^bool (evbuffer_iovec v) {
+                    return !obfoo_decrypt(o, v.iov_base, v.iov_base, v.iov_len);
+                });
+                evbuffer_free(ia);
+                if (r < 0) {
+                    return r;
+                }
+                o->early_data -= early;
+            }
+            if (o->early_data) {
+                return early;
+            }
+        }
+        if (o->crypto_select == OBFOO_AES256_CTR) {
+            o->rx_aes = aes_stream_new(o->rx, o->rx_nonce);
+        }
+        obfoo_issue_ticket(o);
         o->state = OF_STATE_READY;
     }
     case OF_STATE_READY: {
+        if (o->crypto_select == OBFOO_NULL) {
+            return evbuffer_add_buffer(out, in);
+        }
         return evbuffer_filter(in, out, ^bool (evbuffer_iovec v) {
             return !obfoo_decrypt(o, v.iov_base, v.iov_base, v.iov_len);
         });
@@ -234,7 +846,11 @@ ssize_t obfoo_output_filter(evbuffer *in, evbuffer *out, obfoo *o)
     default:
         return 0;
     case OF_STATE_DISCARD:
+    case OF_STATE_EARLY_DATA:
     case OF_STATE_READY: {
+        if (o->crypto_select == OBFOO_NULL) {
+            return evbuffer_add_buffer(out, in);
+        }
         return evbuffer_filter(in, out, ^bool (evbuffer_iovec v) {
             return !obfoo_encrypt(o, v.iov_base, v.iov_base, v.iov_len);
         });
@@ -16,18 +16,56 @@ rx,tx
 
 1 A->B: crypto_kx_PUBLICKEYBYTES, crypto_stream_chacha20_NONCEBYTES, PadA
 2 B->A: crypto_kx_PUBLICKEYBYTES, crypto_stream_chacha20_NONCEBYTES, PadB
-3 A->B: HASH('req1', tx), ENCRYPT(VC, crypto_provide, len(PadC), PadC)
+3 A->B: HASH('req1', tx), ENCRYPT(VC, crypto_provide, len(PadC), PadC, len(IA)), ENCRYPT(IA)
 4 B->A: ENCRYPT(VC, crypto_select, len(padD), padD), ENCRYPT2(Payload Stream)
 5 A->B: ENCRYPT2(Payload Stream)
+
+Resumption: after a session, both sides derive
+secret = h(client_tx ‖ server_tx), ticket = crypto_kx_seed_keypair(h('ticket', secret)).pk
+Next time A sends ticket in place of its public key, and B answers with
+h('ack' ‖ nonceA, secret) in place of its own. Neither does X25519:
+client_tx,server_tx = h('resume' ‖ nonceA ‖ nonceB, secret)
+If B doesn't know the ticket, it treats it as A's public key and answers
+with its own. A holds the ticket's secret key, so the full exchange
+completes without another round trip.
+
+IA is early payload, sent before crypto_select is known, so it uses ENCRYPT().
+ENCRYPT2() is the cipher in crypto_select. OBFOO_AES256_CTR is AES-256 in
+counter mode, keyed with h('aes256ctr', tx), counter block nonce ‖ be64(block).
+
+Peers that predate the other ciphers refuse a crypto_provide other than
+OBFOO_CHACHA20, so it is the only bit sent in the clear field. The rest go
+in an obfoo_ext at the start of PadC, which older peers discard with the pad.
+B answers with one in PadD, which tells A whether B will honour a ticket.
+
+Path validation: once READY, both sides derive
+path_key = h('path' ‖ client_tx ‖ server_tx)
+to answer a challenge to a uTP connection's new address, see network.c.
 */
 
 
 #define crypto_stream_chacha20_BLOCK_LENGTH 64
 
+// crypto_provide / crypto_select bits, the rest are reserved
+#define OBFOO_CHACHA20 0x01
+#define OBFOO_AES256_CTR 0x02
+// payload is not encrypted at all, only for LAN peers
+#define OBFOO_NULL 0x04
+
+#define AES_BLOCK_LENGTH 16
+static_assert(crypto_stream_chacha20_NONCEBYTES + sizeof(uint64_t) == AES_BLOCK_LENGTH, "aes counter block is the stream nonce and block counter");
+
 #define INTRO_BYTES (crypto_kx_PUBLICKEYBYTES + crypto_stream_chacha20_NONCEBYTES)
 static_assert(crypto_stream_chacha20_KEYBYTES <= crypto_kx_SESSIONKEYBYTES, "chacha20 is used as session key");
 
+#define TICKET_BYTES crypto_kx_PUBLICKEYBYTES
+#define OBFOO_PATH_KEY_BYTES crypto_generichash_KEYBYTES
+static_assert(TICKET_BYTES <= crypto_generichash_blake2b_BYTES_MAX, "ticket is a blake2b hash");
+static_assert(2 * crypto_kx_SESSIONKEYBYTES <= crypto_generichash_blake2b_BYTES_MAX, "resumed keys are one blake2b hash");
+
 #define PAD_MAX 256
+// enough for a request line and headers
+#define EARLY_DATA_MAX 8192
 #define INTRO_PAD_MAX ((96 + PAD_MAX) - INTRO_BYTES)
 
 // 2*sizeof(blake2b)
@@ -42,10 +80,34 @@ typedef struct {
     uint8_t pad[];
 } PACKED crypt_intro;
 
+#define OBFOO_EXT_MAGIC "obfooext"
+// the sender keeps resumption tickets, neither side issues one unless both do
+#define OBFOO_EXT_TICKETS 0x01
+
+// leads PadC and PadD when the pad is long enough, a random pad matches the magic with p=2^-64
+typedef struct {
+    uint8_t magic[sizeof(OBFOO_EXT_MAGIC) - 1];
+    uint32_t crypto_provide;
+    uint32_t flags;
+} PACKED obfoo_ext;
+static_assert(sizeof(obfoo_ext) < PAD_MAX, "extension fits in the pad");
+
+// the unused tail of the last keystream block, so a run that starts mid-block
+// doesn't recompute it
+typedef struct {
+    uint8_t block[crypto_stream_chacha20_BLOCK_LENGTH];
+    // block counter + 1, 0 if empty
+    uint64_t ic;
+} keystream;
+
+typedef struct aes_stream aes_stream;
+
 typedef enum {
     OF_STATE_INTRO = 0,
     OF_STATE_SYNC,
+    OF_STATE_EXT,
     OF_STATE_DISCARD,
+    OF_STATE_EARLY_DATA,
     OF_STATE_READY
 } of_state;
 
@@ -54,10 +116,17 @@ typedef struct {
     uint8_t sk[crypto_kx_SECRETKEYBYTES];
     uint8_t rx[crypto_kx_SESSIONKEYBYTES];
     uint8_t tx[crypto_kx_SESSIONKEYBYTES];
+    uint8_t resume_secret[TICKET_BYTES];
     uint8_t rx_nonce[crypto_stream_chacha20_NONCEBYTES];
     uint8_t tx_nonce[crypto_stream_chacha20_NONCEBYTES];
     uint64_t rx_ic_bytes;
     uint64_t tx_ic_bytes;
+    keystream rx_keystream;
+    keystream tx_keystream;
+    aes_stream *rx_aes;
+    aes_stream *tx_aes;
+    uint32_t crypto_provide;
+    uint32_t crypto_select;
     union {
         // incoming
         uint8_t synchash[SYNC_HASH_LEN];
@@ -66,12 +135,25 @@ typedef struct {
     };
     of_state state;
     evbuffer *output;
+    // outgoing: application data that can go out as IA
+    evbuffer *early_input;
+    // outgoing: where the next ticket is filed
+    char *resume_addr;
     uint16_t discarding;
+    uint16_t early_data;
     bool incoming:1;
+    bool early_data_len:1;
+    bool resuming:1;
+    // the other side set OBFOO_EXT_TICKETS
+    bool peer_tickets:1;
 } obfoo;
 
+void obfoo_setup(network *n);
 obfoo* obfoo_new(void);
+void obfoo_resume(obfoo *o, const sockaddr *peer);
 void obfoo_write_intro(obfoo *o, evbuffer *out);
+// false until the session has keys
+bool obfoo_path_key(const obfoo *o, uint8_t *key);
 ssize_t obfoo_input_filter(evbuffer *in, evbuffer *out, obfoo *o);
 ssize_t obfoo_output_filter(evbuffer *in, evbuffer *out, obfoo *o);
 void obfoo_free(obfoo *o);
@@ -1,9 +1,44 @@
 #include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
 
 #include "thread.h"
 
 
+#define THREAD_POOL_MAX 4
+
+typedef struct work_item {
+    work_queue *q;
+    thread_body work;
+    work_done done;
+    bool finished;
+    TAILQ_ENTRY(work_item) next;
+    TAILQ_ENTRY(work_item) pool;
+} work_item;
+
+typedef TAILQ_HEAD(, work_item) work_list;
+
+struct work_queue {
+    // loop thread only
+    work_list items;
+    TAILQ_ENTRY(work_queue) ready;
+    bool is_ready:1;
+    bool draining:1;
+    // under pool_lock
+    bool cancelled;
+};
+
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+work_list pool_pending = TAILQ_HEAD_INITIALIZER(pool_pending);
+work_list pool_completed = TAILQ_HEAD_INITIALIZER(pool_completed);
+event *pool_done_event;
+
+
 void* thread_runner(void *userdata)
 {
     thread_body tb = (thread_body)userdata;
@@ -22,3 +57,135 @@ void thread(thread_body tb)
     }
     pthread_detach(t);
 }
+
+void work_item_free(work_item *w)
+{
+    Block_release(w->work);
+    Block_release(w->done);
+    free(w);
+}
+
+void pool_worker(void)
+{
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (TAILQ_EMPTY(&pool_pending)) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        work_item *w = TAILQ_FIRST(&pool_pending);
+        TAILQ_REMOVE(&pool_pending, w, pool);
+        bool cancelled = w->q->cancelled;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (!cancelled) {
+            w->work();
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        TAILQ_INSERT_TAIL(&pool_completed, w, pool);
+        pthread_mutex_unlock(&pool_lock);
+        event_active(pool_done_event, 0, 0);
+    }
+}
+
+bool work_queue_cancelled(work_queue *q)
+{
+    pthread_mutex_lock(&pool_lock);
+    bool cancelled = q->cancelled;
+    pthread_mutex_unlock(&pool_lock);
+    return cancelled;
+}
+
+void work_queue_drain(work_queue *q)
+{
+    q->draining = true;
+    work_item *w;
+    while ((w = TAILQ_FIRST(&q->items)) && w->finished) {
+        TAILQ_REMOVE(&q->items, w, next);
+        w->done(work_queue_cancelled(q));
+        work_item_free(w);
+    }
+    q->draining = false;
+    if (TAILQ_EMPTY(&q->items) && work_queue_cancelled(q)) {
+        free(q);
+    }
+}
+
+void pool_done_cb(evutil_socket_t fd, short events, void *arg)
+{
+    pthread_mutex_lock(&pool_lock);
+    work_list completed = TAILQ_HEAD_INITIALIZER(completed);
+    TAILQ_CONCAT(&completed, &pool_completed, pool);
+    pthread_mutex_unlock(&pool_lock);
+
+    TAILQ_HEAD(, work_queue) ready_queues = TAILQ_HEAD_INITIALIZER(ready_queues);
+    work_item *w;
+    while ((w = TAILQ_FIRST(&completed))) {
+        TAILQ_REMOVE(&completed, w, pool);
+        w->finished = true;
+        if (!w->q->is_ready) {
+            w->q->is_ready = true;
+            TAILQ_INSERT_TAIL(&ready_queues, w->q, ready);
+        }
+    }
+    // a queue with a finished item can't be freed until it's drained
+    work_queue *q;
+    while ((q = TAILQ_FIRST(&ready_queues))) {
+        TAILQ_REMOVE(&ready_queues, q, ready);
+        q->is_ready = false;
+        work_queue_drain(q);
+    }
+}
+
+void thread_pool_setup(network *n)
+{
+    if (pool_done_event) {
+        return;
+    }
+    pool_done_event = event_new(n->evbase, -1, 0, pool_done_cb, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 1 ? MIN((size_t)cpus - 1, THREAD_POOL_MAX) : 1;
+    for (size_t i = 0; i < workers; i++) {
+        thread(^{
+            pool_worker();
+        });
+    }
+}
+
+work_queue* work_queue_new(void)
+{
+    work_queue *q = alloc(work_queue);
+    TAILQ_INIT(&q->items);
+    return q;
+}
+
+void work_queue_submit(work_queue *q, thread_body work, work_done done)
+{
+    work_item *w = alloc(work_item);
+    w->q = q;
+    w->work = Block_copy(work);
+    w->done = Block_copy(done);
+    TAILQ_INSERT_TAIL(&q->items, w, next);
+    pthread_mutex_lock(&pool_lock);
+    TAILQ_INSERT_TAIL(&pool_pending, w, pool);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+bool work_queue_busy(const work_queue *q)
+{
+    return q && !TAILQ_EMPTY(&q->items);
+}
+
+void work_queue_cancel(work_queue *q)
+{
+    if (!q) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    q->cancelled = true;
+    pthread_mutex_unlock(&pool_lock);
+    if (TAILQ_EMPTY(&q->items) && !q->draining) {
+        free(q);
+    }
+}
@@ -1,7 +1,25 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
 #include <stdbool.h>
 #include <Block.h>
 
+#include "network.h"
+
 
 typedef void (^thread_body)(void);
+// called on the event loop; cancelled means the owner is gone, only free what the job owns
+typedef void (^work_done)(bool cancelled);
+
+typedef struct work_queue work_queue;
 
 void thread(thread_body tb);
+
+void thread_pool_setup(network *n);
+// work runs on a pool thread, done runs on the event loop in submission order
+work_queue* work_queue_new(void);
+void work_queue_submit(work_queue *q, thread_body work, work_done done);
+bool work_queue_busy(const work_queue *q);
+void work_queue_cancel(work_queue *q);
+
+#endif // __THREAD_H__
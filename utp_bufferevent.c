@@ -14,8 +14,14 @@
 
 // utp_read > decrypt > bev_output > other_fd_recv
 // other_fd_send > bev_input > encrypt > utp_write
+//
+// utp_socket_create_fdless_bev uses a bufferevent_pair instead of a
+// socketpair, and gives the caller a pass-through filter over the other half
+// so we can tell when it is freed. no fds or kernel copies are involved.
 
 
+#define UTP_WRITEV_MAX 64
+
 typedef struct {
     utp_socket *utp;
     evbuffer *utp_input;
@@ -25,12 +31,14 @@ typedef struct {
     bufferevent *other_bev;
     bool bev_eof:1;
     bool utp_eof:1;
+    bool fdless:1;
+    bool app_open:1;
 } utp_bufferevent;
 
 
 void ubev_cleanup(utp_bufferevent *u)
 {
-    if (u->utp || u->bev) {
+    if (u->utp || u->bev || u->app_open) {
         return;
     }
     free(u);
@@ -63,6 +71,10 @@ void ubev_bev_close(utp_bufferevent *u)
     u->obfoo = NULL;
     evbuffer_free(u->utp_output);
     u->utp_output = NULL;
+    if (u->fdless) {
+        // freeing one half of a pair doesn't tell the other half
+        bufferevent_flush(u->bev, EV_WRITE, BEV_FINISHED);
+    }
     bufferevent_free_checked(u->bev);
     u->bev = NULL;
 }
@@ -104,12 +116,20 @@ void utp_bufferevent_flush(utp_bufferevent *u)
 {
     evbuffer *in = u->utp_output;
     while (evbuffer_get_length(in)) {
-        // the libutp interface for write is Very Broken.
-        ssize_t len = MIN(1500, evbuffer_get_length(in));
-        unsigned char *buf = evbuffer_pullup(in, len);
-        ssize_t r = utp_write(u->utp, buf, len);
+        // hand the chains to libutp as they are; it packetizes as far as the send window allows
+        evbuffer_iovec v[UTP_WRITEV_MAX];
+        int n = evbuffer_peek(in, -1, NULL, v, lenof(v));
+        n = MIN(n, (int)lenof(v));
+        struct utp_iovec iov[UTP_WRITEV_MAX];
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = v[i].iov_base;
+            iov[i].iov_len = v[i].iov_len;
+            len += v[i].iov_len;
+        }
+        ssize_t r = utp_writev(u->utp, iov, n);
         if (r < 0) {
-            fprintf(stderr, "utp_write failed\n");
+            fprintf(stderr, "utp_writev failed\n");
             ubev_utp_close(u);
             ubev_bev_graceful_close(u);
             return;
@@ -118,6 +138,10 @@ void utp_bufferevent_flush(utp_bufferevent *u)
             break;
         }
         evbuffer_drain(in, r);
+        if ((size_t)r < len) {
+            // window is full, UTP_STATE_WRITABLE will call us again
+            break;
+        }
     }
 }
 
@@ -162,6 +186,10 @@ void ubev_bev_stop_writing(utp_bufferevent *u)
     if (ubev_check_close(u)) {
         return;
     }
+    if (u->fdless) {
+        bufferevent_flush(u->bev, EV_WRITE, BEV_FINISHED);
+        return;
+    }
     shutdown(bufferevent_getfd(u->bev), SHUT_WR);
 }
 
@@ -267,12 +295,39 @@ void ubev_event_cb(bufferevent *bev, short events, void *ctx)
     ubev_check_close(u);
 }
 
-utp_bufferevent* utp_bufferevent_new(event_base *base, utp_socket *s, int fd)
+void ubev_pair_event_cb(bufferevent *bev, short events, void *ctx)
+{
+    utp_bufferevent* u = (utp_bufferevent*)ctx;
+    if (events & BEV_EVENT_EOF) {
+        // a socket bufferevent stops reading on EOF, a pair does not
+        ubev_read_cb(bev, u);
+        bufferevent_disable(bev, EV_READ);
+    }
+    ubev_event_cb(bev, events, ctx);
+}
+
+void ubev_app_free_cb(void *ctx)
+{
+    utp_bufferevent* u = (utp_bufferevent*)ctx;
+    u->app_open = false;
+    if (!u->bev) {
+        ubev_cleanup(u);
+        return;
+    }
+    // same as the other end of a socketpair being closed
+    if (u->utp) {
+        ubev_read_cb(u->bev, u);
+    }
+    bufferevent_disable(u->bev, EV_READ|EV_WRITE);
+    ubev_event_cb(u->bev, BEV_EVENT_EOF|BEV_EVENT_READING, u);
+}
+
+utp_bufferevent* utp_bufferevent_new(event_base *base, utp_socket *s, bufferevent *bev)
 {
     utp_bufferevent *u = alloc(utp_bufferevent);
     u->utp = s;
     utp_set_userdata(s, u);
-    u->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    u->bev = bev;
     if (!u->bev) {
         ubev_utp_close(u);
         ubev_cleanup(u);
@@ -288,7 +343,7 @@ utp_bufferevent* utp_bufferevent_new(event_base *base, utp_socket *s, int fd)
     return u;
 }
 
-int utp_socket_create_fd(event_base *base, utp_socket *s)
+int utp_socket_create_fd(event_base *base, utp_socket *s, uint32_t crypto_provide)
 {
     int fds[2];
     int r = socketpair(PF_LOCAL, SOCK_STREAM, 0, fds);
@@ -297,16 +352,28 @@ int utp_socket_create_fd(event_base *base, utp_socket *s)
     }
     evutil_make_socket_closeonexec(fds[0]);
     evutil_make_socket_nonblocking(fds[0]);
-    utp_bufferevent *u = utp_bufferevent_new(base, s, fds[0]);
+    utp_bufferevent *u = utp_bufferevent_new(base, s, bufferevent_socket_new(base, fds[0], BEV_OPT_CLOSE_ON_FREE));
     if (!u) {
         close(fds[0]);
         close(fds[1]);
         return -1;
     }
+    u->obfoo->crypto_provide = crypto_provide;
     return fds[1];
 }
 
-bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s)
+void ubev_start_outgoing(utp_bufferevent *u, const sockaddr *peer, uint32_t crypto_provide)
+{
+    // held until the connection is up, to tell the app
+    bufferevent_incref(u->other_bev);
+    u->obfoo->incoming = false;
+    u->obfoo->crypto_provide = crypto_provide;
+    u->obfoo->early_input = bufferevent_get_input(u->bev);
+    obfoo_resume(u->obfoo, peer);
+    obfoo_write_intro(u->obfoo, u->obfoo->output);
+}
+
+bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s, const sockaddr *peer, uint32_t crypto_provide)
 {
     int fds[2];
     int r = socketpair(PF_LOCAL, SOCK_STREAM, 0, fds);
@@ -315,7 +382,7 @@ bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s)
     }
     evutil_make_socket_closeonexec(fds[0]);
     evutil_make_socket_nonblocking(fds[0]);
-    utp_bufferevent *u = utp_bufferevent_new(base, s, fds[0]);
+    utp_bufferevent *u = utp_bufferevent_new(base, s, bufferevent_socket_new(base, fds[0], BEV_OPT_CLOSE_ON_FREE));
     if (!u) {
         close(fds[0]);
         close(fds[1]);
@@ -324,15 +391,48 @@ bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s)
     evutil_make_socket_closeonexec(fds[1]);
     evutil_make_socket_nonblocking(fds[1]);
     u->other_bev = bufferevent_socket_new(base, fds[1], BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_incref(u->other_bev);
-    u->obfoo->incoming = false;
-    obfoo_write_intro(u->obfoo, u->obfoo->output);
+    ubev_start_outgoing(u, peer, crypto_provide);
+    return u->other_bev;
+}
+
+bufferevent* utp_socket_create_fdless_bev(event_base *base, utp_socket *s, const sockaddr *peer, uint32_t crypto_provide)
+{
+    bufferevent *pair[2];
+    if (bufferevent_pair_new(base, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS, pair)) {
+        return NULL;
+    }
+    utp_bufferevent *u = utp_bufferevent_new(base, s, pair[0]);
+    if (!u) {
+        bufferevent_free(pair[1]);
+        return NULL;
+    }
+    u->fdless = true;
+    bufferevent_setcb(u->bev, ubev_read_cb, ubev_write_cb, ubev_pair_event_cb, u);
+    u->other_bev = bufferevent_filter_new(pair[1], NULL, NULL, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS, ubev_app_free_cb, u);
+    if (!u->other_bev) {
+        bufferevent_free(pair[1]);
+        ubev_utp_close(u);
+        ubev_bev_close(u);
+        ubev_cleanup(u);
+        return NULL;
+    }
+    u->app_open = true;
+    ubev_start_outgoing(u, peer, crypto_provide);
     return u->other_bev;
 }
 
+obfoo* utp_socket_obfoo(utp_socket *s)
+{
+    utp_bufferevent *u = (utp_bufferevent*)utp_get_userdata(s);
+    return u ? u->obfoo : NULL;
+}
+
 void utp_connect_tcp(event_base *base, utp_socket *s, const sockaddr *address, socklen_t address_len)
 {
-    utp_bufferevent *u = utp_bufferevent_new(base, s, -1);
+    utp_bufferevent *u = utp_bufferevent_new(base, s, bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE));
+    if (!u) {
+        return;
+    }
     if (bufferevent_socket_connect(u->bev, address, address_len) < 0) {
         bufferevent_free(u->bev);
         u->bev = NULL;
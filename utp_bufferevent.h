@@ -2,14 +2,18 @@
 #define __UTP_BUFFEREVENT_H__
 
 #include "network.h"
-
+#include "obfoo.h"
 
 uint64 utp_on_error(utp_callback_arguments *a);
 uint64 utp_on_read(utp_callback_arguments *a);
 uint64 utp_on_state_change(utp_callback_arguments *a);
 
-int utp_socket_create_fd(event_base *base, utp_socket *s);
-bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s);
+int utp_socket_create_fd(event_base *base, utp_socket *s, uint32_t crypto_provide);
+bufferevent* utp_socket_create_bev(event_base *base, utp_socket *s, const sockaddr *peer, uint32_t crypto_provide);
+// no fds, but no socket either: for callers that only use the bufferevent, not evhttp
+bufferevent* utp_socket_create_fdless_bev(event_base *base, utp_socket *s, const sockaddr *peer, uint32_t crypto_provide);
+// the session on a uTP socket, NULL once the app side is gone
+obfoo* utp_socket_obfoo(utp_socket *s);
 void utp_connect_tcp(event_base *base, utp_socket *s, const sockaddr *address, socklen_t address_len);
 
 #endif // __UTP_BUFFEREVENT_H__